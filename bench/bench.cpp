@@ -0,0 +1,630 @@
+/**
+ * @file
+ * @brief Measures the throughput of reading, decoding and exporting.
+ *
+ * Synthetic GDF2, EDF and MAT files are generated first; then every format is
+ * opened, its events loaded, and its signal read in several patterns. The
+ * results are printed to stdout as JSON, the progress to stderr. Run with
+ * --help for the options.
+ *
+ * The files are read right after they are written, so the numbers describe
+ * reading from the OS page cache, i.e. the decoding and copying done by the
+ * library.
+ */
+
+#include <AlenkaFile/datamodel.h>
+#include <AlenkaFile/edf.h>
+#include <AlenkaFile/gdf2.h>
+#include <AlenkaFile/mat.h>
+
+#include <matio.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+struct Config
+{
+	int channels = 64;
+	int samplingFrequency = 1000;
+	int seconds = 600;
+	string type = "int16";
+	int window = 0; // samples; 0 means 10 seconds
+	int randomReads = 200;
+	int events = 10000;
+	int subsetStep = 8;
+	vector<string> formats{"gdf2", "edf", "mat"};
+	string directory;
+	bool keepFiles = false;
+	unsigned int seed = 1;
+};
+
+struct SampleFormat
+{
+	string name;
+	int gdfType;
+	int size;
+	double digitalMinimum, digitalMaximum, physicalMinimum, physicalMaximum;
+	matio_classes matClass;
+	matio_types matType;
+};
+
+const SampleFormat SAMPLE_FORMATS[] = {
+	{"int16", 3, 2, -32768, 32767, -3276.8, 3276.7, MAT_C_INT16, MAT_T_INT16},
+	{"int32", 5, 4, -2147483648., 2147483647., -2147483.648, 2147483.647, MAT_C_INT32, MAT_T_INT32},
+	{"float32", 16, 4, -1000, 1000, -1000, 1000, MAT_C_SINGLE, MAT_T_SINGLE},
+	{"float64", 17, 8, -1000, 1000, -1000, 1000, MAT_C_DOUBLE, MAT_T_DOUBLE},
+};
+
+struct Result
+{
+	string format;
+	string benchmark;
+	double seconds = 0;
+	uint64_t samples = 0; ///< Channel-samples produced (or consumed by exports).
+	uint64_t bytes = 0; ///< Bytes of samples produced (or written by exports).
+	uint64_t events = 0; ///< Events loaded.
+	vector<double> latencies; ///< Seconds per operation, if the benchmark has such operations.
+};
+
+const double PI = 3.14159265358979323846;
+
+typedef chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start)
+{
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+void printUsage()
+{
+	cerr << "Usage: bench [options]\n"
+		"  --channels N        number of channels (64)\n"
+		"  --fs N              sampling frequency in Hz (1000)\n"
+		"  --seconds N         length of the signal (600)\n"
+		"  --type T            GDF2 and MAT sample type: int16, int32, float32 or float64 (int16)\n"
+		"  --window N          samples per read (10 seconds)\n"
+		"  --random-reads N    number of random windowed reads (200)\n"
+		"  --events N          number of events in the GDF2 and EDF files (10000)\n"
+		"  --subset-step N     the channel subset reads every N-th channel (8)\n"
+		"  --formats LIST      comma separated list of gdf2, edf and mat (gdf2,edf,mat)\n"
+		"  --dir PATH          where to put the generated files (a temporary directory)\n"
+		"  --keep              don't delete the generated files\n"
+		"  --seed N            seed of the generated data and read positions (1)\n";
+}
+
+Config parseArguments(int argc, char** argv)
+{
+	Config config;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		string option = argv[i];
+
+		if (option == "--help" || option == "-h")
+		{
+			printUsage();
+			exit(EXIT_SUCCESS);
+		}
+		if (option == "--keep")
+		{
+			config.keepFiles = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			throw invalid_argument("Missing value of option " + option);
+
+		string value = argv[++i];
+
+		if (option == "--channels")
+			config.channels = stoi(value);
+		else if (option == "--fs")
+			config.samplingFrequency = stoi(value);
+		else if (option == "--seconds")
+			config.seconds = stoi(value);
+		else if (option == "--type")
+			config.type = value;
+		else if (option == "--window")
+			config.window = stoi(value);
+		else if (option == "--random-reads")
+			config.randomReads = stoi(value);
+		else if (option == "--events")
+			config.events = stoi(value);
+		else if (option == "--subset-step")
+			config.subsetStep = stoi(value);
+		else if (option == "--dir")
+			config.directory = value;
+		else if (option == "--seed")
+			config.seed = static_cast<unsigned int>(stoul(value));
+		else if (option == "--formats")
+		{
+			config.formats.clear();
+			stringstream ss(value);
+			string format;
+
+			while (getline(ss, format, ','))
+				config.formats.push_back(format);
+		}
+		else
+		{
+			throw invalid_argument("Unknown option " + option);
+		}
+	}
+
+	if (config.channels < 1 || config.samplingFrequency < 1 || config.seconds < 1 || config.randomReads < 1 || config.events < 0 || config.subsetStep < 1)
+		throw invalid_argument("The numeric options must be positive");
+
+	if (config.window <= 0)
+		config.window = 10*config.samplingFrequency;
+
+	return config;
+}
+
+const SampleFormat& findSampleFormat(const string& name)
+{
+	for (const SampleFormat& e : SAMPLE_FORMATS)
+	{
+		if (e.name == name)
+			return e;
+	}
+
+	throw invalid_argument("Unknown sample type " + name);
+}
+
+bool hasFormat(const Config& config, const string& format)
+{
+	return find(config.formats.begin(), config.formats.end(), format) != config.formats.end();
+}
+
+template<typename T>
+void put(vector<char>& buffer, size_t offset, T value)
+{
+	if (!DataFile::testLittleEndian())
+		DataFile::changeEndianness(&value);
+	memcpy(buffer.data() + offset, &value, sizeof(T));
+}
+
+/**
+ * @brief Writes a GDF 2.51 file with sinusoids plus noise and an event table.
+ */
+void writeGdf(const string& filePath, const Config& config, const SampleFormat& format)
+{
+	const int ns = config.channels;
+	const int fs = config.samplingFrequency;
+
+	vector<char> header(256*(1 + ns), 0);
+	memcpy(header.data(), "GDF 2.51", 8);
+	memcpy(header.data() + 8, "X", 1);
+	put<uint32_t>(header, 168, 0); // start date: fraction of day
+	put<uint32_t>(header, 172, 737000); // start date: days
+	put<uint16_t>(header, 184, static_cast<uint16_t>(1 + ns));
+	put<int64_t>(header, 236, config.seconds);
+	put<double>(header, 244, 1);
+	put<uint16_t>(header, 252, static_cast<uint16_t>(ns));
+
+	for (int i = 0; i < ns; ++i)
+	{
+		string label = "ch" + to_string(i);
+		memcpy(header.data() + 256 + 16*i, label.data(), min<size_t>(label.size(), 16));
+	}
+
+	size_t offset = 256 + (16 + 80 + 6 + 2)*ns;
+	for (double value : {format.physicalMinimum, format.physicalMaximum, format.digitalMinimum, format.digitalMaximum})
+	{
+		for (int i = 0; i < ns; ++i, offset += 8)
+			put<double>(header, offset, value);
+	}
+
+	offset += (64 + 16)*ns;
+	for (int i = 0; i < ns; ++i)
+	{
+		put<uint32_t>(header, offset + 4*i, fs);
+		put<uint32_t>(header, offset + 4*(ns + i), format.gdfType);
+	}
+
+	ofstream file(filePath, ios_base::binary | ios_base::trunc);
+	file.write(header.data(), header.size());
+
+	// Every record holds one second of every channel.
+	mt19937 generator(config.seed);
+	normal_distribution<double> noise(0, 0.05);
+	double amplitude = 0.4*(format.digitalMaximum - format.digitalMinimum);
+	vector<char> record(static_cast<size_t>(ns)*fs*format.size);
+
+	for (int r = 0; r < config.seconds; ++r)
+	{
+		for (int i = 0; i < ns; ++i)
+		{
+			double frequency = 1 + i%30;
+
+			for (int j = 0; j < fs; ++j)
+			{
+				double t = r + static_cast<double>(j)/fs;
+				double value = amplitude*(0.8*sin(2*PI*frequency*t + i) + noise(generator));
+				value = max(format.digitalMinimum, min(format.digitalMaximum, value));
+				size_t position = (static_cast<size_t>(i)*fs + j)*format.size;
+
+				switch (format.gdfType)
+				{
+				case 3: put<int16_t>(record, position, static_cast<int16_t>(lround(value))); break;
+				case 5: put<int32_t>(record, position, static_cast<int32_t>(llround(value))); break;
+				case 16: put<float>(record, position, static_cast<float>(value)); break;
+				default: put<double>(record, position, value); break;
+				}
+			}
+		}
+
+		file.write(record.data(), record.size());
+	}
+
+	// Write a mode 3 event table.
+	uint64_t samples = static_cast<uint64_t>(config.seconds)*fs;
+	uniform_int_distribution<uint64_t> position(0, samples - 1);
+	uniform_int_distribution<int> type(1, 5), channel(0, ns), duration(0, fs);
+
+	vector<uint32_t> positions(config.events);
+	for (uint32_t& e : positions)
+		e = static_cast<uint32_t>(position(generator) + 1);
+	sort(positions.begin(), positions.end());
+
+	vector<char> table(8 + 12*config.events, 0);
+	table[0] = 3;
+	table[1] = static_cast<char>(config.events & 0xFF);
+	table[2] = static_cast<char>(config.events >> 8 & 0xFF);
+	table[3] = static_cast<char>(config.events >> 16 & 0xFF);
+	put<float>(table, 4, static_cast<float>(fs));
+
+	for (int i = 0; i < config.events; ++i)
+	{
+		put<uint32_t>(table, 8 + 4*i, positions[i]);
+		put<uint16_t>(table, 8 + 4*config.events + 2*i, static_cast<uint16_t>(type(generator)));
+		put<uint16_t>(table, 8 + 6*config.events + 2*i, static_cast<uint16_t>(channel(generator)));
+		put<uint32_t>(table, 8 + 8*config.events + 4*i, static_cast<uint32_t>(duration(generator)));
+	}
+
+	file.write(table.data(), table.size());
+
+	if (!file)
+		throw runtime_error("Error writing " + filePath);
+}
+
+/**
+ * @brief Writes the signal of the GDF2 file as a MAT 5 file.
+ *
+ * The integer types are stored as the raw digital values with the multipliers
+ * in 'mults'. matio writes whole variables, so the signal is held in memory.
+ */
+void writeMat(const string& filePath, const string& gdfPath, const SampleFormat& format)
+{
+	GDF2 source(gdfPath, format.matClass != MAT_C_SINGLE && format.matClass != MAT_C_DOUBLE);
+	const uint64_t samples = source.getSamplesRecorded();
+	const unsigned int channels = source.getChannelCount();
+
+	vector<char> data(samples*channels*format.size);
+	vector<double> block;
+	const uint64_t blockSamples = 1 << 16;
+
+	for (uint64_t first = 0; first < samples; first += blockSamples)
+	{
+		uint64_t n = min(blockSamples, samples - first);
+		block.resize(n*channels);
+		source.readSignal(block.data(), first, first + n - 1);
+
+		for (unsigned int i = 0; i < channels; ++i)
+		{
+			for (uint64_t j = 0; j < n; ++j)
+			{
+				double value = block[i*n + j];
+				char* out = data.data() + (i*samples + first + j)*format.size;
+
+				switch (format.matClass)
+				{
+				case MAT_C_INT16: { int16_t v = static_cast<int16_t>(value); memcpy(out, &v, 2); break; }
+				case MAT_C_INT32: { int32_t v = static_cast<int32_t>(value); memcpy(out, &v, 4); break; }
+				case MAT_C_SINGLE: { float v = static_cast<float>(value); memcpy(out, &v, 4); break; }
+				default: memcpy(out, &value, 8); break;
+				}
+			}
+		}
+	}
+
+	mat_t* file = Mat_CreateVer(filePath.c_str(), nullptr, MAT_FT_MAT5);
+
+	if (!file)
+		throw runtime_error("Unable to create " + filePath);
+
+	int res = 0;
+
+	size_t dataDims[2] = {static_cast<size_t>(samples), channels};
+	matvar_t* var = Mat_VarCreate("d", format.matClass, format.matType, 2, dataDims, data.data(), MAT_F_DONT_COPY_DATA);
+	res |= Mat_VarWrite(file, var, MAT_COMPRESSION_NONE);
+	Mat_VarFree(var);
+
+	double fs = source.getSamplingFrequency();
+	size_t scalarDims[2] = {1, 1};
+	var = Mat_VarCreate("fs", MAT_C_DOUBLE, MAT_T_DOUBLE, 2, scalarDims, &fs, MAT_F_DONT_COPY_DATA);
+	res |= Mat_VarWrite(file, var, MAT_COMPRESSION_NONE);
+	Mat_VarFree(var);
+
+	vector<double> mults(channels, (format.physicalMaximum - format.physicalMinimum)/(format.digitalMaximum - format.digitalMinimum));
+	size_t multsDims[2] = {1, channels};
+	var = Mat_VarCreate("mults", MAT_C_DOUBLE, MAT_T_DOUBLE, 2, multsDims, mults.data(), MAT_F_DONT_COPY_DATA);
+	res |= Mat_VarWrite(file, var, MAT_COMPRESSION_NONE);
+	Mat_VarFree(var);
+
+	Mat_Close(file);
+
+	if (res != 0)
+		throw runtime_error("Error writing " + filePath);
+}
+
+template<typename T>
+Result sequentialRead(DataFile* file, const Config& config, const string& benchmark)
+{
+	const uint64_t samples = file->getSamplesRecorded();
+	const unsigned int channels = file->getChannelCount();
+	vector<T> buffer(static_cast<size_t>(config.window)*channels);
+
+	Result result;
+	result.benchmark = benchmark;
+	Clock::time_point start = Clock::now();
+
+	for (uint64_t first = 0; first < samples; first += config.window)
+	{
+		uint64_t last = min<uint64_t>(first + config.window, samples) - 1;
+		file->readSignal(buffer.data(), first, last);
+		result.samples += (last - first + 1)*channels;
+	}
+
+	result.seconds = secondsSince(start);
+	result.bytes = result.samples*sizeof(T);
+	return result;
+}
+
+Result randomRead(DataFile* file, const Config& config, const string& benchmark, const vector<unsigned int>* channels)
+{
+	const uint64_t samples = file->getSamplesRecorded();
+	const unsigned int channelCount = channels ? static_cast<unsigned int>(channels->size()) : file->getChannelCount();
+	const uint64_t window = min<uint64_t>(config.window, samples);
+	vector<float> buffer(window*channelCount);
+
+	mt19937 generator(config.seed);
+	uniform_int_distribution<uint64_t> position(0, samples - window);
+
+	Result result;
+	result.benchmark = benchmark;
+	Clock::time_point start = Clock::now();
+
+	for (int i = 0; i < config.randomReads; ++i)
+	{
+		uint64_t first = position(generator);
+		Clock::time_point readStart = Clock::now();
+
+		if (channels)
+			file->readSignal(buffer.data(), *channels, first, first + window - 1);
+		else
+			file->readSignal(buffer.data(), first, first + window - 1);
+
+		result.latencies.push_back(secondsSince(readStart));
+		result.samples += window*channelCount;
+	}
+
+	result.seconds = secondsSince(start);
+	result.bytes = result.samples*sizeof(float);
+	return result;
+}
+
+/**
+ * @brief Opens the file, loads its events and runs all the read benchmarks.
+ */
+template<class T>
+void benchmarkFormat(const string& format, const string& filePath, const Config& config, vector<Result>* results)
+{
+	cerr << "Reading " << format << endl;
+
+	vector<Result> formatResults;
+
+	Result open;
+	open.benchmark = "open";
+	Clock::time_point start = Clock::now();
+	unique_ptr<T> file(new T(filePath));
+	open.seconds = secondsSince(start);
+	formatResults.push_back(open);
+
+	DataModel dataModel(new EventTypeTable(), new MontageTable());
+	file->setDataModel(&dataModel);
+
+	Result load;
+	load.benchmark = "load_events";
+	start = Clock::now();
+	file->load();
+	load.seconds = secondsSince(start);
+	load.events = dataModel.montageTable()->eventTable(0)->rowCount();
+	formatResults.push_back(load);
+
+	formatResults.push_back(sequentialRead<float>(file.get(), config, "sequential_float"));
+	formatResults.push_back(sequentialRead<double>(file.get(), config, "sequential_double"));
+	formatResults.push_back(randomRead(file.get(), config, "random_window", nullptr));
+
+	vector<unsigned int> subset;
+	for (unsigned int i = 0; i < file->getChannelCount(); i += config.subsetStep)
+		subset.push_back(i);
+
+	formatResults.push_back(randomRead(file.get(), config, "channel_subset", &subset));
+
+	for (Result& e : formatResults)
+	{
+		e.format = format;
+		results->push_back(e);
+	}
+}
+
+double percentile(vector<double> values, double p)
+{
+	sort(values.begin(), values.end());
+	size_t index = static_cast<size_t>(ceil(p*values.size())) - 1;
+	return values[min(index, values.size() - 1)];
+}
+
+void printJson(ostream& out, const Config& config, const vector<pair<string, uint64_t>>& files, const vector<Result>& results)
+{
+	out << fixed << setprecision(6);
+	out << "{\n";
+	out << "  \"config\": {\"channels\": " << config.channels << ", \"sampling_frequency\": " << config.samplingFrequency
+		<< ", \"seconds\": " << config.seconds << ", \"type\": \"" << config.type << "\", \"window\": " << config.window
+		<< ", \"random_reads\": " << config.randomReads << ", \"events\": " << config.events
+		<< ", \"subset_step\": " << config.subsetStep << ", \"seed\": " << config.seed << "},\n";
+
+	out << "  \"files\": {";
+	for (size_t i = 0; i < files.size(); ++i)
+		out << (i ? ", " : "") << "\"" << files[i].first << "\": " << files[i].second;
+	out << "},\n";
+
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Result& e = results[i];
+
+		out << "    {\"format\": \"" << e.format << "\", \"benchmark\": \"" << e.benchmark << "\", \"seconds\": " << e.seconds;
+
+		if (e.events > 0)
+			out << ", \"events\": " << e.events;
+
+		if (e.samples > 0 && e.seconds > 0)
+		{
+			out << ", \"samples\": " << e.samples << ", \"samples_per_s\": " << e.samples/e.seconds;
+			if (e.bytes > 0)
+				out << ", \"bytes\": " << e.bytes << ", \"mb_per_s\": " << e.bytes/e.seconds/1e6;
+		}
+
+		if (!e.latencies.empty())
+		{
+			double sum = 0;
+			for (double l : e.latencies)
+				sum += l;
+
+			out << ", \"latency_ms\": {\"mean\": " << 1000*sum/e.latencies.size() << ", \"p50\": " << 1000*percentile(e.latencies, 0.5)
+				<< ", \"p90\": " << 1000*percentile(e.latencies, 0.9) << ", \"p99\": " << 1000*percentile(e.latencies, 0.99)
+				<< ", \"max\": " << 1000*percentile(e.latencies, 1) << "}";
+		}
+
+		out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+int run(const Config& config)
+{
+	using namespace boost::filesystem;
+
+	const SampleFormat& format = findSampleFormat(config.type);
+
+	path directory = config.directory.empty() ? temp_directory_path()/unique_path("alenka-bench-%%%%-%%%%") : path(config.directory);
+	create_directories(directory);
+
+	const string gdfPath = (directory/"bench.gdf").string();
+	const string edfPath = (directory/"bench.edf").string();
+	const string matPath = (directory/"bench.mat").string();
+
+	vector<Result> results;
+	vector<pair<string, uint64_t>> files;
+
+	// The GDF2 file is the source of the others, so it is always generated.
+	cerr << "Writing " << gdfPath << endl;
+	writeGdf(gdfPath, config, format);
+	files.emplace_back("gdf2", file_size(gdfPath));
+
+	if (hasFormat(config, "edf"))
+	{
+		cerr << "Writing " << edfPath << endl;
+
+		GDF2 source(gdfPath);
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		source.setDataModel(&dataModel);
+		source.load();
+
+		Montage montage = dataModel.montageTable()->row(0);
+		montage.save = true;
+		dataModel.montageTable()->row(0, montage);
+
+		Result result;
+		result.format = "edf";
+		result.benchmark = "save_as";
+		Clock::time_point start = Clock::now();
+		EDF::saveAs(edfPath, &source);
+		result.seconds = secondsSince(start);
+		result.samples = source.getSamplesRecorded()*source.getChannelCount();
+		result.bytes = file_size(edfPath);
+		results.push_back(result);
+
+		files.emplace_back("edf", result.bytes);
+	}
+
+	if (hasFormat(config, "mat"))
+	{
+		cerr << "Writing " << matPath << endl;
+		writeMat(matPath, gdfPath, format);
+		files.emplace_back("mat", file_size(matPath));
+	}
+
+	if (hasFormat(config, "gdf2"))
+		benchmarkFormat<GDF2>("gdf2", gdfPath, config, &results);
+	if (hasFormat(config, "edf"))
+		benchmarkFormat<EDF>("edf", edfPath, config, &results);
+	if (hasFormat(config, "mat"))
+		benchmarkFormat<MAT>("mat", matPath, config, &results);
+
+	printJson(cout, config, files, results);
+
+	if (!config.keepFiles)
+	{
+		if (config.directory.empty())
+		{
+			remove_all(directory);
+		}
+		else
+		{
+			for (const string& e : {gdfPath, edfPath, matPath})
+				remove(e);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		return run(parseArguments(argc, argv));
+	}
+	catch (exception& e)
+	{
+		cerr << "Error: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+}
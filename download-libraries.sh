@@ -5,14 +5,6 @@
 # This script downloads all dependant libraries.
 # Use Git Bash or a similar tool to run this on Windows.
 
-if [ -d EDFlib ]
-then
-	EDFlib=skipped
-else
-	git clone --depth 1 https://github.com/Teuniz/EDFlib.git &&
-	EDFlib=OK || EDFlib=fail
-fi
-
 if [ -d pugixml ]
 then
 	pugixml=skipped
@@ -68,7 +60,6 @@ echo
 echo ========== Download summary ==========
 echo "Library path            Status"
 echo ======================================
-echo "EDFlib                  $EDFlib"
 echo "pugixml                 $pugixml"
 echo "unit-test/googletest    $googletest"
 echo "boost                   $boost"
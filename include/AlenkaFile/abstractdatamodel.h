@@ -3,6 +3,7 @@
 
 #include <string>
 #include <cstdio>
+#include <utility>
 
 namespace AlenkaFile
 {
@@ -31,6 +32,37 @@ public:
 	virtual EventType row(int i) const = 0;
 	virtual void row(int i, const EventType& value) = 0;
 	virtual EventType defaultValue(int row) const = 0;
+
+	// The rest are built on the functions above. The subclasses should
+	// override them with something that doesn't copy row by row.
+	virtual void row(int i, EventType&& value)
+	{
+		row(i, static_cast<const EventType&>(value));
+	}
+	/**
+	 * @brief Inserts count rows at row and moves values[0, count) into them.
+	 */
+	virtual void insertRows(int row, int count, EventType* values)
+	{
+		insertRows(row, count);
+		setRows(row, count, values);
+	}
+	/**
+	 * @brief Copies the rows [i, i + count) to values.
+	 */
+	virtual void getRows(int i, int count, EventType* values) const
+	{
+		for (int j = 0; j < count; ++j)
+			values[j] = row(i + j);
+	}
+	/**
+	 * @brief Moves values[0, count) into the rows [i, i + count).
+	 */
+	virtual void setRows(int i, int count, EventType* values)
+	{
+		for (int j = 0; j < count; ++j)
+			row(i + j, std::move(values[j]));
+	}
 };
 
 struct Event
@@ -58,6 +90,37 @@ public:
 	virtual Event row(int i) const = 0;
 	virtual void row(int i, const Event& value) = 0;
 	virtual Event defaultValue(int row) const = 0;
+
+	// The rest are built on the functions above. The subclasses should
+	// override them with something that doesn't copy row by row.
+	virtual void row(int i, Event&& value)
+	{
+		row(i, static_cast<const Event&>(value));
+	}
+	/**
+	 * @brief Inserts count rows at row and moves values[0, count) into them.
+	 */
+	virtual void insertRows(int row, int count, Event* values)
+	{
+		insertRows(row, count);
+		setRows(row, count, values);
+	}
+	/**
+	 * @brief Copies the rows [i, i + count) to values.
+	 */
+	virtual void getRows(int i, int count, Event* values) const
+	{
+		for (int j = 0; j < count; ++j)
+			values[j] = row(i + j);
+	}
+	/**
+	 * @brief Moves values[0, count) into the rows [i, i + count).
+	 */
+	virtual void setRows(int i, int count, Event* values)
+	{
+		for (int j = 0; j < count; ++j)
+			row(i + j, std::move(values[j]));
+	}
 };
 
 struct Track
@@ -84,6 +147,37 @@ public:
 	virtual Track row(int i) const = 0;
 	virtual void row(int i, const Track& value) = 0;
 	virtual Track defaultValue(int row) const = 0;
+
+	// The rest are built on the functions above. The subclasses should
+	// override them with something that doesn't copy row by row.
+	virtual void row(int i, Track&& value)
+	{
+		row(i, static_cast<const Track&>(value));
+	}
+	/**
+	 * @brief Inserts count rows at row and moves values[0, count) into them.
+	 */
+	virtual void insertRows(int row, int count, Track* values)
+	{
+		insertRows(row, count);
+		setRows(row, count, values);
+	}
+	/**
+	 * @brief Copies the rows [i, i + count) to values.
+	 */
+	virtual void getRows(int i, int count, Track* values) const
+	{
+		for (int j = 0; j < count; ++j)
+			values[j] = row(i + j);
+	}
+	/**
+	 * @brief Moves values[0, count) into the rows [i, i + count).
+	 */
+	virtual void setRows(int i, int count, Track* values)
+	{
+		for (int j = 0; j < count; ++j)
+			row(i + j, std::move(values[j]));
+	}
 };
 
 struct Montage
@@ -4,7 +4,15 @@
 #include "abstractdatamodel.h"
 
 #include <cstdint>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 #include <cassert>
 
@@ -13,6 +21,58 @@
 namespace AlenkaFile
 {
 
+class AsyncReader;
+class BlockCache;
+class Overview;
+struct ReadCounters;
+class SaveProgress;
+class ThreadPool;
+
+/**
+ * @brief The error reported for asynchronous reads that were cancelled.
+ */
+class ReadCancelled : public std::runtime_error
+{
+public:
+	ReadCancelled() : std::runtime_error("The read request was cancelled.") {}
+};
+
+/**
+ * @brief Statistics of the block cache of a DataFile.
+ */
+struct BlockCacheStats
+{
+	uint64_t hits = 0; ///< Number of blocks found in the cache.
+	uint64_t misses = 0; ///< Number of blocks that had to be read.
+	uint64_t readAheadBlocks = 0; ///< Number of blocks read ahead of the requests.
+	int blockCount = 0; ///< Number of blocks currently in the cache.
+	size_t bytesUsed = 0; ///< Memory currently taken by the cached samples.
+};
+
+/**
+ * @brief Statistics of the reads of a DataFile, see DataFile::getReadStats().
+ *
+ * The times are summed over all the threads, so they can exceed the wall
+ * clock time. Decoding includes the calibration, as the two are done in one
+ * pass over the samples.
+ */
+struct ReadStats
+{
+	bool enabled = false; ///< False if the library was built without ALENKA_FILE_STATS.
+	uint64_t readSignalCalls = 0; ///< Number of calls to readSignal().
+	uint64_t bytesRead = 0; ///< Number of bytes taken from the file.
+	uint64_t ioCalls = 0; ///< Number of reads from the file (zero for memory mapped data).
+	uint64_t recordsDecoded = 0; ///< Number of data records decoded (for the record based formats).
+	uint64_t samplesConverted = 0; ///< Number of samples decoded and calibrated.
+	uint64_t samplesZeroFilled = 0; ///< Number of samples outside of the file set to zero.
+	double totalSeconds = 0; ///< Time spent in readSignal().
+	double ioSeconds = 0; ///< Time spent reading from the file.
+	double decodeSeconds = 0; ///< Time spent decoding and calibrating the samples.
+	double zeroFillSeconds = 0; ///< Time spent filling the samples outside of the file.
+	uint64_t cacheHits = 0; ///< Same as BlockCacheStats::hits.
+	uint64_t cacheMisses = 0; ///< Same as BlockCacheStats::misses.
+};
+
 /**
  * @brief An abstract base class of the data files.
  *
@@ -28,19 +88,32 @@ namespace AlenkaFile
  *
  * It is assumed that every channel has the same sampling frequency and the same total
  * number of samples recorded.
+ *
+ * The destructor of the subclass must call stopBackgroundWork() before it releases
+ * anything readChannels() uses.
  */
 class DataFile
 {
 	std::string filePath;
 	DataModel* dataModel;
+	ThreadPool* threadPool = nullptr;
+	std::unique_ptr<BlockCache> blockCache;
+	bool cacheReadAhead = false;
+	std::unique_ptr<AsyncReader> asyncReader;
+	std::mutex asyncMutex;
+	std::shared_ptr<const Overview> overview;
+	mutable std::mutex overviewMutex;
+	std::thread overviewThread;
+	std::atomic<bool> overviewCancel{false};
+	std::unique_ptr<ReadCounters> readCounters;
 
 public:
 	/**
 	 * @brief DataFile constructor.
 	 * @param filePath The file path of the primary file.
 	 */
-	DataFile(const std::string& filePath) : filePath(filePath) {}
-	virtual ~DataFile() {}
+	DataFile(const std::string& filePath);
+	virtual ~DataFile();
 
 	std::string getFilePath() const
 	{
@@ -76,8 +149,17 @@ public:
 	 * @param infoFile [out]
 	 */
 	virtual void saveSecondaryFile(std::string montFilePath = "");
-	virtual void save()
+
+	/**
+	 * @brief Saves the changes to the secondary file and, where the format
+	 * allows it, the events to the primary file.
+	 *
+	 * @param progress If not null, it receives the progress and can cancel
+	 * the operation (see SaveProgress).
+	 */
+	virtual void save(SaveProgress* progress = nullptr)
 	{
+		(void)progress;
 		saveSecondaryFile();
 	}
 
@@ -106,6 +188,8 @@ public:
 	 * These extra samples are set to zero.
 	 *
 	 * The actual reading from the primary file is delegated to readChannels.
+	 * Several threads can call this at the same time if the subclass's
+	 * readChannels() is reentrant.
 	 * @param data [out] The signal data is copied to this buffer.
 	 * @param firstSample The first sample to be read.
 	 * @param lastSample The last sample to be read.
@@ -117,6 +201,68 @@ public:
 	 */
 	void readSignal(double* data, int64_t firstSample, int64_t lastSample);
 
+	/**
+	 * @brief Reads signal data of the selected channels only.
+	 *
+	 * Works the same as the overload for all channels, but the buffer holds only
+	 * channels.size() channels in the order given by channels.
+	 * @param data [out] The signal data is copied to this buffer.
+	 * @param channels Indices of the channels to be read.
+	 * @param firstSample The first sample to be read.
+	 * @param lastSample The last sample to be read.
+	 */
+	void readSignal(float* data, const std::vector<unsigned int>& channels, int64_t firstSample, int64_t lastSample);
+
+	/**
+	 * \overload void readSignal(float* data, const std::vector<unsigned int>& channels, int64_t firstSample, int64_t lastSample)
+	 */
+	void readSignal(double* data, const std::vector<unsigned int>& channels, int64_t firstSample, int64_t lastSample);
+
+	/**
+	 * @brief Reads signal data on a background thread.
+	 *
+	 * Works like readSignal(), but returns immediately. The pending requests
+	 * are read in the order of their position in the file, and the ones that
+	 * overlap or touch are merged into one read. The buffer must stay valid
+	 * until the request is finished.
+	 * @return The future is made ready when the data is in the buffer. If the
+	 * request fails or is cancelled, get() throws the error (ReadCancelled for
+	 * cancelled requests).
+	 */
+	std::future<void> readSignalAsync(float* data, int64_t firstSample, int64_t lastSample);
+
+	/**
+	 * \overload std::future<void> readSignalAsync(float* data, int64_t firstSample, int64_t lastSample)
+	 */
+	std::future<void> readSignalAsync(double* data, int64_t firstSample, int64_t lastSample);
+
+	/**
+	 * @brief Reads signal data on a background thread and calls callback when done.
+	 *
+	 * The callback gets a null pointer on success, or the error otherwise.
+	 * It is called on the I/O thread, or from cancelAsyncReads() for cancelled
+	 * requests, and it must not throw.
+	 */
+	void readSignalAsync(float* data, int64_t firstSample, int64_t lastSample, std::function<void(std::exception_ptr)> callback);
+
+	/**
+	 * \overload void readSignalAsync(float* data, int64_t firstSample, int64_t lastSample, std::function<void(std::exception_ptr)> callback)
+	 */
+	void readSignalAsync(double* data, int64_t firstSample, int64_t lastSample, std::function<void(std::exception_ptr)> callback);
+
+	/**
+	 * @brief Cancels the pending asynchronous reads that don't overlap the given range.
+	 *
+	 * This is meant for dropping the requests the viewport has already moved
+	 * past. Requests that are being read are not affected.
+	 */
+	void cancelAsyncReads(int64_t keepFirstSample, int64_t keepLastSample);
+
+	/**
+	 * @brief Cancels all the pending asynchronous reads.
+	 */
+	void cancelAsyncReads();
+
 	/**
 	 * @brief Reads signal data specified by the sample range.
 	 *
@@ -125,12 +271,32 @@ public:
 	 * @param firstSample The first sample to be read.
 	 * @param lastSample The last sample to be read.
 	 */
-	virtual void readChannels(std::vector<float*> dataChannels, uint64_t firstSample, uint64_t lastSample) = 0;
+	virtual void readChannels(const std::vector<float*>& dataChannels, uint64_t firstSample, uint64_t lastSample) = 0;
+
+	/**
+	 * \overload virtual void readChannels(const std::vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) = 0
+	 */
+	virtual void readChannels(const std::vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) = 0;
+
+	/**
+	 * @brief Reads signal data of the selected channels specified by the sample range.
+	 *
+	 * The range cannot exceed the boundaries of the signal.
+	 *
+	 * The default implementation reads all channels into a temporary buffer.
+	 * The subclasses should override this to skip the unselected channels.
+	 * @param dataChannels A vector of pointers to the beginning of channels;
+	 * dataChannels[i] receives the samples of channel channels[i].
+	 * @param channels Indices of the channels to be read.
+	 * @param firstSample The first sample to be read.
+	 * @param lastSample The last sample to be read.
+	 */
+	virtual void readChannels(const std::vector<float*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample);
 
 	/**
-	 * \overload virtual void readChannels(std::vector<double*> dataChannels, uint64_t firstSample, uint64_t lastSample) = 0
+	 * \overload virtual void readChannels(const std::vector<float*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample)
 	 */
-	virtual void readChannels(std::vector<double*> dataChannels, uint64_t firstSample, uint64_t lastSample) = 0;
+	virtual void readChannels(const std::vector<double*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample);
 
 	DataModel* getDataModel() const
 	{
@@ -142,6 +308,104 @@ public:
 		this->dataModel = dataModel;
 	}
 
+	ThreadPool* getThreadPool() const
+	{
+		return threadPool;
+	}
+
+	/**
+	 * @brief Sets the pool used to decode large reads on several threads.
+	 *
+	 * The decoding is split by channel, so the result is the same as with
+	 * a single thread. Pass nullptr to decode on the calling thread only.
+	 * The pool is not owned by this object.
+	 */
+	void setThreadPool(ThreadPool* threadPool)
+	{
+		this->threadPool = threadPool;
+	}
+
+	/**
+	 * @brief Sets the memory budget of the cache of decoded samples.
+	 *
+	 * The cache sits between readSignal() and readChannels(), so it works the
+	 * same for all the file types. The least recently used blocks are evicted
+	 * when the budget is exceeded.
+	 * @param bytes The memory budget. Zero disables the cache and frees it.
+	 * @param blockSize The number of samples of one channel stored in a block.
+	 * Changing it drops all the cached blocks.
+	 *
+	 * Don't call this while other threads read from the file.
+	 */
+	void setCacheSize(size_t bytes, unsigned int blockSize = 4096);
+
+	/**
+	 * @brief Returns the memory budget of the cache, or zero if it is disabled.
+	 */
+	size_t getCacheSize() const;
+
+	/**
+	 * @brief Enables reading of one extra block in the direction of scrolling.
+	 *
+	 * The extra block is read together with the missing blocks of a request,
+	 * so it doesn't cost another call to readChannels().
+	 */
+	void setCacheReadAhead(bool readAhead)
+	{
+		cacheReadAhead = readAhead;
+	}
+	bool getCacheReadAhead() const
+	{
+		return cacheReadAhead;
+	}
+
+	BlockCacheStats getCacheStats() const;
+
+	/**
+	 * @brief Returns a snapshot of the read statistics.
+	 *
+	 * The counters are only maintained when the library is built with
+	 * ALENKA_FILE_STATS defined (the CMake option of the same name). Otherwise
+	 * the instrumentation compiles to nothing, and only the cache statistics
+	 * are filled in.
+	 */
+	ReadStats getReadStats() const;
+
+	/**
+	 * @brief Sets all the read counters to zero; the cache statistics are kept.
+	 */
+	void resetReadStats();
+
+	/**
+	 * @brief Returns the counters updated by the implementations, or nullptr
+	 * when the statistics are disabled.
+	 */
+	ReadCounters* getReadCounters() const
+	{
+		return readCounters.get();
+	}
+
+	/**
+	 * @brief Drops all the cached blocks; the statistics are kept.
+	 */
+	void clearCache();
+
+	/**
+	 * @brief Makes the min/max/mean overview of the signal available.
+	 *
+	 * The overview is loaded from the primaryFileName.overview sidecar if it is
+	 * up to date. Otherwise it is computed from the whole signal and saved there;
+	 * a failure to save it is ignored.
+	 * @param inBackground If true, the overview is prepared on another thread
+	 * and getOverview() returns null until it is ready.
+	 */
+	void buildOverview(bool inBackground = false);
+
+	/**
+	 * @brief Returns the overview, or null if buildOverview() hasn't finished yet.
+	 */
+	std::shared_ptr<const Overview> getOverview() const;
+
 	virtual double getPhysicalMaximum(unsigned int channel) { return 32767; (void)channel; }
 	virtual double getPhysicalMinimum(unsigned int channel) { return -32768; (void)channel;}
 	virtual double getDigitalMaximum(unsigned int channel) { return 32767; (void)channel;}
@@ -181,6 +445,36 @@ public:
 	{
 		changeEndianness(reinterpret_cast<char*>(val), sizeof(T));
 	}
+
+protected:
+	/**
+	 * @brief Stops all the threads that call readChannels() in the background.
+	 *
+	 * Cancels the pending asynchronous reads, stops the I/O thread and the
+	 * overview computation. No more asynchronous requests are accepted after this.
+	 */
+	void stopBackgroundWork();
+
+	/**
+	 * @brief Lets the background work start again after stopBackgroundWork().
+	 *
+	 * Use the pair to replace the primary file: the asynchronous requests
+	 * submitted in between are cancelled.
+	 */
+	void resumeBackgroundWork();
+
+	/**
+	 * @brief Calls body(i) for every i in [0, count) using the thread pool.
+	 *
+	 * The calls are made on the calling thread if there is no pool, or if
+	 * the job is too small to be worth splitting.
+	 * @param samples The total number of samples processed by the job.
+	 */
+	void parallelFor(int count, const std::function<void(int)>& body, uint64_t samples);
+
+private:
+	AsyncReader* startAsyncReads();
+	std::shared_ptr<const Overview> loadOrComputeOverview();
 };
 
 } // namespace AlenkaFile
@@ -3,6 +3,7 @@
 
 #include "abstractdatamodel.h"
 
+#include <utility>
 #include <vector>
 
 namespace AlenkaFile
@@ -19,7 +20,11 @@ public:
 	virtual void removeRows(int row, int count) override;
 	virtual EventType row(int i) const override { return table[i]; }
 	virtual void row(int i, const EventType& value) override { table[i] = value; }
+	virtual void row(int i, EventType&& value) override { table[i] = std::move(value); }
 	virtual EventType defaultValue(int row) const override;
+	virtual void insertRows(int row, int count, EventType* values) override;
+	virtual void getRows(int i, int count, EventType* values) const override;
+	virtual void setRows(int i, int count, EventType* values) override;
 };
 
 class EventTable : public AbstractEventTable
@@ -33,7 +38,11 @@ public:
 	virtual void removeRows(int row, int count = 1) override;
 	virtual Event row(int i) const override { return table[i]; }
 	virtual void row(int i, const Event& value) override { table[i] = value; }
+	virtual void row(int i, Event&& value) override { table[i] = std::move(value); }
 	virtual Event defaultValue(int row) const override;
+	virtual void insertRows(int row, int count, Event* values) override;
+	virtual void getRows(int i, int count, Event* values) const override;
+	virtual void setRows(int i, int count, Event* values) override;
 };
 
 class TrackTable : public AbstractTrackTable
@@ -47,7 +56,11 @@ public:
 	virtual void removeRows(int row, int count = 1) override;
 	virtual Track row(int i) const override { return table[i]; }
 	virtual void row(int i, const Track& value) override { table[i] = value; }
+	virtual void row(int i, Track&& value) override { table[i] = std::move(value); }
 	virtual Track defaultValue(int row) const override;
+	virtual void insertRows(int row, int count, Track* values) override;
+	virtual void getRows(int i, int count, Track* values) const override;
+	virtual void setRows(int i, int count, Track* values) override;
 };
 
 class MontageTable : public AbstractMontageTable
@@ -2,33 +2,69 @@
 #define ALENKAFILE_EDF_H
 
 #include "datafile.h"
+#include "fileinfo.h"
 
-class edf_hdr_struct;
+#include <memory>
+#include <vector>
 
 namespace AlenkaFile
 {
 
+class EDFAnnotationReader;
+class RandomAccessFile;
+struct EdfLayout;
+
 /**
  * @brief A class implementing the EDF+ and BDF+ types.
  *
- * There is a limit on the channel count (512) due to the limitations
- * of the EDFlib library.
+ * The header is parsed and the files are written without any library, so
+ * the number of signals is limited only by the format (9999). The data
+ * records are read with positional reads, and all the selected signals are
+ * decoded from them in one pass, so several threads can read from one object
+ * at the same time.
  */
 class EDF : public DataFile
 {
 	double samplingFrequency;
 	int numberOfChannels;
 	uint64_t samplesRecorded;
-	edf_hdr_struct* edfhdr;
-	int readChunk;
-	double* readChunkBuffer;
+	std::unique_ptr<EdfLayout> layout;
+	std::vector<int> channelSignal; ///< The index of the channel's signal in the header.
+	std::unique_ptr<RandomAccessFile> dataFile;
+	int64_t startOfData;
+	int64_t recordBytes;
+	bool bdf;
+	std::vector<int64_t> channelOffset;
+	std::vector<int64_t> channelSamplesPerRecord;
+	std::vector<double> multiplier;
+	std::vector<double> offset;
+	bool discontinuous;
+	std::vector<long long> segmentOnset; ///< In units of 100 ns.
+	std::vector<uint64_t> segmentFirstSample;
 
 public:
+	/**
+	 * @brief The ways to read the annotations (the events) of EDF+ files.
+	 *
+	 * They are read by walking all the data records, which makes opening
+	 * of long files slow; the records are parsed in parallel on the thread
+	 * pool, or on a temporary one if the file has none yet. With the last two
+	 * options the signal can be read right away, while load() waits for
+	 * the annotations.
+	 */
+	enum class Annotations
+	{
+		OnOpen, ///< They are read while opening the file.
+		InBackground, ///< They are read on a background thread started by the constructor.
+		OnLoad ///< They are read when load() needs them.
+	};
+
 	/**
 	 * @brief
 	 * @param filePath The file path of the primary data file.
+	 * @param annotations When the annotations are read.
 	 */
-	EDF(const std::string& filePath);
+	EDF(const std::string& filePath, Annotations annotations = Annotations::OnOpen);
 	virtual ~EDF();
 
 	virtual double getSamplingFrequency() const override
@@ -44,15 +80,23 @@ public:
 		return samplesRecorded;
 	}
 	virtual double getStartDate() const override;
-	virtual void save() override;
+	virtual void save(SaveProgress* progress = nullptr) override;
 	virtual bool load() override;
-	virtual void readChannels(std::vector<float*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<float*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
+	}
+	virtual void readChannels(const std::vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
+	}
+	virtual void readChannels(const std::vector<float*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
 	}
-	virtual void readChannels(std::vector<double*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<double*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
 	}
 
 	virtual double getPhysicalMaximum(unsigned int channel) override;
@@ -61,16 +105,75 @@ public:
 	virtual double getDigitalMinimum(unsigned int channel) override;
 	virtual std::string getLabel(unsigned int channel);
 
-	static void saveAs(const std::string& filePath, DataFile* sourceFile);
+	/**
+	 * @brief Returns true for EDF+D and BDF+D files, which can have gaps between the data records.
+	 *
+	 * The onsets of the data records of these files are read while opening
+	 * them, and the contiguous runs of records are kept in a sorted index.
+	 * The other files are treated as a single run.
+	 */
+	bool isDiscontinuous() const
+	{
+		return discontinuous;
+	}
+
+	/**
+	 * @brief Returns the time of a sample in seconds from the start of the first data record.
+	 */
+	double sampleToTime(uint64_t sample) const;
+
+	/**
+	 * @brief Returns the sample recorded at a time in seconds from the start of the first data record.
+	 *
+	 * If the time falls in a gap, the first sample after the gap is returned.
+	 * Times after the end give getSamplesRecorded(). Like sampleToTime(), this
+	 * is a binary search in the index.
+	 */
+	uint64_t timeToSample(double time) const;
+
+	/**
+	 * @brief Reads the signal on a uniform time grid with the gaps filled with zeros.
+	 *
+	 * The samples are spaced by 1/getSamplingFrequency() starting at time (in
+	 * seconds from the start of the first data record). The layout of data is
+	 * the same as with readSignal(): sampleCount samples of every channel.
+	 */
+	void readSignalByTime(float* data, double time, uint64_t sampleCount);
+
+	/**
+	 * \overload void readSignalByTime(float* data, double time, uint64_t sampleCount)
+	 */
+	void readSignalByTime(double* data, double time, uint64_t sampleCount);
+
+	/**
+	 * @brief Writes the signal and the events of sourceFile to a new EDF+ file.
+	 *
+	 * @param progress If not null, it receives the progress and can cancel
+	 * the export; the unfinished file is then removed.
+	 */
+	static void saveAs(const std::string& filePath, DataFile* sourceFile, SaveProgress* progress = nullptr);
+
+	/**
+	 * @brief Reads the basic parameters of an EDF or BDF file; see probeFile().
+	 *
+	 * Only the header is read, so the annotations are not scanned. The
+	 * annotation signals are left out like when the file is opened.
+	 */
+	static FileInfo probe(const std::string& filePath);
 
 private:
+	Annotations annotations;
+	std::unique_ptr<EDFAnnotationReader> annotationReader;
+
+	template<typename T>
+	void readChannelsFloatDouble(const std::vector<T*>& dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample);
 	template<typename T>
-	void readChannelsFloatDouble(std::vector<T*> dataChannels, uint64_t firstSample, uint64_t lastSample);
+	void readSignalByTimeFloatDouble(T* data, double time, uint64_t sampleCount);
 	void openFile();
 	void fillDefaultMontage();
 	void loadEvents();
-	void addUsedEventTypes();
-	static void saveAsWithType(const std::string& filePath, DataFile* sourceFile, const edf_hdr_struct* edfhdr);
+	void addUsedEventTypes(std::vector<Event>* events);
+	static void saveAsWithType(const std::string& filePath, DataFile* sourceFile, const EdfLayout* original, SaveProgress* progress);
 };
 
 } // namespace AlenkaFile
@@ -0,0 +1,64 @@
+#ifndef ALENKAFILE_FILEINFO_H
+#define ALENKAFILE_FILEINFO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+class ThreadPool;
+
+enum class FileFormat
+{
+	Unknown, GDF2, EDF, BDF, MAT
+};
+
+/**
+ * @brief The basic parameters of a recording returned by the probe functions.
+ *
+ * The values are the same the DataFile object of the file would return.
+ */
+struct FileInfo
+{
+	std::string filePath;
+	FileFormat format = FileFormat::Unknown;
+	unsigned int channelCount = 0;
+	double samplingFrequency = 0;
+	uint64_t samplesRecorded = 0;
+	double startDate = 0; ///< In the same units as DataFile::getStartDate().
+	std::vector<std::string> labels;
+	std::string error; ///< Set by scanDirectory() if the file could not be probed.
+};
+
+/**
+ * @brief Returns the format implied by the file's extension.
+ */
+FileFormat formatFromExtension(const std::string& filePath);
+
+/**
+ * @brief Reads the basic parameters of a file without opening it as a DataFile.
+ *
+ * The format is chosen by the extension, and the work is done by
+ * GDF2::probe(), EDF::probe() or MAT::probe(). Only the headers are read,
+ * so this is much faster than constructing the DataFile object.
+ *
+ * Throws runtime_error if the format is unknown or the file cannot be read.
+ */
+FileInfo probeFile(const std::string& filePath);
+
+/**
+ * @brief Probes all the files with a known extension in a directory.
+ *
+ * The files are probed in parallel. The files that fail have
+ * FileInfo::error set instead of an exception being thrown.
+ * @param pool The pool to use. If null, a temporary one is created.
+ * @param recursive If true, the subdirectories are scanned too.
+ * @return The results sorted by the file path.
+ */
+std::vector<FileInfo> scanDirectory(const std::string& directory, ThreadPool* pool = nullptr, bool recursive = true);
+
+} // namespace AlenkaFile
+
+#endif // ALENKAFILE_FILEINFO_H
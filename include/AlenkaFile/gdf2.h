@@ -2,26 +2,60 @@
 #define ALENKAFILE_GDF2_H
 
 #include "datafile.h"
+#include "fileinfo.h"
 
 #include <cmath>
 #include <fstream>
+#include <memory>
+
+namespace boost { namespace interprocess { class mapped_region; } }
 
 namespace AlenkaFile
 {
 
+class RandomAccessFile;
+
 /**
  * @brief A class implementing the GDF v2.51 file type.
  *
  * This is my own implementation that doesn't depend on anything but the standard library.
+ *
+ * Several threads can read samples from one object at the same time: the data
+ * section is accessed through the mapping or with positional reads, and all the
+ * scratch buffers are per thread.
+ *
+ * The channels can have different sampling rates and data types. The
+ * DataFile interface presents all of them at the highest rate (see
+ * setResampling()); readChannelNative() reads a channel at its own rate.
+ *
+ * The constructor reads only the fixed header and the layout of the records,
+ * which is enough for the channel count, the sampling rate and the length of
+ * the recording. The rest of the variable header is parsed, and the data
+ * section opened, when they are first needed. So opening a file just to learn
+ * its basic parameters is cheap, as long as load() isn't called.
  */
 class GDF2 : public DataFile
 {
 public:
+	/**
+	 * @brief The methods used to bring slower channels to the common rate.
+	 */
+	enum class Resampling
+	{
+		Hold, ///< Repeats the last native sample.
+		Linear ///< Interpolates linearly between the neighboring native samples.
+	};
+
 	/**
 	 * @brief GDF2 constructor.
 	 * @param filePath The file path of the primary data file.
+	 * @param uncalibrated If true, the raw sample values are returned.
+	 * @param memoryMapped If true, the data section is mapped into memory and
+	 * the samples are decoded directly from the mapping. When the mapping
+	 * cannot be created (e.g. not enough address space), regular file reads
+	 * are used instead.
 	 */
-	GDF2(const std::string& filePath, bool uncalibrated = false);
+	GDF2(const std::string& filePath, bool uncalibrated = false, bool memoryMapped = true);
 	virtual ~GDF2();
 
 	virtual double getSamplingFrequency() const override
@@ -42,60 +76,168 @@ public:
 		double days = fh.startDate[1];
 		return days + fractionOfDay;
 	}
-	virtual void save() override;
+	virtual void save(SaveProgress* progress = nullptr) override;
 	virtual bool load() override;
-	virtual void readChannels(std::vector<float*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<float*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
+	}
+	virtual void readChannels(const std::vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
+	}
+	virtual void readChannels(const std::vector<float*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
 	}
-	virtual void readChannels(std::vector<double*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<double*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
 	}
 
 	virtual double getPhysicalMaximum(unsigned int channel) override
 	{
+		loadVariableHeader();
 		if (channel < getChannelCount())
 			return vh.physicalMaximum[channel];
 		return 0;
 	}
 	virtual double getPhysicalMinimum(unsigned int channel) override
 	{
+		loadVariableHeader();
 		if (channel < getChannelCount())
 			return vh.physicalMinimum[channel];
 		return 0;
 	}
 	virtual double getDigitalMaximum(unsigned int channel) override
 	{
+		loadVariableHeader();
 		if (channel < getChannelCount())
 			return vh.digitalMaximum[channel];
 		return 0;
 	}
 	virtual double getDigitalMinimum(unsigned int channel) override
 	{
+		loadVariableHeader();
 		if (channel < getChannelCount())
 			return vh.digitalMinimum[channel];
 		return 0;
 	}
 	virtual std::string getLabel(unsigned int channel)
 	{
+		loadVariableHeader();
 		if (channel < getChannelCount())
 			return vh.label[channel];
 		return 0;
 	}
 
+	/**
+	 * @brief Returns the maximum size in bytes of a single bulk read.
+	 */
+	size_t getReadBatchSize() const
+	{
+		return readBatchSize;
+	}
+
+	/**
+	 * @brief Sets the maximum size in bytes of a single bulk read.
+	 *
+	 * When the file is not memory mapped and most of the requested records are
+	 * needed anyway, whole records are read in batches of up to this size and
+	 * demultiplexed in memory. At least one record is always read at a time.
+	 */
+	void setReadBatchSize(size_t bytes)
+	{
+		readBatchSize = bytes;
+	}
+
+	Resampling getResampling() const
+	{
+		return resampling;
+	}
+
+	/**
+	 * @brief Sets how the channels with a lower sampling rate are resampled.
+	 *
+	 * The default is Resampling::Hold. This has no effect on the channels
+	 * recorded at the common rate. The cached blocks are dropped, as they
+	 * hold the samples resampled the old way.
+	 */
+	void setResampling(Resampling resampling)
+	{
+		this->resampling = resampling;
+		clearCache();
+	}
+
+	/**
+	 * @brief Returns the sampling frequency the channel was recorded with.
+	 */
+	double getChannelSamplingFrequency(unsigned int channel) const;
+
+	/**
+	 * @brief Returns the number of samples recorded for the channel at its own rate.
+	 */
+	uint64_t getChannelSamplesRecorded(unsigned int channel) const;
+
+	/**
+	 * @brief Reads samples of one channel at its own sampling rate.
+	 *
+	 * The range cannot exceed getChannelSamplesRecorded(channel).
+	 */
+	void readChannelNative(unsigned int channel, float* data, uint64_t firstSample, uint64_t lastSample);
+
+	/**
+	 * \overload void readChannelNative(unsigned int channel, float* data, uint64_t firstSample, uint64_t lastSample)
+	 */
+	void readChannelNative(unsigned int channel, double* data, uint64_t firstSample, uint64_t lastSample);
+
+	/**
+	 * @brief Writes the signal and the events of sourceFile to a new GDF2 file.
+	 *
+	 * The samples are stored as floating-point values with an identity
+	 * calibration, so they read back exactly as sourceFile returned them (as
+	 * long as typeOfData is wide enough). The records are one second long
+	 * (round(samplingFrequency) samples), and the last one is padded with
+	 * zeros, so the new file has the number of samples rounded up to a whole
+	 * record. The events are written the same way save() writes them.
+	 *
+	 * @param typeOfData The GDF code of the sample type: 16 for float32 or 17
+	 * for float64.
+	 * @param progress If not null, it receives the progress and can cancel
+	 * the export; the unfinished file is then removed.
+	 */
+	static void saveAs(const std::string& filePath, DataFile* sourceFile, int typeOfData = 17, SaveProgress* progress = nullptr);
+
+	/**
+	 * @brief Reads the basic parameters of a GDF2 file; see probeFile().
+	 *
+	 * Only the fixed header and the labels and record layout from the
+	 * variable header are read.
+	 */
+	static FileInfo probe(const std::string& filePath);
+
 private:
 	std::fstream file;
 	double samplingFrequency;
 	uint64_t samplesRecorded;
 	int64_t startOfData;
 	int64_t startOfEventTable;
-	double* scale;
-	int dataTypeSize;
+	double* multiplier = nullptr;
+	double* offset = nullptr;
+	bool uncalibrated;
+	bool memoryMapped;
+	std::once_flag variableHeaderFlag;
+	std::once_flag dataSectionFlag;
 	int version;
-	char* recordRawBuffer;
-	double* recordDoubleBuffer;
-	int dataType;
+	int samplesPerRecord;
+	int64_t recordBytes;
+	std::vector<int64_t> channelOffset;
+	std::vector<int> channelTypeSize;
+	Resampling resampling = Resampling::Hold;
+	std::unique_ptr<boost::interprocess::mapped_region> dataMapping;
+	const char* mappedData = nullptr;
+	size_t readBatchSize = 4*1024*1024;
+	std::unique_ptr<RandomAccessFile> dataFile;
 
 	/**
 	 * @brief A structure for storing values from the file's fixed header
@@ -133,27 +275,35 @@ private:
 	 */
 	struct
 	{
-		char (* label)[16 + 1];
-		char (* typeOfSensor)[80 + 1];
+		char (* label)[16 + 1] = nullptr;
+		char (* typeOfSensor)[80 + 1] = nullptr;
 		// physicalDimension obsolete
-		uint16_t* physicalDimensionCode;
-		double* physicalMinimum;
-		double* physicalMaximum;
-		double* digitalMinimum;
-		double* digitalMaximum;
+		uint16_t* physicalDimensionCode = nullptr;
+		double* physicalMinimum = nullptr;
+		double* physicalMaximum = nullptr;
+		double* digitalMinimum = nullptr;
+		double* digitalMaximum = nullptr;
 		// prefiltering obsolete
-		float* timeOffset;
-		float* lowpass;
-		float* highpass;
-		float* notch;
-		uint32_t* samplesPerRecord;
-		uint32_t* typeOfData;
-		float (* sensorPosition)[3];
-		char (* sensorInfo)[20];
+		float* timeOffset = nullptr;
+		float* lowpass = nullptr;
+		float* highpass = nullptr;
+		float* notch = nullptr;
+		uint32_t* samplesPerRecord = nullptr;
+		uint32_t* typeOfData = nullptr;
+		float (* sensorPosition)[3] = nullptr;
+		char (* sensorInfo)[20] = nullptr;
 	} vh;
 
 	template<typename T>
-	void readChannelsFloatDouble(std::vector<T*> dataChannels, const uint64_t firstSample, const uint64_t lastSample);
+	void readChannelsFloatDouble(const std::vector<T*>& dataChannels, const std::vector<unsigned int>* channels, const uint64_t firstSample, const uint64_t lastSample);
+	template<typename T>
+	void readNative(const std::vector<unsigned int>& channels, const std::vector<uint64_t>& firstSamples, const std::vector<uint64_t>& lastSamples, const std::vector<T*>& dataChannels);
+	template<typename T>
+	void readChannelNativeFloatDouble(unsigned int channel, T* data, uint64_t firstSample, uint64_t lastSample);
+	void loadVariableHeader();
+	void parseVariableHeader();
+	void openDataSection();
+	void mapDataSection();
 	void readGdfEventTable();
 	void fillDefaultMontage();
 };
@@ -2,7 +2,9 @@
 #define ALENKAFILE_MAT_H
 
 #include "datafile.h"
+#include "fileinfo.h"
 
+#include <mutex>
 #include <vector>
 
 typedef struct _mat_t mat_t;
@@ -34,6 +36,7 @@ class MAT : public DataFile
 	int numberOfChannels;
 	uint64_t samplesRecorded;
 	std::vector<char> tmpBuffer;
+	std::mutex readMutex;
 	std::vector<matvar_t*> data;
 	std::vector<matvar_t*> dataToFree;
 	std::vector<unsigned int> dataFileIndex;
@@ -62,16 +65,33 @@ public:
 	{
 		return days;
 	}
-	virtual void save() override;
+	virtual void save(SaveProgress* progress = nullptr) override;
 	virtual bool load() override;
-	virtual void readChannels(std::vector<float*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<float*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
 	}
-	virtual void readChannels(std::vector<double*> dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	virtual void readChannels(const std::vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
 	{
-		readChannelsFloatDouble(dataChannels, firstSample, lastSample);
+		readChannelsFloatDouble(dataChannels, nullptr, firstSample, lastSample);
 	}
+	virtual void readChannels(const std::vector<float*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
+	}
+	virtual void readChannels(const std::vector<double*>& dataChannels, const std::vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		readChannelsFloatDouble(dataChannels, &channels, firstSample, lastSample);
+	}
+
+	/**
+	 * @brief Reads the basic parameters of a MAT file; see probeFile().
+	 *
+	 * Matio reads only the variable headers of the data, so this costs about
+	 * the same as the constructor. Only the small variables (the sampling
+	 * rate, the date and the labels) are read whole.
+	 */
+	static FileInfo probe(const std::string& filePath, const MATvars& vars = MATvars());
 
 private:
 	void openMatFile(const std::string& filePath);
@@ -84,7 +104,7 @@ private:
 	void readEvents(std::vector<int>* eventPositions, std::vector<int>* eventDurations, std::vector<int>* eventChannels);
 
 	template<typename T>
-	void readChannelsFloatDouble(std::vector<T*> dataChannels, uint64_t firstSample, uint64_t lastSample);
+	void readChannelsFloatDouble(std::vector<T*> dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample);
 
 	void fillDefaultMontage();
 	void loadEvents();
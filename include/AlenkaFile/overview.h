@@ -0,0 +1,113 @@
+#ifndef ALENKAFILE_OVERVIEW_H
+#define ALENKAFILE_OVERVIEW_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+class DataFile;
+
+/**
+ * @brief A min/max/mean pyramid of the signal for drawing zoomed-out views.
+ *
+ * Level 0 splits every channel into bins of baseBinSize samples, and every
+ * next level merges levelFactor bins of the previous one. The top level has
+ * a single bin. The last bin of a level can be shorter than the others; its
+ * mean is computed from the samples it actually covers.
+ */
+class Overview
+{
+public:
+	static const int DEFAULT_BASE_BIN_SIZE = 1024;
+	static const int DEFAULT_LEVEL_FACTOR = 4;
+
+	Overview(unsigned int channelCount, uint64_t samplesRecorded, int baseBinSize = DEFAULT_BASE_BIN_SIZE, int levelFactor = DEFAULT_LEVEL_FACTOR);
+
+	unsigned int getChannelCount() const
+	{
+		return channelCount;
+	}
+	uint64_t getSamplesRecorded() const
+	{
+		return samplesRecorded;
+	}
+	int getLevelCount() const
+	{
+		return static_cast<int>(levels.size());
+	}
+
+	/**
+	 * @brief Returns the number of samples covered by one bin of the level.
+	 */
+	uint64_t getBinSize(int level) const;
+
+	uint64_t getBinCount(int level) const
+	{
+		return levels.at(level).binCount;
+	}
+
+	/**
+	 * @brief Returns the coarsest level whose bins are not longer than samplesPerBin.
+	 *
+	 * For example, pass the number of samples per pixel column. Returns level 0
+	 * if even its bins are too long, and -1 if the overview is empty.
+	 */
+	int findLevel(double samplesPerBin) const;
+
+	/**
+	 * @brief Copies the envelope of bins [firstBin, lastBin] of all channels.
+	 *
+	 * The output buffers use the same layout as DataFile::readSignal(): one
+	 * block of lastBin - firstBin + 1 values per channel. Bins outside of the
+	 * signal are set to zero. Any of the buffers can be null.
+	 */
+	void readEnvelope(int level, int64_t firstBin, int64_t lastBin, float* minimum, float* maximum, float* mean) const;
+
+	/**
+	 * @brief Computes the overview by reading the whole signal of file.
+	 * @param cancel If it becomes true, the computation stops and nullptr is returned.
+	 */
+	static std::unique_ptr<Overview> compute(DataFile* file, const std::atomic<bool>* cancel = nullptr);
+
+	/**
+	 * @brief Checks that this overview was computed from file.
+	 *
+	 * Compares the dimensions and recomputes the first bin of every channel.
+	 */
+	bool matches(DataFile* file) const;
+
+	/**
+	 * @brief Writes the overview to a binary file; throws runtime_error on failure.
+	 */
+	void save(const std::string& filePath) const;
+
+	/**
+	 * @brief Reads an overview saved by save().
+	 * @return Null if the file doesn't exist or is not a valid overview.
+	 */
+	static std::unique_ptr<Overview> load(const std::string& filePath);
+
+private:
+	struct Level
+	{
+		uint64_t binCount;
+		std::vector<float> minimum, maximum, mean;
+	};
+
+	unsigned int channelCount;
+	uint64_t samplesRecorded;
+	int baseBinSize;
+	int levelFactor;
+	std::vector<Level> levels;
+
+	void computeUpperLevels();
+};
+
+} // namespace AlenkaFile
+
+#endif // ALENKAFILE_OVERVIEW_H
@@ -0,0 +1,107 @@
+#ifndef ALENKAFILE_SAVEPROGRESS_H
+#define ALENKAFILE_SAVEPROGRESS_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief The error thrown by save and export operations that were cancelled.
+ */
+class SaveCancelled : public std::runtime_error
+{
+public:
+	SaveCancelled() : std::runtime_error("The save operation was cancelled.") {}
+};
+
+/**
+ * @brief Tracks the progress of a long save or export operation and lets it be cancelled.
+ *
+ * Pass an object to DataFile::save(), EDF::saveAs() or GDF2::saveAs(). The
+ * operation calls start() once and then update() after every block it
+ * processes. The getters and cancel() can be used from any thread.
+ *
+ * A cancelled operation throws SaveCancelled from its next update() and
+ * removes the files it has created.
+ */
+class SaveProgress
+{
+public:
+	/**
+	 * @brief SaveProgress constructor.
+	 * @param callback If set, it is called on the saving thread after every
+	 * update(). It can call cancel().
+	 */
+	explicit SaveProgress(std::function<void(SaveProgress&)> callback = nullptr) : callback(std::move(callback)) {}
+
+	SaveProgress(const SaveProgress&) = delete;
+	SaveProgress& operator=(const SaveProgress&) = delete;
+
+	void cancel()
+	{
+		cancelled = true;
+	}
+	bool isCancelled() const
+	{
+		return cancelled;
+	}
+
+	/**
+	 * @brief Returns the number of samples per channel the operation is going to process.
+	 */
+	uint64_t getTotalSamples() const
+	{
+		return totalSamples;
+	}
+	uint64_t getSamplesProcessed() const
+	{
+		return samplesProcessed;
+	}
+	uint64_t getBytesProcessed() const
+	{
+		return bytesProcessed;
+	}
+
+	/**
+	 * @brief Returns the average number of bytes processed per second since start().
+	 */
+	double getBytesPerSecond() const;
+
+	/**
+	 * @brief Returns the average number of samples processed per second since start().
+	 */
+	double getSamplesPerSecond() const;
+
+	/**
+	 * @brief Resets the counters; called by the operation before it begins.
+	 *
+	 * Throws SaveCancelled if cancel() was called already.
+	 */
+	void start(uint64_t totalSamples);
+
+	/**
+	 * @brief Adds to the counters; called by the operation after every block.
+	 *
+	 * Throws SaveCancelled if cancel() was called.
+	 */
+	void update(uint64_t samples, uint64_t bytes);
+
+private:
+	std::function<void(SaveProgress&)> callback;
+	std::atomic<bool> cancelled {false};
+	std::atomic<uint64_t> totalSamples {0};
+	std::atomic<uint64_t> samplesProcessed {0};
+	std::atomic<uint64_t> bytesProcessed {0};
+	std::atomic<int64_t> startTime {0}; // steady_clock ticks
+
+	double elapsedSeconds() const;
+};
+
+} // namespace AlenkaFile
+
+#endif // ALENKAFILE_SAVEPROGRESS_H
@@ -0,0 +1,60 @@
+#ifndef ALENKAFILE_THREADPOOL_H
+#define ALENKAFILE_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief A fixed set of worker threads for splitting the decoding of large reads.
+ *
+ * One pool can be shared by any number of DataFile objects (see
+ * DataFile::setThreadPool()). The pool must outlive all the files that use it.
+ */
+class ThreadPool
+{
+public:
+	/**
+	 * @brief ThreadPool constructor.
+	 * @param threadCount The number of worker threads. If zero, one thread
+	 * per hardware thread is started (not counting the calling thread).
+	 */
+	explicit ThreadPool(unsigned int threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned int getThreadCount() const
+	{
+		return static_cast<unsigned int>(threads.size());
+	}
+
+	/**
+	 * @brief Calls body(i) for every i in [0, count) and waits for all of them.
+	 *
+	 * The calling thread takes part in the work, so this can be safely used
+	 * from inside another parallelFor(). If some of the calls throw, the first
+	 * exception is rethrown here after all the others have finished.
+	 */
+	void parallelFor(int count, const std::function<void(int)>& body);
+
+private:
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> queue;
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	bool stop = false;
+
+	void workerLoop();
+};
+
+} // namespace AlenkaFile
+
+#endif // ALENKAFILE_THREADPOOL_H
@@ -0,0 +1,229 @@
+#include "asyncreader.h"
+
+#include "../include/AlenkaFile/datafile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <type_traits>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+// The merged requests are read into a temporary buffer of at most this many bytes.
+const int64_t MAX_RUN_BYTES = 4*1024*1024;
+
+void cancelRequests(vector<AsyncReader::Request>& requests)
+{
+	exception_ptr e = make_exception_ptr(ReadCancelled());
+
+	for (auto& r : requests)
+	{
+		if (r.callback)
+			r.callback(e);
+	}
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+AsyncReader::~AsyncReader()
+{
+	stop();
+}
+
+void AsyncReader::submit(Request&& request)
+{
+	{
+		lock_guard<mutex> lock(pendingMutex);
+
+		if (!stopping)
+		{
+			if (!worker.joinable())
+				worker = thread(&AsyncReader::workerLoop, this);
+
+			pending.push_back(move(request));
+			pendingCondition.notify_one();
+			return;
+		}
+	}
+
+	vector<Request> cancelled;
+	cancelled.push_back(move(request));
+	cancelRequests(cancelled);
+}
+
+void AsyncReader::cancel(int64_t keepFirst, int64_t keepLast)
+{
+	vector<Request> cancelled;
+
+	{
+		lock_guard<mutex> lock(pendingMutex);
+
+		auto it = stable_partition(pending.begin(), pending.end(), [keepFirst, keepLast] (const Request& r)
+		{
+			return r.firstSample <= keepLast && keepFirst <= r.lastSample;
+		});
+
+		move(it, pending.end(), back_inserter(cancelled));
+		pending.erase(it, pending.end());
+	}
+
+	cancelRequests(cancelled);
+}
+
+void AsyncReader::stop()
+{
+	vector<Request> cancelled;
+
+	{
+		lock_guard<mutex> lock(pendingMutex);
+
+		stopping = true;
+		move(pending.begin(), pending.end(), back_inserter(cancelled));
+		pending.clear();
+	}
+	pendingCondition.notify_all();
+
+	if (worker.joinable())
+		worker.join();
+
+	cancelRequests(cancelled);
+}
+
+void AsyncReader::resume()
+{
+	lock_guard<mutex> lock(pendingMutex);
+
+	// The worker was joined by stop(); submit() starts a new one.
+	assert(!worker.joinable());
+	stopping = false;
+}
+
+void AsyncReader::workerLoop()
+{
+	while (true)
+	{
+		vector<Request> run;
+
+		{
+			unique_lock<mutex> lock(pendingMutex);
+			pendingCondition.wait(lock, [this] () { return stopping || !pending.empty(); });
+
+			if (stopping)
+				return;
+
+			takeRun(&run);
+		}
+
+		if (run[0].isDouble)
+			readMerged<double>(run);
+		else
+			readMerged<float>(run);
+	}
+}
+
+void AsyncReader::takeRun(vector<Request>* run)
+{
+	const Request& oldest = pending.front();
+	const bool isDouble = oldest.isDouble;
+	const int64_t sampleBytes = static_cast<int64_t>(file->getChannelCount()*(isDouble ? sizeof(double) : sizeof(float)));
+
+	int64_t firstSample = oldest.firstSample, lastSample = oldest.lastSample;
+	vector<bool> taken(pending.size());
+	taken[0] = true;
+
+	// Add the requests that overlap or touch the run until it stops growing,
+	// or until it would get longer than MAX_RUN_BYTES.
+	for (bool grown = true; grown;)
+	{
+		grown = false;
+
+		for (size_t i = 1; i < pending.size(); ++i)
+		{
+			const Request& r = pending[i];
+
+			if (taken[i] || r.isDouble != isDouble || r.firstSample > lastSample + 1 || firstSample > r.lastSample + 1)
+				continue;
+
+			int64_t first = min(firstSample, r.firstSample), last = max(lastSample, r.lastSample);
+
+			if ((last - first + 1)*sampleBytes <= MAX_RUN_BYTES)
+			{
+				firstSample = first;
+				lastSample = last;
+				taken[i] = grown = true;
+			}
+		}
+	}
+
+	// The rest stay in the queue, where cancel() can still drop them.
+	deque<Request> rest;
+	for (size_t i = 0; i < pending.size(); ++i)
+	{
+		if (taken[i])
+			run->push_back(move(pending[i]));
+		else
+			rest.push_back(move(pending[i]));
+	}
+	pending.swap(rest);
+
+	stable_sort(run->begin(), run->end(), [] (const Request& a, const Request& b) { return a.firstSample < b.firstSample; });
+}
+
+template<class T>
+void AsyncReader::readMerged(vector<Request>& run)
+{
+	assert(!run.empty());
+
+	exception_ptr error;
+
+	try
+	{
+		if (run.size() == 1)
+		{
+			file->readSignal(static_cast<T*>(run[0].data), run[0].firstSample, run[0].lastSample);
+		}
+		else
+		{
+			int64_t firstSample = run[0].firstSample, lastSample = run[0].lastSample;
+			for (auto& r : run)
+				lastSample = max(lastSample, r.lastSample);
+
+			int64_t len = lastSample - firstSample + 1;
+			unsigned int channelCount = file->getChannelCount();
+
+			vector<T> buffer(channelCount*len);
+			file->readSignal(buffer.data(), firstSample, lastSample);
+
+			for (auto& r : run)
+			{
+				int64_t requestLength = r.lastSample - r.firstSample + 1;
+				T* data = static_cast<T*>(r.data);
+
+				for (unsigned int i = 0; i < channelCount; ++i)
+				{
+					const T* source = buffer.data() + i*len + (r.firstSample - firstSample);
+					copy(source, source + requestLength, data + i*requestLength);
+				}
+			}
+		}
+	}
+	catch (...)
+	{
+		error = current_exception();
+	}
+
+	for (auto& r : run)
+	{
+		if (r.callback)
+			r.callback(error);
+	}
+}
+
+} // namespace AlenkaFile
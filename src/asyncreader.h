@@ -0,0 +1,77 @@
+#ifndef ASYNCREADER_H
+#define ASYNCREADER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+class DataFile;
+
+/**
+ * @brief The I/O worker behind DataFile::readSignalAsync().
+ *
+ * The worker thread takes the oldest pending request together with the
+ * pending ones that overlap or touch it, up to a limited length, and reads
+ * them with a single readSignal() call. The other requests stay pending, so
+ * they can still be cancelled.
+ */
+class AsyncReader
+{
+public:
+	struct Request
+	{
+		bool isDouble;
+		void* data;
+		int64_t firstSample;
+		int64_t lastSample;
+		std::function<void(std::exception_ptr)> callback;
+	};
+
+	explicit AsyncReader(DataFile* file) : file(file) {}
+	~AsyncReader();
+
+	void submit(Request&& request);
+
+	/**
+	 * @brief Cancels the pending requests that don't overlap [keepFirst, keepLast].
+	 *
+	 * The callbacks of the cancelled requests are called from this function.
+	 */
+	void cancel(int64_t keepFirst, int64_t keepLast);
+
+	/**
+	 * @brief Cancels all the pending requests and waits for the worker to finish.
+	 */
+	void stop();
+
+	/**
+	 * @brief Accepts new requests again after stop().
+	 */
+	void resume();
+
+private:
+	DataFile* file;
+	std::thread worker;
+	std::deque<Request> pending;
+	std::mutex pendingMutex;
+	std::condition_variable pendingCondition;
+	bool stopping = false;
+
+	void workerLoop();
+	void takeRun(std::vector<Request>* run);
+
+	template<class T>
+	void readMerged(std::vector<Request>& run);
+};
+
+} // namespace AlenkaFile
+
+#endif // ASYNCREADER_H
@@ -0,0 +1,250 @@
+#include "blockcache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <type_traits>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+vector<float>& samples(vector<float>& floatSamples, vector<double>&, float*)
+{
+	return floatSamples;
+}
+
+vector<double>& samples(vector<float>&, vector<double>& doubleSamples, double*)
+{
+	return doubleSamples;
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+size_t BlockCache::getCapacity() const
+{
+	lock_guard<mutex> lock(cacheMutex);
+	return capacity;
+}
+
+BlockCacheStats BlockCache::getStats() const
+{
+	lock_guard<mutex> lock(cacheMutex);
+	return stats;
+}
+
+void BlockCache::setCapacity(size_t bytes)
+{
+	lock_guard<mutex> lock(cacheMutex);
+	capacity = bytes;
+	evict();
+}
+
+void BlockCache::clear()
+{
+	lock_guard<mutex> lock(cacheMutex);
+	lru.clear();
+	index.clear();
+	stats.blockCount = 0;
+	stats.bytesUsed = 0;
+}
+
+void BlockCache::read(DataFile* file, const vector<float*>& dataChannels, const vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead)
+{
+	readFloatDouble(file, dataChannels, channels, firstSample, lastSample, readAhead);
+}
+
+void BlockCache::read(DataFile* file, const vector<double*>& dataChannels, const vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead)
+{
+	readFloatDouble(file, dataChannels, channels, firstSample, lastSample, readAhead);
+}
+
+template<class T>
+void BlockCache::readFloatDouble(DataFile* file, const vector<T*>& dataChannels, const vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead)
+{
+	assert(firstSample <= lastSample && lastSample < file->getSamplesRecorded());
+
+	const bool isDouble = is_same<T, double>::value;
+	unsigned int channelCount = channels ? static_cast<unsigned int>(channels->size()) : file->getChannelCount();
+	uint64_t firstBlock = firstSample/blockSize;
+	uint64_t blockCount = lastSample/blockSize - firstBlock + 1;
+
+	vector<bool> hit(channelCount*blockCount, false);
+	vector<bool> missingChannel(file->getChannelCount(), false);
+	uint64_t missFirst = numeric_limits<uint64_t>::max(), missLast = 0;
+	int readDirection;
+
+	// Copy out the cached blocks. The lock is not held while reading the file,
+	// so the hits cannot be used after this.
+	{
+		lock_guard<mutex> lock(cacheMutex);
+
+		if (firstSample != previousFirstSample)
+			direction = firstSample > previousFirstSample ? 1 : -1;
+		previousFirstSample = firstSample;
+		readDirection = direction;
+
+		for (unsigned int i = 0; i < channelCount; ++i)
+		{
+			unsigned int channel = channels ? (*channels)[i] : i;
+
+			for (uint64_t b = 0; b < blockCount; ++b)
+			{
+				auto it = index.find(Key{firstBlock + b, channel, isDouble});
+
+				if (it != index.end())
+				{
+					lru.splice(lru.begin(), lru, it->second);
+					Block& block = *it->second;
+					const T* source = samples(block.floatSamples, block.doubleSamples, static_cast<T*>(nullptr)).data();
+
+					uint64_t blockStart = (firstBlock + b)*blockSize;
+					uint64_t from = max(firstSample, blockStart);
+					uint64_t to = min(lastSample, blockStart + blockSize - 1);
+
+					copy(source + (from - blockStart), source + (to - blockStart + 1), dataChannels[i] + (from - firstSample));
+
+					hit[i*blockCount + b] = true;
+					++stats.hits;
+				}
+				else
+				{
+					missingChannel[channel] = true;
+					missFirst = min(missFirst, firstBlock + b);
+					missLast = max(missLast, firstBlock + b);
+					++stats.misses;
+				}
+			}
+		}
+	}
+
+	// Read the missing blocks of the missing channels with one call.
+	vector<unsigned int> missing;
+	for (unsigned int i = 0; i < missingChannel.size(); ++i)
+	{
+		if (missingChannel[i])
+			missing.push_back(i);
+	}
+
+	if (missing.empty())
+		return;
+
+	uint64_t lastFileBlock = (file->getSamplesRecorded() - 1)/blockSize;
+	bool readingAhead = false;
+
+	if (readAhead)
+	{
+		if (readDirection > 0 && missLast < lastFileBlock)
+		{
+			++missLast;
+			readingAhead = true;
+		}
+		else if (readDirection < 0 && missFirst > 0)
+		{
+			--missFirst;
+			readingAhead = true;
+		}
+	}
+
+	uint64_t spanFirst = missFirst*blockSize;
+	uint64_t spanLast = min(missLast*blockSize + blockSize - 1, file->getSamplesRecorded() - 1);
+	uint64_t spanLength = spanLast - spanFirst + 1;
+
+	vector<T> buffer(missing.size()*spanLength);
+	vector<T*> bufferChannels(missing.size());
+	vector<int> bufferChannel(file->getChannelCount(), -1);
+
+	for (unsigned int i = 0; i < missing.size(); ++i)
+	{
+		bufferChannels[i] = buffer.data() + i*spanLength;
+		bufferChannel[missing[i]] = static_cast<int>(i);
+	}
+
+	if (missing.size() == file->getChannelCount())
+		file->readChannels(bufferChannels, spanFirst, spanLast);
+	else
+		file->readChannels(bufferChannels, missing, spanFirst, spanLast);
+
+	// Fill in the rest of the output from the buffer.
+	for (unsigned int i = 0; i < channelCount; ++i)
+	{
+		unsigned int channel = channels ? (*channels)[i] : i;
+
+		for (uint64_t b = 0; b < blockCount; ++b)
+		{
+			if (hit[i*blockCount + b])
+				continue;
+
+			uint64_t blockStart = (firstBlock + b)*blockSize;
+			uint64_t from = max(firstSample, blockStart);
+			uint64_t to = min(lastSample, blockStart + blockSize - 1);
+
+			const T* source = buffer.data() + bufferChannel[channel]*spanLength + (from - spanFirst);
+			copy(source, source + (to - from + 1), dataChannels[i] + (from - firstSample));
+		}
+	}
+
+	// Store the newly read blocks.
+	lock_guard<mutex> lock(cacheMutex);
+
+	if (readingAhead)
+		++stats.readAheadBlocks;
+
+	for (unsigned int i = 0; i < missing.size(); ++i)
+	{
+		for (uint64_t b = missFirst; b <= missLast; ++b)
+		{
+			Key key{b, missing[i], isDouble};
+
+			if (index.find(key) != index.end())
+				continue;
+
+			uint64_t from = b*blockSize - spanFirst;
+			uint64_t to = min(from + blockSize, spanLength);
+			const T* source = buffer.data() + i*spanLength;
+
+			Block block;
+			block.key = key;
+			samples(block.floatSamples, block.doubleSamples, static_cast<T*>(nullptr)).assign(source + from, source + to);
+
+			insert(move(block));
+		}
+	}
+}
+
+void BlockCache::insert(Block&& block)
+{
+	size_t bytes = block.bytes();
+
+	if (capacity < bytes)
+		return;
+
+	lru.push_front(move(block));
+	index[lru.front().key] = lru.begin();
+
+	++stats.blockCount;
+	stats.bytesUsed += bytes;
+
+	evict();
+}
+
+void BlockCache::evict()
+{
+	while (capacity < stats.bytesUsed)
+	{
+		assert(!lru.empty());
+
+		stats.bytesUsed -= lru.back().bytes();
+		--stats.blockCount;
+
+		index.erase(lru.back().key);
+		lru.pop_back();
+	}
+}
+
+} // namespace AlenkaFile
@@ -0,0 +1,114 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "../include/AlenkaFile/datafile.h"
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief An LRU cache of decoded samples used by DataFile::readSignal().
+ *
+ * The signal of every channel is split into blocks of blockSize samples.
+ * Each cached block holds the samples of one channel decoded either to float
+ * or to double, so the values returned are exactly those readChannels()
+ * would return for the same type.
+ *
+ * The cache can be used from several threads at once. The lock is not held
+ * while the file is being read.
+ */
+class BlockCache
+{
+public:
+	BlockCache(size_t capacity, unsigned int blockSize) : capacity(capacity), blockSize(blockSize) {}
+
+	size_t getCapacity() const;
+	unsigned int getBlockSize() const
+	{
+		return blockSize;
+	}
+
+	/**
+	 * @brief Changes the memory budget; blocks over the budget are evicted.
+	 */
+	void setCapacity(size_t bytes);
+
+	void clear();
+
+	BlockCacheStats getStats() const;
+
+	/**
+	 * @brief Works like DataFile::readChannels(), but reads only the blocks
+	 * that are not in the cache.
+	 *
+	 * All the missing blocks are read with one call to readChannels(). If
+	 * readAhead is true, this call is extended by one more block in the
+	 * direction the requests have been moving.
+	 * @param channels The selected channels, or nullptr for all of them.
+	 */
+	void read(DataFile* file, const std::vector<float*>& dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead);
+
+	/**
+	 * \overload void read(DataFile* file, const std::vector<float*>& dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead)
+	 */
+	void read(DataFile* file, const std::vector<double*>& dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead);
+
+private:
+	struct Key
+	{
+		uint64_t block;
+		unsigned int channel;
+		bool isDouble;
+
+		bool operator==(const Key& other) const
+		{
+			return block == other.block && channel == other.channel && isDouble == other.isDouble;
+		}
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const
+		{
+			uint64_t h = key.block*0x9E3779B97F4A7C15ULL ^ (static_cast<uint64_t>(key.channel) << 1 | key.isDouble);
+			return static_cast<size_t>(h ^ h >> 32);
+		}
+	};
+
+	struct Block
+	{
+		Key key;
+		std::vector<float> floatSamples;
+		std::vector<double> doubleSamples;
+
+		size_t bytes() const
+		{
+			return floatSamples.size()*sizeof(float) + doubleSamples.size()*sizeof(double);
+		}
+	};
+
+	mutable std::mutex cacheMutex;
+	size_t capacity;
+	unsigned int blockSize;
+	std::list<Block> lru; // The most recently used block is at the front.
+	std::unordered_map<Key, std::list<Block>::iterator, KeyHash> index;
+	BlockCacheStats stats;
+	uint64_t previousFirstSample = 0;
+	int direction = 1;
+
+	template<class T>
+	void readFloatDouble(DataFile* file, const std::vector<T*>& dataChannels, const std::vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample, bool readAhead);
+
+	void insert(Block&& block);
+	void evict();
+};
+
+} // namespace AlenkaFile
+
+#endif // BLOCKCACHE_H
@@ -1,9 +1,18 @@
 #include "../include/AlenkaFile/datafile.h"
 
+#include "../include/AlenkaFile/overview.h"
+#include "../include/AlenkaFile/threadpool.h"
+#include "asyncreader.h"
+#include "blockcache.h"
+#include "readcounters.h"
+
+#include <boost/filesystem.hpp>
 #include <pugixml.hpp>
 
 #include <algorithm>
 #include <cassert>
+#include <deque>
+#include <limits>
 #include <stdexcept>
 #include <type_traits>
 
@@ -15,8 +24,12 @@ namespace
 {
 
 template<typename T>
-void fillWithZeroes(vector<T*>& dataChannels, uint64_t n)
+void fillWithZeroes(DataFile* file, vector<T*>& dataChannels, uint64_t n)
 {
+	ALENKA_FILE_TIMER(timer, file, zeroFillNanoseconds);
+	ALENKA_FILE_COUNT(file, samplesZeroFilled, n*dataChannels.size());
+	(void)file;
+
 	for (auto& e : dataChannels)
 	{
 		for (uint64_t i = 0; i < n; i++)
@@ -27,20 +40,96 @@ void fillWithZeroes(vector<T*>& dataChannels, uint64_t n)
 	}
 }
 
+/**
+ * @brief A channel pointer array reused by the reads on this thread.
+ *
+ * Reads of many channels would otherwise allocate the array every time.
+ * A read nested in another one on the same thread, e.g. a readChannels()
+ * that reads another file, gets an array of its own, so the arrays of the
+ * outer calls stay intact.
+ */
+template<typename T>
+class ChannelPointers
+{
+public:
+	explicit ChannelPointers(size_t size) : pointers(acquire())
+	{
+		try
+		{
+			pointers.resize(size);
+		}
+		catch (...)
+		{
+			--depth();
+			throw;
+		}
+	}
+	~ChannelPointers()
+	{
+		--depth();
+	}
+
+	ChannelPointers(const ChannelPointers&) = delete;
+	ChannelPointers& operator=(const ChannelPointers&) = delete;
+
+	vector<T*>& get()
+	{
+		return pointers;
+	}
+
+private:
+	vector<T*>& pointers;
+
+	// A deque doesn't move its elements when it grows.
+	static deque<vector<T*>>& pool()
+	{
+		thread_local deque<vector<T*>> arrays;
+		return arrays;
+	}
+	static size_t& depth()
+	{
+		thread_local size_t nesting = 0;
+		return nesting;
+	}
+	static vector<T*>& acquire()
+	{
+		deque<vector<T*>>& arrays = pool();
+		if (arrays.size() <= depth())
+			arrays.emplace_back();
+		return arrays[depth()++];
+	}
+};
+
 template<typename T>
-void readSignalFloatDouble(DataFile* file, T* data, int64_t firstSample, int64_t lastSample)
+void readSignalFloatDouble(DataFile* file, BlockCache* cache, bool readAhead, T* data, const vector<unsigned int>* channels, int64_t firstSample, int64_t lastSample)
 {
 	if (lastSample < firstSample)
 		throw invalid_argument("'lastSample' must be greater than or equal to 'firstSample'.");
 
+	ALENKA_FILE_TIMER(timer, file, totalNanoseconds);
+	ALENKA_FILE_COUNT(file, readSignalCalls, 1);
+
+	unsigned int channelCount = file->getChannelCount();
+	if (channels)
+	{
+		for (unsigned int e : *channels)
+		{
+			if (channelCount <= e)
+				throw invalid_argument("Channel index out of range.");
+		}
+
+		channelCount = static_cast<unsigned int>(channels->size());
+	}
+
 	int64_t len = lastSample - firstSample + 1;
-	vector<T*> dataChannels(file->getChannelCount());
-	for (unsigned int i = 0; i < file->getChannelCount(); i++)
+	ChannelPointers<T> pointers(channelCount);
+	vector<T*>& dataChannels = pointers.get();
+	for (unsigned int i = 0; i < channelCount; i++)
 		dataChannels[i] = data + i*len;
 
 	if (firstSample < 0)
 	{
-		fillWithZeroes(dataChannels, min(-firstSample, len));
+		fillWithZeroes(file, dataChannels, min(-firstSample, len));
 		firstSample = 0;
 	}
 
@@ -48,21 +137,62 @@ void readSignalFloatDouble(DataFile* file, T* data, int64_t firstSample, int64_t
 
 	if (firstSample <= lastInFile)
 	{
-		file->readChannels(dataChannels, firstSample, lastInFile);
+		if (cache)
+			cache->read(file, dataChannels, channels, firstSample, lastInFile, readAhead);
+		else if (channels)
+			file->readChannels(dataChannels, *channels, firstSample, lastInFile);
+		else
+			file->readChannels(dataChannels, firstSample, lastInFile);
 
 		for (auto& e : dataChannels)
 			e += lastInFile - firstSample + 1;
 	}
 
 	if (lastInFile < lastSample)
-		fillWithZeroes(dataChannels, min(lastSample - lastInFile, len));
+		fillWithZeroes(file, dataChannels, min(lastSample - lastInFile, len));
 
 #ifndef NDEBUG
-	for (unsigned int i = 0; i < file->getChannelCount(); i++)
+	for (unsigned int i = 0; i < channelCount; i++)
 		assert(dataChannels.at(i) == data + (i + 1)*len && "Make sure that precisely the required number of samples was read.");
 #endif
 }
 
+template<typename T>
+void readChannelsSubset(DataFile* file, const vector<T*>& dataChannels, const vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample)
+{
+	assert(dataChannels.size() == channels.size());
+
+	uint64_t len = lastSample - firstSample + 1;
+	vector<T> buffer(file->getChannelCount()*len);
+
+	vector<T*> allChannels(file->getChannelCount());
+	for (unsigned int i = 0; i < file->getChannelCount(); i++)
+		allChannels[i] = buffer.data() + i*len;
+
+	file->readChannels(allChannels, firstSample, lastSample);
+
+	for (unsigned int i = 0; i < channels.size(); i++)
+		copy(buffer.data() + channels[i]*len, buffer.data() + (channels[i] + 1)*len, dataChannels[i]);
+}
+
+template<typename T>
+future<void> readSignalAsyncFuture(AsyncReader* reader, T* data, int64_t firstSample, int64_t lastSample)
+{
+	auto result = make_shared<promise<void>>();
+	future<void> f = result->get_future();
+
+	AsyncReader::Request request{is_same<T, double>::value, data, firstSample, lastSample, [result] (exception_ptr e)
+	{
+		if (e)
+			result->set_exception(e);
+		else
+			result->set_value();
+	}};
+
+	reader->submit(move(request));
+	return f;
+}
+
 void appendTrack(xml_node node, const Track& t)
 {
 	xml_node track = node.append_child("track");
@@ -76,9 +206,12 @@ void appendTrack(xml_node node, const Track& t)
 
 void appendTrackTable(xml_node node, AbstractTrackTable* tt)
 {
+	vector<Track> tracks(tt->rowCount());
+	tt->getRows(0, tt->rowCount(), tracks.data());
+
 	xml_node trackTable = node.append_child("trackTable");
-	for (int i = 0; i < tt->rowCount(); i++)
-		appendTrack(trackTable, tt->row(i));
+	for (const Track& t : tracks)
+		appendTrack(trackTable, t);
 }
 
 void appendEvent(xml_node node, const Event& e)
@@ -95,9 +228,12 @@ void appendEvent(xml_node node, const Event& e)
 
 void appendEventTable(xml_node node, AbstractEventTable* et)
 {
+	vector<Event> events(et->rowCount());
+	et->getRows(0, et->rowCount(), events.data());
+
 	xml_node eventTable = node.append_child("eventTable");
-	for (int i = 0; i < et->rowCount(); i++)
-		appendEvent(eventTable, et->row(i));
+	for (const Event& e : events)
+		appendEvent(eventTable, e);
 }
 
 void appendEventType(xml_node node, const EventType& et)
@@ -136,54 +272,48 @@ void buildXML(xml_document& xml, DataModel* dataModel)
 		appendEventType(eventTypeTable, dataModel->eventTypeTable()->row(i));
 }
 
-void loadTrack(xml_node node, AbstractTrackTable* tt)
+void loadTrack(xml_node node, Track* t)
 {
 	if (node)
 	{
-		int last = tt->rowCount();
-		tt->insertRows(last);
-		Track t = tt->row(last);
-
-		t.label = node.attribute("label").as_string();
-		DataModel::str2color(node.attribute("color").as_string(), t.color);
-		t.amplitude = node.attribute("amplitude").as_double();
-		t.hidden = node.attribute("hidden").as_bool();
-		t.code = node.child("code").text().as_string();
-
-		tt->row(last, t);
+		t->label = node.attribute("label").as_string();
+		DataModel::str2color(node.attribute("color").as_string(), t->color);
+		t->amplitude = node.attribute("amplitude").as_double();
+		t->hidden = node.attribute("hidden").as_bool();
+		t->code = node.child("code").text().as_string();
 	}
 }
 
+// The rows are collected first and inserted with one call.
 void loadTrackTable(xml_node node, AbstractTrackTable* tt)
 {
 	if (node)
 	{
+		int first = tt->rowCount();
+		vector<Track> tracks;
 		xml_node track = node.child("track");
 
 		while (track)
 		{
-			loadTrack(track, tt);
+			tracks.push_back(tt->defaultValue(first + static_cast<int>(tracks.size())));
+			loadTrack(track, &tracks.back());
 			track = track.next_sibling("track");
 		}
+
+		tt->insertRows(first, static_cast<int>(tracks.size()), tracks.data());
 	}
 }
 
-void loadEvent(xml_node node, AbstractEventTable* et)
+void loadEvent(xml_node node, Event* e)
 {
 	if (node)
 	{
-		int last = et->rowCount();
-		et->insertRows(last);
-		Event e = et->row(last);
-
-		e.label = node.attribute("label").as_string();
-		e.type = node.attribute("type").as_int();
-		e.position = node.attribute("position").as_int();
-		e.duration = node.attribute("duration").as_int();
-		e.channel = node.attribute("channel").as_int();
-		e.description = node.child("description").text().as_string();
-
-		et->row(last, e);
+		e->label = node.attribute("label").as_string();
+		e->type = node.attribute("type").as_int();
+		e->position = node.attribute("position").as_int();
+		e->duration = node.attribute("duration").as_int();
+		e->channel = node.attribute("channel").as_int();
+		e->description = node.child("description").text().as_string();
 	}
 }
 
@@ -191,13 +321,18 @@ void loadEventTable(xml_node node, AbstractEventTable* et)
 {
 	if (node)
 	{
+		int first = et->rowCount();
+		vector<Event> events;
 		xml_node event = node.child("event");
 
 		while (event)
 		{
-			loadEvent(event, et);
+			events.push_back(et->defaultValue(first + static_cast<int>(events.size())));
+			loadEvent(event, &events.back());
 			event = event.next_sibling("event");
 		}
+
+		et->insertRows(first, static_cast<int>(events.size()), events.data());
 	}
 }
 
@@ -233,21 +368,15 @@ void loadMontageTable(xml_node node, AbstractMontageTable* mt)
 	}
 }
 
-void loadEventType(xml_node node, AbstractEventTypeTable* ett)
+void loadEventType(xml_node node, EventType* et)
 {
 	if (node)
 	{
-		int last = ett->rowCount();
-		ett->insertRows(last);
-		EventType et = ett->row(last);
-
-		et.id = node.attribute("id").as_int();
-		et.name = node.attribute("name").as_string();
-		et.opacity = node.attribute("opacity").as_double();
-		DataModel::str2color(node.attribute("color").as_string(), et.color);
-		et.hidden = node.attribute("hidden").as_bool();
-
-		ett->row(last, et);
+		et->id = node.attribute("id").as_int();
+		et->name = node.attribute("name").as_string();
+		et->opacity = node.attribute("opacity").as_double();
+		DataModel::str2color(node.attribute("color").as_string(), et->color);
+		et->hidden = node.attribute("hidden").as_bool();
 	}
 }
 
@@ -255,13 +384,18 @@ void loadEventTypeTable(xml_node node, AbstractEventTypeTable* ett)
 {
 	if (node)
 	{
+		int first = ett->rowCount();
+		vector<EventType> types;
 		xml_node eventType = node.child("eventType");
 
 		while (eventType)
 		{
-			loadEventType(eventType, ett);
+			types.push_back(ett->defaultValue(first + static_cast<int>(types.size())));
+			loadEventType(eventType, &types.back());
 			eventType = eventType.next_sibling("eventType");
 		}
+
+		ett->insertRows(first, static_cast<int>(types.size()), types.data());
 	}
 }
 
@@ -279,6 +413,18 @@ void loadXML(xml_node node, DataModel* dataModel)
 namespace AlenkaFile
 {
 
+DataFile::DataFile(const string& filePath) : filePath(filePath)
+{
+#ifdef ALENKA_FILE_STATS
+	readCounters.reset(new ReadCounters());
+#endif
+}
+
+DataFile::~DataFile()
+{
+	stopBackgroundWork();
+}
+
 void DataFile::saveSecondaryFile(string montFilePath)
 {
 	if (montFilePath == "")
@@ -307,12 +453,83 @@ bool DataFile::loadSecondaryFile(string montFilePath)
 
 void DataFile::readSignal(float* data, int64_t firstSample, int64_t lastSample)
 {
-	readSignalFloatDouble(this, data, firstSample, lastSample);
+	readSignalFloatDouble(this, blockCache.get(), cacheReadAhead, data, nullptr, firstSample, lastSample);
 }
 
 void DataFile::readSignal(double* data, int64_t firstSample, int64_t lastSample)
 {
-	readSignalFloatDouble(this, data, firstSample, lastSample);
+	readSignalFloatDouble(this, blockCache.get(), cacheReadAhead, data, nullptr, firstSample, lastSample);
+}
+
+void DataFile::readSignal(float* data, const vector<unsigned int>& channels, int64_t firstSample, int64_t lastSample)
+{
+	readSignalFloatDouble(this, blockCache.get(), cacheReadAhead, data, &channels, firstSample, lastSample);
+}
+
+void DataFile::readSignal(double* data, const vector<unsigned int>& channels, int64_t firstSample, int64_t lastSample)
+{
+	readSignalFloatDouble(this, blockCache.get(), cacheReadAhead, data, &channels, firstSample, lastSample);
+}
+
+future<void> DataFile::readSignalAsync(float* data, int64_t firstSample, int64_t lastSample)
+{
+	if (lastSample < firstSample)
+		throw invalid_argument("'lastSample' must be greater than or equal to 'firstSample'.");
+
+	return readSignalAsyncFuture(startAsyncReads(), data, firstSample, lastSample);
+}
+
+future<void> DataFile::readSignalAsync(double* data, int64_t firstSample, int64_t lastSample)
+{
+	if (lastSample < firstSample)
+		throw invalid_argument("'lastSample' must be greater than or equal to 'firstSample'.");
+
+	return readSignalAsyncFuture(startAsyncReads(), data, firstSample, lastSample);
+}
+
+void DataFile::readSignalAsync(float* data, int64_t firstSample, int64_t lastSample, function<void(exception_ptr)> callback)
+{
+	if (lastSample < firstSample)
+		throw invalid_argument("'lastSample' must be greater than or equal to 'firstSample'.");
+
+	startAsyncReads()->submit(AsyncReader::Request{false, data, firstSample, lastSample, move(callback)});
+}
+
+void DataFile::readSignalAsync(double* data, int64_t firstSample, int64_t lastSample, function<void(exception_ptr)> callback)
+{
+	if (lastSample < firstSample)
+		throw invalid_argument("'lastSample' must be greater than or equal to 'firstSample'.");
+
+	startAsyncReads()->submit(AsyncReader::Request{true, data, firstSample, lastSample, move(callback)});
+}
+
+void DataFile::cancelAsyncReads(int64_t keepFirstSample, int64_t keepLastSample)
+{
+	AsyncReader* reader;
+
+	{
+		lock_guard<mutex> lock(asyncMutex);
+		reader = asyncReader.get();
+	}
+
+	if (reader)
+		reader->cancel(keepFirstSample, keepLastSample);
+}
+
+void DataFile::cancelAsyncReads()
+{
+	// No request overlaps this range.
+	cancelAsyncReads(numeric_limits<int64_t>::max(), numeric_limits<int64_t>::min());
+}
+
+void DataFile::readChannels(const vector<float*>& dataChannels, const vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample)
+{
+	readChannelsSubset(this, dataChannels, channels, firstSample, lastSample);
+}
+
+void DataFile::readChannels(const vector<double*>& dataChannels, const vector<unsigned int>& channels, uint64_t firstSample, uint64_t lastSample)
+{
+	readChannelsSubset(this, dataChannels, channels, firstSample, lastSample);
 }
 
 string DataFile::getLabel(unsigned int channel)
@@ -329,4 +546,205 @@ string DataFile::getLabel(unsigned int channel)
 	return "";
 }
 
+void DataFile::setCacheSize(size_t bytes, unsigned int blockSize)
+{
+	if (bytes == 0)
+		blockCache.reset();
+	else if (blockCache && blockCache->getBlockSize() == blockSize)
+		blockCache->setCapacity(bytes);
+	else
+		blockCache.reset(new BlockCache(bytes, max(1u, blockSize)));
+}
+
+size_t DataFile::getCacheSize() const
+{
+	return blockCache ? blockCache->getCapacity() : 0;
+}
+
+BlockCacheStats DataFile::getCacheStats() const
+{
+	return blockCache ? blockCache->getStats() : BlockCacheStats();
+}
+
+ReadStats DataFile::getReadStats() const
+{
+	ReadStats stats;
+
+	if (ReadCounters* c = readCounters.get())
+	{
+		const double toSeconds = 1e-9;
+
+		stats.enabled = true;
+		stats.readSignalCalls = c->readSignalCalls;
+		stats.bytesRead = c->bytesRead;
+		stats.ioCalls = c->ioCalls;
+		stats.recordsDecoded = c->recordsDecoded;
+		stats.samplesConverted = c->samplesConverted;
+		stats.samplesZeroFilled = c->samplesZeroFilled;
+		stats.totalSeconds = c->totalNanoseconds*toSeconds;
+		stats.ioSeconds = c->ioNanoseconds*toSeconds;
+		stats.decodeSeconds = c->decodeNanoseconds*toSeconds;
+		stats.zeroFillSeconds = c->zeroFillNanoseconds*toSeconds;
+	}
+
+	BlockCacheStats cacheStats = getCacheStats();
+	stats.cacheHits = cacheStats.hits;
+	stats.cacheMisses = cacheStats.misses;
+
+	return stats;
+}
+
+void DataFile::resetReadStats()
+{
+	if (readCounters)
+		readCounters->reset();
+}
+
+void DataFile::clearCache()
+{
+	if (blockCache)
+		blockCache->clear();
+}
+
+AsyncReader* DataFile::startAsyncReads()
+{
+	lock_guard<mutex> lock(asyncMutex);
+
+	if (!asyncReader)
+		asyncReader.reset(new AsyncReader(this));
+
+	return asyncReader.get();
+}
+
+void DataFile::buildOverview(bool inBackground)
+{
+	if (inBackground)
+	{
+		lock_guard<mutex> lock(overviewMutex);
+
+		// Only one background computation is started per file.
+		if (!overviewThread.joinable())
+		{
+			overviewThread = thread([this] ()
+			{
+				try
+				{
+					auto o = loadOrComputeOverview();
+
+					lock_guard<mutex> lock(overviewMutex);
+					overview = o;
+				}
+				catch (...)
+				{
+					// The overview just stays unavailable.
+				}
+			});
+		}
+	}
+	else
+	{
+		auto o = loadOrComputeOverview();
+
+		lock_guard<mutex> lock(overviewMutex);
+		overview = o;
+	}
+}
+
+shared_ptr<const Overview> DataFile::getOverview() const
+{
+	lock_guard<mutex> lock(overviewMutex);
+	return overview;
+}
+
+shared_ptr<const Overview> DataFile::loadOrComputeOverview()
+{
+	string sidecarPath = filePath + ".overview";
+
+	boost::system::error_code ec, sidecarEc;
+	time_t primaryTime = boost::filesystem::last_write_time(filePath, ec);
+	time_t sidecarTime = boost::filesystem::last_write_time(sidecarPath, sidecarEc);
+	bool sidecarIsNewer = !ec && !sidecarEc && primaryTime <= sidecarTime;
+
+	if (sidecarIsNewer)
+	{
+		shared_ptr<Overview> o = Overview::load(sidecarPath);
+
+		if (o && o->matches(this))
+			return o;
+	}
+
+	shared_ptr<Overview> o = Overview::compute(this, &overviewCancel);
+
+	if (o)
+	{
+		try
+		{
+			o->save(sidecarPath);
+		}
+		catch (runtime_error&)
+		{
+			// E.g. the directory is read-only; the overview is kept in memory only.
+			boost::filesystem::remove(sidecarPath, ec);
+		}
+	}
+
+	return o;
+}
+
+void DataFile::stopBackgroundWork()
+{
+	overviewCancel = true;
+	thread overviewWorker;
+
+	{
+		lock_guard<mutex> lock(overviewMutex);
+		overviewWorker = move(overviewThread);
+	}
+
+	// The worker takes the lock at its end, so it must be joined without it.
+	if (overviewWorker.joinable())
+		overviewWorker.join();
+
+	AsyncReader* reader;
+
+	// The reader is made even if there was none, so that the requests
+	// submitted from now on are cancelled rather than read.
+	{
+		lock_guard<mutex> lock(asyncMutex);
+
+		if (!asyncReader)
+			asyncReader.reset(new AsyncReader(this));
+		reader = asyncReader.get();
+	}
+
+	// The callbacks of the cancelled requests are called without the lock.
+	reader->stop();
+}
+
+void DataFile::resumeBackgroundWork()
+{
+	overviewCancel = false;
+
+	lock_guard<mutex> lock(asyncMutex);
+
+	if (asyncReader)
+		asyncReader->resume();
+}
+
+void DataFile::parallelFor(int count, const function<void(int)>& body, uint64_t samples)
+{
+	// Below this the synchronization costs more than the decoding itself.
+	const uint64_t minParallelSamples = 64*1024;
+
+	if (threadPool && count > 1 && samples >= minParallelSamples)
+	{
+		threadPool->parallelFor(count, body);
+	}
+	else
+	{
+		for (int i = 0; i < count; ++i)
+			body(i);
+	}
+}
+
 } // namespace AlenkaFile
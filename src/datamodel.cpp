@@ -1,6 +1,8 @@
 #include "../include/AlenkaFile/datamodel.h"
 
+#include <algorithm>
 #include <cassert>
+#include <iterator>
 
 using namespace AlenkaFile;
 using namespace std;
@@ -14,6 +16,25 @@ void eraseVector(vector<T>& v, int i, int count)
 	v.erase(v.begin() + i, v.begin() + i + count);
 }
 
+template<class T>
+void insertVector(vector<T>& v, int i, int count, T* values)
+{
+	v.insert(v.begin() + i, make_move_iterator(values), make_move_iterator(values + count));
+}
+
+// The default values are made first, so that the rows after them are moved only once.
+template<class T, class Table>
+void insertDefaults(vector<T>& v, const Table* table, int row, int count)
+{
+	vector<T> values;
+	values.reserve(count);
+
+	for (int i = 0; i < count; ++i)
+		values.push_back(table->defaultValue(row + i));
+
+	insertVector(v, row, count, values.data());
+}
+
 } // namespace
 
 namespace AlenkaFile
@@ -21,8 +42,7 @@ namespace AlenkaFile
 
 void EventTypeTable::insertRows(int row, int count)
 {
-	for (int i = 0; i < count; ++i)
-		table.insert(table.begin() + row + i, defaultValue(row + i));
+	insertDefaults(table, this, row, count);
 }
 
 void EventTypeTable::removeRows(int row, int count)
@@ -30,6 +50,21 @@ void EventTypeTable::removeRows(int row, int count)
 	eraseVector(table, row, count);
 }
 
+void EventTypeTable::insertRows(int row, int count, EventType* values)
+{
+	insertVector(table, row, count, values);
+}
+
+void EventTypeTable::getRows(int i, int count, EventType* values) const
+{
+	copy(table.begin() + i, table.begin() + i + count, values);
+}
+
+void EventTypeTable::setRows(int i, int count, EventType* values)
+{
+	move(values, values + count, table.begin() + i);
+}
+
 EventType EventTypeTable::defaultValue(int row) const
 {
 	EventType et;
@@ -45,8 +80,7 @@ EventType EventTypeTable::defaultValue(int row) const
 
 void EventTable::insertRows(int row, int count)
 {
-	for (int i = 0; i < count; ++i)
-		table.insert(table.begin() + row + i, defaultValue(row + i));
+	insertDefaults(table, this, row, count);
 }
 
 void EventTable::removeRows(int row, int count)
@@ -54,6 +88,21 @@ void EventTable::removeRows(int row, int count)
 	eraseVector(table, row, count);
 }
 
+void EventTable::insertRows(int row, int count, Event* values)
+{
+	insertVector(table, row, count, values);
+}
+
+void EventTable::getRows(int i, int count, Event* values) const
+{
+	copy(table.begin() + i, table.begin() + i + count, values);
+}
+
+void EventTable::setRows(int i, int count, Event* values)
+{
+	move(values, values + count, table.begin() + i);
+}
+
 Event EventTable::defaultValue(int row) const
 {
 	Event e;
@@ -69,8 +118,7 @@ Event EventTable::defaultValue(int row) const
 
 void TrackTable::insertRows(int row, int count)
 {
-	for (int i = 0; i < count; ++i)
-		table.insert(table.begin() + row + i, defaultValue(row + i));
+	insertDefaults(table, this, row, count);
 }
 
 void TrackTable::removeRows(int row, int count)
@@ -78,6 +126,21 @@ void TrackTable::removeRows(int row, int count)
 	eraseVector(table, row, count);
 }
 
+void TrackTable::insertRows(int row, int count, Track* values)
+{
+	insertVector(table, row, count, values);
+}
+
+void TrackTable::getRows(int i, int count, Track* values) const
+{
+	copy(table.begin() + i, table.begin() + i + count, values);
+}
+
+void TrackTable::setRows(int i, int count, Track* values)
+{
+	move(values, values + count, table.begin() + i);
+}
+
 Track TrackTable::defaultValue(int row) const
 {
 	Track t;
@@ -1,13 +1,23 @@
 #include "../include/AlenkaFile/edf.h"
+#include "../include/AlenkaFile/saveprogress.h"
+#include "../include/AlenkaFile/threadpool.h"
 
-#include "edflib_extended.h"
+#include "randomaccessfile.h"
+#include "readahead.h"
+#include "readcounters.h"
+#include "sampleconversion.h"
 #include <boost/filesystem.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
 #include <ctime>
 #include <cmath>
-#include <iostream>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <limits>
 #include <sstream>
 #include <set>
 
@@ -18,115 +28,917 @@ using namespace boost;
 namespace
 {
 
-const int MIN_READ_CHUNK = 200;
-const int OPT_READ_CHUNK = 2*1000;
-const int MAX_READ_CHUNK = 2*1000*1000;
+// The data records are read in batches of up to this many bytes.
+const int64_t READ_BATCH_SIZE = 4*1024*1024;
 
-void writeSignalInfo(int file, DataFile* dataFile, const edf_hdr_struct* edfhdr)
+const bool isLittleEndian = DataFile::testLittleEndian();
+
+// The export reads about this many bytes of samples at a time, and keeps up to
+// EXPORT_BUFFER_COUNT such blocks in memory.
+const size_t EXPORT_BLOCK_SIZE = 4*1024*1024;
+const int EXPORT_BUFFER_COUNT = 3;
+
+// The annotations are read this many bytes of data records at a time.
+const int64_t ANNOTATION_BATCH_SIZE = 4*1024*1024;
+
+int convertEventPositionBack(long long onset, double samplingFrequency)
+{
+	return static_cast<int>(round(static_cast<double>(onset)*samplingFrequency/10000/1000));
+}
+
+// Returns a field of the ASCII header without the trailing spaces.
+string headerField(const char* header, int offset, int size)
+{
+	string field(header + offset, size);
+	field.erase(field.find_last_not_of(' ') + 1);
+	return field;
+}
+
+// Parses a number of the ASCII header. The header always uses a decimal point,
+// so the number is read in the C locale whatever the locale of the application.
+double parseHeaderNumber(const string& text)
+{
+	istringstream stream(text);
+	stream.imbue(locale::classic());
+
+	double value;
+	if (!(stream >> value))
+		throw runtime_error("Bad number '" + text + "' in the EDF header.");
+	return value;
+}
+
+// Parses a numeric field of the ASCII header.
+double headerNumber(const char* header, int offset, int size)
 {
-	int res = 0;
+	return parseHeaderNumber(headerField(header, offset, size));
+}
 
-	for (unsigned int i = 0; i < dataFile->getChannelCount(); ++i)
+// Returns the text padded with spaces or cut to the size of a header field.
+string padField(string text, size_t size)
+{
+	text.resize(size, ' ');
+	return text;
+}
+
+// Formats a number for a header field of 8 characters with as many decimals as fit.
+// Like parseHeaderNumber(), it always uses the C locale.
+string formatHeaderNumber(double value)
+{
+	for (int precision = 7; precision >= 0; --precision)
 	{
-		res |=  edf_set_samplefrequency(file, i, static_cast<int>(dataFile->getSamplingFrequency()));
-		res |=  edf_set_physical_maximum(file, i, dataFile->getPhysicalMaximum(i));
-		res |=  edf_set_physical_minimum(file, i, dataFile->getPhysicalMinimum(i));
-		res |=  edf_set_digital_maximum(file, i, static_cast<int>(min<double>(dataFile->getDigitalMaximum(i), 32767)));
-		res |=  edf_set_digital_minimum(file, i, static_cast<int>(max<double>(dataFile->getDigitalMinimum(i), -32768)));
-		res |=  edf_set_label(file, i, dataFile->getLabel(i).c_str());
+		ostringstream stream;
+		stream.imbue(locale::classic());
+		stream << fixed << setprecision(precision) << value;
+		string text = stream.str();
 
-		if (edfhdr)
+		if (text.find('.') != string::npos)
 		{
-			res |=  edf_set_prefilter(file, i, edfhdr->signalparam[i].prefilter);
-			res |=  edf_set_transducer(file, i, edfhdr->signalparam[i].transducer);
-			res |=  edf_set_physical_dimension(file, i, edfhdr->signalparam[i].physdimension);
+			text.erase(text.find_last_not_of('0') + 1);
+			if (text.back() == '.')
+				text.pop_back();
 		}
+
+		if (text == "-0")
+			text = "0";
+		if (text.size() <= 8)
+			return text;
 	}
 
-	if (res)
-		cerr << "Warning: EDF bad values in writeSignalInfo" << endl;
-	assert(res == 0);
+	throw runtime_error("The number " + to_string(value) + " doesn't fit in the EDF header.");
 }
 
-void writeMetaInfo(int file, const edf_hdr_struct* edfhdr)
+// Returns the start date of the recording in the units of DataFile::getStartDate().
+double headerStartDate(const char* fixedHeader)
+{
+	// The two digit years are 1985 to 2084 as the specification says.
+	tm time = tm();
+	time.tm_mday = static_cast<int>(headerNumber(fixedHeader, 168, 2));
+	time.tm_mon = static_cast<int>(headerNumber(fixedHeader, 171, 2)) - 1;
+	int year = static_cast<int>(headerNumber(fixedHeader, 174, 2));
+	time.tm_year = year + (year < 85 ? 100 : 0);
+	time.tm_hour = static_cast<int>(headerNumber(fixedHeader, 176, 2));
+	time.tm_min = static_cast<int>(headerNumber(fixedHeader, 179, 2));
+	time.tm_sec = static_cast<int>(headerNumber(fixedHeader, 182, 2));
+	time.tm_isdst = -1;
+
+	return static_cast<double>(mktime(&time))/24/60/60 + DataFile::daysUpTo1970;
+}
+
+} // namespace
+
+namespace AlenkaFile
 {
-	if (!edfhdr)
-		return;
 
-	int res = 0;
+/**
+ * @brief The header of an EDF or BDF file.
+ *
+ * The fields needed to find things in the data records are parsed right
+ * away; the rest is kept as the raw text, which can be of any size, so
+ * there is no limit on the number of signals.
+ */
+struct EdfLayout
+{
+	char fixedHeader[256];
+	bool bdf;
+	int sampleBytes;
+	int64_t headerBytes;
+	int64_t recordBytes = 0;
+	int64_t numberOfDataRecords;
+	double duration;
+	std::vector<std::string> labels;
+	std::vector<int64_t> samplesPerRecord;
+	std::vector<int64_t> signalOffset; ///< Where the signal's samples start in a record.
+	std::vector<char> signalHeader; ///< The signal headers stored field after field, as in the file.
+
+	bool isAnnotation(int signal) const
+	{
+		return labels[signal] == "EDF Annotations" || labels[signal] == "BDF Annotations";
+	}
+
+	/**
+	 * @brief Returns a field of a signal header.
+	 * @param offset The offset of the field for the first signal divided by the number of signals,
+	 * i.e. 16 for the transducer type, 104 for the physical minimum and so on.
+	 */
+	std::string signalField(int signal, int offset, int size) const
+	{
+		return headerField(signalHeader.data(), offset*static_cast<int>(labels.size()) + size*signal, size);
+	}
+	double signalNumber(int signal, int offset, int size) const
+	{
+		return headerNumber(signalHeader.data(), offset*static_cast<int>(labels.size()) + size*signal, size);
+	}
+};
+
+} // namespace AlenkaFile
+
+namespace
+{
+
+EdfLayout readEdfLayout(const RandomAccessFile& file, const string& filePath)
+{
+	EdfLayout layout;
+	file.read(layout.fixedHeader, 256, 0);
+	const char* fixedHeader = layout.fixedHeader;
+
+	if (string(fixedHeader, 8) == "0       ")
+		layout.bdf = false;
+	else if (string(fixedHeader, 8) == "\xFF" "BIOSEMI")
+		layout.bdf = true;
+	else
+		throw runtime_error("Unrecognized file format.");
+
+	layout.sampleBytes = layout.bdf ? 3 : 2;
+	layout.headerBytes = static_cast<int64_t>(headerNumber(fixedHeader, 184, 8));
+	layout.numberOfDataRecords = static_cast<int64_t>(headerNumber(fixedHeader, 236, 8));
+	layout.duration = headerNumber(fixedHeader, 244, 8);
+	int ns = static_cast<int>(headerNumber(fixedHeader, 252, 4));
+
+	if (ns < 1 || layout.headerBytes != 256*(ns + 1))
+		throw runtime_error("Bad EDF header.");
+
+	layout.signalHeader.resize(256*ns);
+	file.read(layout.signalHeader.data(), layout.signalHeader.size(), 256);
+
+	for (int i = 0; i < ns; ++i)
+	{
+		int64_t n = static_cast<int64_t>(headerNumber(layout.signalHeader.data(), 216*ns + 8*i, 8));
 
-	res |=  edf_set_startdatetime(file, edfhdr->startdate_year, edfhdr->startdate_month, edfhdr->startdate_day,
-		edfhdr->starttime_hour, edfhdr->starttime_minute, edfhdr->starttime_second);
-	res |=  edf_set_patientname(file, edfhdr->patient_name);
-	res |=  edf_set_patientcode(file, edfhdr->patientcode);
+		layout.labels.push_back(headerField(layout.signalHeader.data(), 16*i, 16));
+		layout.samplesPerRecord.push_back(n);
+		layout.signalOffset.push_back(layout.recordBytes);
+		layout.recordBytes += n*layout.sampleBytes;
+	}
 
-	// TODO: Figure out how to set these. This version causes problems. Or don't copy it: isntead show a warning
-	// that the file will have some incorrect values, and make it a known issue.
-	//edf_set_gender_char(file, edfhdr->gender);
-	//edf_set_birthdate_char(file, edfhdr->birthdate);
+	// The count is -1 while the recording is still being written.
+	if (layout.numberOfDataRecords < 0 && layout.recordBytes > 0)
+		layout.numberOfDataRecords = (static_cast<int64_t>(filesystem::file_size(filePath)) - layout.headerBytes)/layout.recordBytes;
 
-	res |=  edf_set_patient_additional(file, edfhdr->patient_additional);
-	res |=  edf_set_admincode(file, edfhdr->admincode);
-	res |=  edf_set_technician(file, edfhdr->technician);
-	res |=  edf_set_equipment(file, edfhdr->equipment);
-	res |=  edf_set_recording_additional(file, edfhdr->recording_additional);
+	layout.numberOfDataRecords = max<int64_t>(0, layout.numberOfDataRecords);
 
-	if (res)
-		cerr << "Warning: EDF bad values in writeMetaInfo" << endl;
-	assert(res == 0);
+	return layout;
 }
 
-long long convertEventPosition(int sample, double samplingFrequency)
+/**
+ * @brief An annotation in the form EDF::loadEvents() uses.
+ */
+struct EdfAnnotation
 {
-	return static_cast<long long>(round(sample/samplingFrequency*10000));
+	long long onset; ///< In units of 100 ns from the start of the first data record.
+	long long duration; ///< In units of 100 ns; zero if the TAL has none.
+	string text;
+};
+
+// Parses an unsigned TAL number like "12.5" to units of 100 ns.
+bool parseTalNumber(const char* text, size_t size, long long* time)
+{
+	if (size == 0)
+		return false;
+
+	long long value = 0, fraction = 0;
+	int fractionDigits = 0;
+	size_t i = 0;
+
+	for (; i < size && isdigit(static_cast<unsigned char>(text[i])); ++i)
+		value = 10*value + (text[i] - '0');
+
+	if (i < size && text[i] == '.')
+	{
+		for (++i; i < size && isdigit(static_cast<unsigned char>(text[i])); ++i)
+		{
+			if (fractionDigits < 7)
+			{
+				fraction = 10*fraction + (text[i] - '0');
+				++fractionDigits;
+			}
+		}
+	}
+
+	if (i != size)
+		return false;
+
+	for (; fractionDigits < 7; ++fractionDigits)
+		fraction *= 10;
+
+	*time = value*10*1000*1000 + fraction;
+	return true;
 }
 
-int convertEventPositionBack(long long onset, double samplingFrequency)
+// Parses a TAL time stamp like "+12.5" to units of 100 ns.
+bool parseTalTime(const string& text, long long* time)
 {
-	return static_cast<int>(round(static_cast<double>(onset)*samplingFrequency/10000/1000));
+	if (text.size() < 2 || (text[0] != '+' && text[0] != '-') || !parseTalNumber(text.data() + 1, text.size() - 1, time))
+		return false;
+
+	if (text[0] == '-')
+		*time = -*time;
+	return true;
 }
 
-} // namespace
+/**
+ * @brief Parses the TALs of one annotation signal of one data record.
+ *
+ * The time-keeping TAL (the first one in the record with no text) is not
+ * returned; its onset is stored to recordOnset instead, if that is not null.
+ * Parsing stops at the first malformed TAL.
+ */
+void parseTals(const char* data, size_t size, vector<EdfAnnotation>* annotations, long long* recordOnset)
+{
+	size_t i = 0;
+	bool first = true;
 
-namespace AlenkaFile
+	auto readUntil = [&] (string* text, char end, char alternative) -> char
+	{
+		text->clear();
+
+		for (; i < size; ++i)
+		{
+			if (data[i] == end || data[i] == alternative)
+				return data[i++];
+			if (data[i] == 0)
+				return 0;
+
+			text->push_back(data[i]);
+		}
+
+		return 0;
+	};
+
+	string onsetText, durationText, text;
+
+	while (i < size && data[i] != 0)
+	{
+		char c = readUntil(&onsetText, 0x14, 0x15);
+		long long duration = 0;
+
+		if (c == 0x15)
+		{
+			c = readUntil(&durationText, 0x14, 0x14);
+
+			if (c == 0x14 && !parseTalNumber(durationText.data(), durationText.size(), &duration))
+				return;
+		}
+
+		long long onset;
+		if (c != 0x14 || !parseTalTime(onsetText, &onset))
+			return;
+
+		// The annotations, each terminated by 0x14; the TAL ends with a zero.
+		// The time-keeping TAL is the first one, and its first annotation is empty.
+		for (int j = 0; i < size && data[i] != 0; ++j)
+		{
+			if (readUntil(&text, 0x14, 0x14) != 0x14)
+				return;
+
+			if (!text.empty())
+				annotations->push_back(EdfAnnotation{onset, duration, text});
+			else if (first && j == 0 && recordOnset)
+				*recordOnset = onset;
+		}
+
+		first = false;
+		++i; // Skip the zero that ends the TAL.
+	}
+}
+
+// Parses an integer the way sscanf's %d does: white space and a sign can precede the digits.
+bool parseInt(const char** text, const char* end, int* value)
 {
+	const char* p = *text;
+	while (p < end && isspace(static_cast<unsigned char>(*p)))
+		++p;
+
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		++p;
+
+	if (p == end || !isdigit(static_cast<unsigned char>(*p)))
+		return false;
+
+	int n = 0;
+	for (; p < end && isdigit(static_cast<unsigned char>(*p)); ++p)
+		n = 10*n + (*p - '0');
+
+	*value = negative ? -n : n;
+	*text = p;
+	return true;
+}
 
-EDF::EDF(const string& filePath) : DataFile(filePath)
+/**
+ * @brief Fills in the fields of e stored in the text of an annotation.
+ *
+ * EDF::save() writes "t=<type> c=<channel>|<label>|<description>". The type
+ * and the channel are left unchanged if they are missing. The text of an
+ * annotation without the bars (e.g. from another program) becomes both the
+ * label and the description.
+ */
+void parseEventText(const string& text, Event* e)
 {
-	edfhdr = new edf_hdr_struct;
+	const char* p = text.data();
+	const char* end = p + text.size();
 
-	openFile();
+	if (end - p >= 2 && p[0] == 't' && p[1] == '=')
+	{
+		p += 2;
+
+		if (parseInt(&p, end, &e->type))
+		{
+			while (p < end && isspace(static_cast<unsigned char>(*p)))
+				++p;
+
+			if (end - p >= 2 && p[0] == 'c' && p[1] == '=')
+			{
+				p += 2;
+				parseInt(&p, end, &e->channel);
+			}
+		}
+	}
+
+	size_t labelStart = text.find('|') + 1; // Zero if there is no bar.
+	size_t labelEnd = min(text.find('|', labelStart), text.size());
+
+	if (labelStart < labelEnd)
+		e->label.assign(text, labelStart, labelEnd - labelStart);
+
+	size_t descriptionStart = labelEnd < text.size() ? labelEnd + 1 : 0;
+
+	if (descriptionStart < text.size())
+		e->description.assign(text, descriptionStart, string::npos);
 }
 
-EDF::~EDF()
+/**
+ * @brief Reads all the annotations of an EDF+ or BDF+ file.
+ *
+ * The data records are split into batches that are read and parsed in
+ * parallel, each into its own list, and the lists are joined in the order
+ * of the records. The onsets are relative to the start of the first data
+ * record.
+ * @param pool The pool to use. If null, a temporary one is created when
+ * there is more than one batch.
+ */
+vector<EdfAnnotation> readEdfAnnotations(const string& filePath, ThreadPool* pool, const atomic<bool>* cancel)
+{
+	RandomAccessFile file;
+	file.open(filePath);
+	EdfLayout layout = readEdfLayout(file, filePath);
+
+	vector<int> annotationSignals;
+	for (int i = 0; i < static_cast<int>(layout.labels.size()); ++i)
+	{
+		if (layout.isAnnotation(i))
+			annotationSignals.push_back(i);
+	}
+
+	vector<EdfAnnotation> annotations;
+
+	if (annotationSignals.empty() || layout.recordBytes <= 0)
+		return annotations;
+
+	long long startOffset = 0;
+	int64_t recordsPerBatch = max<int64_t>(1, ANNOTATION_BATCH_SIZE/layout.recordBytes);
+	int batchCount = static_cast<int>((layout.numberOfDataRecords + recordsPerBatch - 1)/recordsPerBatch);
+	vector<vector<EdfAnnotation>> batchAnnotations(batchCount);
+
+	auto parseBatch = [&] (int batch)
+	{
+		if (cancel && *cancel)
+			return;
+
+		int64_t r = batch*recordsPerBatch;
+		int64_t records = min(recordsPerBatch, layout.numberOfDataRecords - r);
+		vector<char> buffer(static_cast<size_t>(records*layout.recordBytes));
+		file.read(buffer.data(), buffer.size(), layout.headerBytes + r*layout.recordBytes);
+
+		for (int64_t k = 0; k < records; ++k)
+		{
+			for (unsigned int j = 0; j < annotationSignals.size(); ++j)
+			{
+				int signal = annotationSignals[j];
+				const char* data = buffer.data() + k*layout.recordBytes + layout.signalOffset[signal];
+				size_t size = static_cast<size_t>(layout.samplesPerRecord[signal]*layout.sampleBytes);
+
+				// Only the first batch writes startOffset.
+				parseTals(data, size, &batchAnnotations[batch], r + k == 0 && j == 0 ? &startOffset : nullptr);
+			}
+		}
+	};
+
+	if (batchCount > 1)
+	{
+		unique_ptr<ThreadPool> localPool;
+		if (!pool)
+		{
+			localPool.reset(new ThreadPool());
+			pool = localPool.get();
+		}
+
+		pool->parallelFor(batchCount, parseBatch);
+	}
+	else if (batchCount == 1)
+	{
+		parseBatch(0);
+	}
+
+	if (cancel && *cancel)
+		return vector<EdfAnnotation>();
+
+	size_t count = 0;
+	for (const vector<EdfAnnotation>& e : batchAnnotations)
+		count += e.size();
+	annotations.reserve(count);
+
+	for (vector<EdfAnnotation>& batch : batchAnnotations)
+	{
+		for (EdfAnnotation& e : batch)
+		{
+			e.onset -= startOffset;
+			annotations.push_back(std::move(e));
+		}
+	}
+
+	return annotations;
+}
+
+// Formats a non-negative time in units of 100 ns as seconds without trailing zeros.
+string formatTalTime(long long time)
 {
-	delete[] readChunkBuffer;
+	string text = to_string(time/(10*1000*1000));
+	long long fraction = time%(10*1000*1000);
 
-	int err = edfclose_file(edfhdr->handle);
-	delete edfhdr;
+	if (fraction != 0)
+	{
+		string digits = to_string(fraction);
+		digits.insert(0, 7 - digits.size(), '0');
+		digits.erase(digits.find_last_not_of('0') + 1);
+		text += "." + digits;
+	}
 
-	if (err < 0)
-		cerr << "Error closing EDF file" << endl;
+	return text;
 }
 
-double EDF::getStartDate() const
+string talOnset(long long time)
+{
+	return (time < 0 ? "-" : "+") + formatTalTime(time < 0 ? -time : time);
+}
+
+/**
+ * @brief Calls f(event, text) for every event that EDF::save() stores to the file.
+ *
+ * These are the events of the montages marked for saving that refer to an
+ * existing channel and type. The text encodes the fields that the onset and
+ * duration don't, and EDF::loadEvents() parses it back.
+ */
+template<class F>
+void forEachSavedEvent(DataFile* file, F f)
+{
+	AbstractMontageTable* montageTable = file->getDataModel()->montageTable();
+	int numberOfChannels = static_cast<int>(file->getChannelCount());
+
+	for (int i = 0; i < montageTable->rowCount(); ++i)
+	{
+		if (!montageTable->row(i).save)
+			continue;
+
+		AbstractEventTable* eventTable = montageTable->eventTable(i);
+
+		for (int j = 0; j < eventTable->rowCount(); ++j)
+		{
+			Event e = eventTable->row(j);
+
+			// Skip events belonging to tracks greater thatn the number of channels in the file.
+			// TODO: Perhaps make a warning about this?
+			if (-1 <= e.channel && e.channel < numberOfChannels && e.type >= 0)
+			{
+				stringstream ss;
+				ss << "t=" << e.type << " c=" << e.channel << "|" << e.label << "|" << e.description;
+				f(e, ss.str());
+			}
+		}
+	}
+}
+
+// Returns the onset of the time-keeping TAL at the start of an annotation signal,
+// or an empty string if there is none.
+string timekeepingOnset(const char* data, size_t size)
+{
+	size_t end = 0;
+	while (end < size && data[end] != 0x14 && data[end] != 0)
+		++end;
+
+	string onset(data, end);
+	long long time;
+
+	if (end + 1 < size && data[end] == 0x14 && data[end + 1] == 0x14 && parseTalTime(onset, &time))
+		return onset;
+	return "";
+}
+
+/**
+ * @brief Reads the onsets of all the data records from their time-keeping TALs.
+ *
+ * Only the start of the first annotation signal of every record is read.
+ * The onsets are in units of 100 ns relative to the first record. A record
+ * without a valid time-keeping TAL is assumed to follow the previous one.
+ */
+vector<long long> readRecordOnsets(const RandomAccessFile& file, const EdfLayout& layout)
+{
+	int annotationSignal = -1;
+	for (int i = 0; i < static_cast<int>(layout.labels.size()) && annotationSignal < 0; ++i)
+	{
+		if (layout.isAnnotation(i))
+			annotationSignal = i;
+	}
+
+	const long long recordTime = llround(layout.duration*10*1000*1000);
+	vector<long long> onsets(static_cast<size_t>(layout.numberOfDataRecords));
+
+	if (annotationSignal < 0)
+	{
+		for (size_t r = 0; r < onsets.size(); ++r)
+			onsets[r] = r*recordTime;
+		return onsets;
+	}
+
+	// The time-keeping TAL is short, so this is enough even for long files.
+	size_t size = static_cast<size_t>(min<int64_t>(64, layout.samplesPerRecord[annotationSignal]*layout.sampleBytes));
+	vector<char> buffer(size);
+
+	for (size_t r = 0; r < onsets.size(); ++r)
+	{
+		file.read(buffer.data(), size, layout.headerBytes + r*layout.recordBytes + layout.signalOffset[annotationSignal]);
+
+		long long onset;
+		if (parseTalTime(timekeepingOnset(buffer.data(), size), &onset))
+			onsets[r] = onset;
+		else
+			onsets[r] = r == 0 ? 0 : onsets[r - 1] + recordTime;
+	}
+
+	long long startOffset = onsets.empty() ? 0 : onsets[0];
+	for (long long& e : onsets)
+		e -= startOffset;
+
+	return onsets;
+}
+
+/**
+ * @brief The TALs of the annotations to be written and the records they belong to.
+ *
+ * The TALs are stored in the order of their onsets, each in the record it
+ * starts in, or in one of the following ones if that one is full. The
+ * records need not be contiguous, so each is found by its own onset.
+ */
+class TalList
+{
+public:
+	/**
+	 * @brief TalList constructor.
+	 * @param startOffset The onset of the first record, which is added to the onsets.
+	 * @param recordOnsets The onsets of the records relative to the first one in units of 100 ns.
+	 */
+	TalList(vector<EdfAnnotation> annotations, long long startOffset, const vector<long long>& recordOnsets) : recordLoad(recordOnsets.size())
+	{
+		stable_sort(annotations.begin(), annotations.end(), [] (const EdfAnnotation& a, const EdfAnnotation& b) { return a.onset < b.onset; });
+
+		for (const EdfAnnotation& e : annotations)
+		{
+			string tal = talOnset(e.onset + startOffset);
+			if (e.duration > 0)
+				tal += "\x15" + formatTalTime(e.duration);
+
+			string text = e.text;
+			replace_if(text.begin(), text.end(), [] (char c) { return c == 0x14 || c == 0x15 || c == 0; }, ' ');
+			tal += "\x14" + text + "\x14" + string(1, 0);
+
+			int64_t r = upper_bound(recordOnsets.begin(), recordOnsets.end(), e.onset) - recordOnsets.begin() - 1;
+			r = max<int64_t>(0, r);
+
+			tals.push_back(tal);
+			talRecord.push_back(r);
+			recordLoad[r] += tal.size();
+		}
+	}
+
+	/**
+	 * @brief Returns the room needed by the busiest record and a time-keeping TAL of the given size.
+	 */
+	int64_t estimateSize(int64_t timekeepingBytes) const
+	{
+		return timekeepingBytes + (recordLoad.empty() ? 0 : *max_element(recordLoad.begin(), recordLoad.end()));
+	}
+
+	void restart()
+	{
+		next = 0;
+	}
+	bool done() const
+	{
+		return next == tals.size();
+	}
+
+	/**
+	 * @brief Fills the annotation signal of record r.
+	 *
+	 * The time-keeping TAL with the onset goes first, followed by as many of
+	 * the remaining TALs as fit. The rest is filled with zeros.
+	 * @param out If null, the TALs are only counted as if they were written.
+	 * @return False if not even the time-keeping TAL fits.
+	 */
+	bool fill(char* out, size_t size, const string& onset, int64_t r)
+	{
+		string content = onset + "\x14\x14" + string(1, 0);
+		if (content.size() > size)
+			return false;
+
+		while (next < tals.size() && talRecord[next] <= r && content.size() + tals[next].size() <= size)
+			content += tals[next++];
+
+		if (out)
+		{
+			copy(content.begin(), content.end(), out);
+			fill_n(out + content.size(), size - content.size(), 0);
+		}
+
+		return true;
+	}
+
+private:
+	vector<string> tals;
+	vector<int64_t> talRecord;
+	vector<int64_t> recordLoad;
+	size_t next = 0;
+};
+
+// Converts physical values to the little-endian digital samples stored in the file.
+void encodeSamples(const double* in, int n, double bitValue, double digitalOffset, int digitalMinimum, int digitalMaximum, int sampleBytes, char* out)
+{
+	for (int i = 0; i < n; ++i, out += sampleBytes)
+	{
+		double value = round(in[i]/bitValue - digitalOffset);
+
+		// NaN becomes the minimum.
+		int digital = value >= digitalMaximum ? digitalMaximum : value > digitalMinimum ? static_cast<int>(value) : digitalMinimum;
+
+		out[0] = static_cast<char>(digital & 0xFF);
+		out[1] = static_cast<char>((digital >> 8) & 0xFF);
+		if (sampleBytes == 3)
+			out[2] = static_cast<char>((digital >> 16) & 0xFF);
+	}
+}
+
+/**
+ * @brief Copies an EDF+ or BDF+ file and replaces its annotations.
+ *
+ * The header and the samples of the ordinary signals are copied byte for byte,
+ * so the signal doesn't change no matter how many times the file is saved.
+ * Only the first annotation signal is rewritten: every record keeps its
+ * time-keeping TAL, and the annotations are stored in the record they start
+ * in, or in the following ones when that one is full. If they don't fit, the
+ * annotation signal is made longer. The other annotation signals are
+ * cleared, because their annotations were loaded together with the rest.
+ *
+ * Returns false without creating the file if there is no annotation signal.
+ */
+bool copyEdfWithAnnotations(const string& from, const string& to, vector<EdfAnnotation> annotations,
+	uint64_t totalSamples, SaveProgress* progress)
+{
+	RandomAccessFile input;
+	input.open(from);
+	EdfLayout layout = readEdfLayout(input, from);
+	int ns = static_cast<int>(layout.labels.size());
+
+	int annotationSignal = -1;
+	vector<int> clearedSignals;
+
+	for (int i = 0; i < ns; ++i)
+	{
+		if (layout.isAnnotation(i))
+		{
+			if (annotationSignal < 0)
+				annotationSignal = i;
+			else
+				clearedSignals.push_back(i);
+		}
+	}
+
+	if (annotationSignal < 0 || layout.numberOfDataRecords <= 0)
+		return false;
+
+	const int64_t records = layout.numberOfDataRecords;
+	const int64_t annotationOffset = layout.signalOffset[annotationSignal];
+	const int64_t oldAnnotationBytes = layout.samplesPerRecord[annotationSignal]*layout.sampleBytes;
+	const long long recordTime = llround(layout.duration*10*1000*1000);
+
+	vector<char> header(static_cast<size_t>(layout.headerBytes));
+	input.read(header.data(), header.size(), 0);
+
+	// The onsets in the file are relative to the first time-keeping TAL.
+	vector<char> firstRecord(static_cast<size_t>(oldAnnotationBytes));
+	input.read(firstRecord.data(), firstRecord.size(), layout.headerBytes + annotationOffset);
+	long long startOffset = 0;
+	parseTalTime(timekeepingOnset(firstRecord.data(), firstRecord.size()), &startOffset);
+
+	// The events are placed by the real onsets of the records, which include the gaps of EDF+D files.
+	vector<long long> onsets = readRecordOnsets(input, layout);
+	TalList tals(std::move(annotations), startOffset, onsets);
+
+	// Start with enough room for the busiest record and a time-keeping TAL.
+	int64_t timekeepingBytes = talOnset(startOffset + onsets.back() + recordTime).size() + 3;
+	int64_t annotationBytes = max(oldAnnotationBytes, tals.estimateSize(timekeepingBytes));
+
+	// Writes the file with the given annotation signal size; returns false if the annotations don't fit.
+	auto write = [&] (int64_t annotationBytes) -> bool
+	{
+		int64_t spr = (annotationBytes + layout.sampleBytes - 1)/layout.sampleBytes;
+		annotationBytes = spr*layout.sampleBytes;
+		int64_t shift = annotationBytes - oldAnnotationBytes;
+		int64_t newRecordBytes = layout.recordBytes + shift;
+
+		string sprField = to_string(spr);
+		if (sprField.size() > 8)
+			throw runtime_error("The EDF annotations don't fit in the annotation signal.");
+		sprField = padField(sprField, 8);
+		copy(sprField.begin(), sprField.end(), header.begin() + 256 + 216*ns + 8*annotationSignal);
+
+		ofstream output(to, ios_base::binary | ios_base::trunc);
+		output.write(header.data(), header.size());
+
+		if (progress)
+			progress->start(totalSamples);
+
+		int64_t recordsPerBatch = max<int64_t>(1, READ_BATCH_SIZE/layout.recordBytes);
+		vector<char> inputBuffer, outputBuffer;
+		tals.restart();
+
+		for (int64_t r0 = 0; r0 < records; r0 += recordsPerBatch)
+		{
+			int64_t count = min(recordsPerBatch, records - r0);
+			inputBuffer.resize(static_cast<size_t>(count*layout.recordBytes));
+			outputBuffer.assign(static_cast<size_t>(count*newRecordBytes), 0);
+			input.read(inputBuffer.data(), inputBuffer.size(), layout.headerBytes + r0*layout.recordBytes);
+
+			for (int64_t k = 0; k < count; ++k)
+			{
+				const char* in = inputBuffer.data() + k*layout.recordBytes;
+				char* out = outputBuffer.data() + k*newRecordBytes;
+
+				// The samples before and after the annotation signal are copied as they are.
+				copy(in, in + annotationOffset, out);
+				copy(in + annotationOffset + oldAnnotationBytes, in + layout.recordBytes, out + annotationOffset + annotationBytes);
+
+				for (int signal : clearedSignals)
+				{
+					int64_t signalOffset = layout.signalOffset[signal] + (signal > annotationSignal ? shift : 0);
+					fill_n(out + signalOffset, layout.samplesPerRecord[signal]*layout.sampleBytes, 0);
+				}
+
+				string onset = timekeepingOnset(in + annotationOffset, static_cast<size_t>(oldAnnotationBytes));
+				if (onset.empty())
+					onset = talOnset(startOffset + onsets[r0 + k]);
+
+				if (!tals.fill(out + annotationOffset, static_cast<size_t>(annotationBytes), onset, r0 + k))
+					return false;
+			}
+
+			output.write(outputBuffer.data(), outputBuffer.size());
+
+			if (!output)
+				throw runtime_error("Error writing file '" + to + "'.");
+
+			if (progress)
+			{
+				uint64_t samples = static_cast<uint64_t>(static_cast<double>(totalSamples)*(r0 + count)/records)
+					- static_cast<uint64_t>(static_cast<double>(totalSamples)*r0/records);
+				progress->update(samples, outputBuffer.size());
+			}
+		}
+
+		output.close();
+
+		if (!output)
+			throw runtime_error("Error writing file '" + to + "'.");
+
+		return tals.done();
+	};
+
+	try
+	{
+		while (!write(annotationBytes))
+			annotationBytes *= 2;
+	}
+	catch (...)
+	{
+		system::error_code ec;
+		filesystem::remove(to, ec);
+		throw;
+	}
+
+	return true;
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief Reads the annotations of an EDF+ file on a background thread.
+ */
+class EDFAnnotationReader
+{
+public:
+	EDFAnnotationReader(const string& filePath, ThreadPool* pool) :
+		result(std::async(std::launch::async, readEdfAnnotations, filePath, pool, &cancel)) {}
+	~EDFAnnotationReader()
+	{
+		cancel = true;
+		if (result.valid())
+			result.wait();
+	}
+
+	void wait() const
+	{
+		result.wait();
+	}
+
+	/**
+	 * @brief Waits for the annotations; can be called only once.
+	 */
+	vector<EdfAnnotation> get()
+	{
+		return result.get();
+	}
+
+private:
+	atomic<bool> cancel {false};
+	std::future<vector<EdfAnnotation>> result;
+};
+
+EDF::EDF(const string& filePath, Annotations annotations) : DataFile(filePath), annotations(annotations)
 {
-	tm time;
+	openFile();
 
-	time.tm_mday = edfhdr->startdate_day;
-	time.tm_mon = edfhdr->startdate_month - 1;
-	time.tm_year = edfhdr->startdate_year - 1900;
+	if (annotations != Annotations::OnLoad)
+		annotationReader.reset(new EDFAnnotationReader(filePath, getThreadPool()));
+	if (annotations == Annotations::OnOpen)
+		annotationReader->wait();
+}
 
-	time.tm_sec = edfhdr->starttime_second;
-	time.tm_min = edfhdr->starttime_minute;
-	time.tm_hour = edfhdr->starttime_hour;
+EDF::~EDF()
+{
+	stopBackgroundWork();
+	annotationReader.reset();
+}
 
-	return static_cast<double>(mktime(&time))/24/60/60 + daysUpTo1970;
+double EDF::getStartDate() const
+{
+	return headerStartDate(layout->fixedHeader);
 }
 
-// TODO: Allow tracking through a progress dialog as this can take a long time
-// (because it has to recreate the whole file from scratch).
-void EDF::save()
+// EDF+ and BDF+ files are saved by copying the data records and rewriting only
+// the annotations. Files without an annotation signal have to be recreated
+// from scratch, which can take a long time.
+void EDF::save(SaveProgress* progress)
 {
 	saveSecondaryFile();
 
@@ -144,11 +956,27 @@ void EDF::save()
 
 	// Make the new file under a temporary name.
 	filesystem::path tmpPath = filesystem::unique_path(getFilePath() + ".%%%%.tmp");
-	saveAsWithType(tmpPath.string(), this, edfhdr);
+
+	vector<EdfAnnotation> events;
+	forEachSavedEvent(this, [this, &events] (const Event& e, const string& text)
+	{
+		long long onset = llround(e.position/samplingFrequency*10*1000*1000);
+		if (discontinuous && e.position >= 0)
+			onset = llround(sampleToTime(e.position)*10*1000*1000);
+
+		long long duration = e.duration > 0 ? llround(e.duration/samplingFrequency*10*1000*1000) : 0;
+		events.push_back(EdfAnnotation{onset, duration, text});
+	});
+
+	if (!copyEdfWithAnnotations(getFilePath(), tmpPath.string(), std::move(events), samplesRecorded, progress))
+		saveAsWithType(tmpPath.string(), this, layout.get(), progress);
+
+	// The reader state is rebuilt below, so nothing may read in the background
+	// meanwhile. If this fails, the background work stays stopped.
+	stopBackgroundWork();
 
 	// Save a backup of the original file.
-	int res = edfclose_file(edfhdr->handle);
-	assert(res == 0 && "EDF file couldn't be closed."); (void)res;
+	dataFile.reset();
 
 	filesystem::path backupPath = getFilePath() + ".backup";
 	if (!filesystem::exists(backupPath))
@@ -158,6 +986,10 @@ void EDF::save()
 	filesystem::rename(tmpPath, getFilePath());
 
 	openFile();
+
+	// The samples can change when the file is recreated by saveAsWithType().
+	clearCache();
+	resumeBackgroundWork();
 }
 
 bool EDF::load()
@@ -175,117 +1007,345 @@ bool EDF::load()
 double EDF::getPhysicalMaximum(unsigned int channel)
 {
 	if (channel < getChannelCount())
-		return edfhdr->signalparam[channel].phys_max;
+		return layout->signalNumber(channelSignal[channel], 112, 8);
 	return 0;
 }
 
 double EDF::getPhysicalMinimum(unsigned int channel)
 {
 	if (channel < getChannelCount())
-		return edfhdr->signalparam[channel].phys_min;
+		return layout->signalNumber(channelSignal[channel], 104, 8);
 	return 0;
 }
 
 double EDF::getDigitalMaximum(unsigned int channel)
 {
 	if (channel < getChannelCount())
-		return edfhdr->signalparam[channel].dig_max;
+		return layout->signalNumber(channelSignal[channel], 128, 8);
 	return 0;
 }
 
 double EDF::getDigitalMinimum(unsigned int channel)
 {
 	if (channel < getChannelCount())
-		return edfhdr->signalparam[channel].dig_min;
+		return layout->signalNumber(channelSignal[channel], 120, 8);
 	return 0;
 }
 
 string EDF::getLabel(unsigned int channel)
 {
 	if (channel < getChannelCount())
-		return edfhdr->signalparam[channel].label;
+		return layout->labels[channelSignal[channel]];
 	return 0;
 }
 
-void EDF::saveAs(const string& filePath, DataFile* sourceFile)
+void EDF::saveAs(const string& filePath, DataFile* sourceFile, SaveProgress* progress)
 {
-	saveAsWithType(filePath, sourceFile, nullptr);
+	saveAsWithType(filePath, sourceFile, nullptr, progress);
+}
+
+FileInfo EDF::probe(const string& filePath)
+{
+	RandomAccessFile file;
+	file.open(filePath);
+
+	FileInfo info;
+	info.filePath = filePath;
+
+	EdfLayout layout = readEdfLayout(file, filePath);
+	info.format = layout.bdf ? FileFormat::BDF : FileFormat::EDF;
+
+	int64_t spr = -1;
+
+	for (int i = 0; i < static_cast<int>(layout.labels.size()); ++i)
+	{
+		if (layout.isAnnotation(i))
+			continue;
+
+		info.labels.push_back(layout.labels[i]);
+		if (spr < 0)
+			spr = layout.samplesPerRecord[i];
+	}
+
+	info.channelCount = static_cast<unsigned int>(info.labels.size());
+
+	if (spr > 0 && layout.duration > 0)
+	{
+		info.samplingFrequency = spr/layout.duration;
+		info.samplesRecorded = static_cast<uint64_t>(spr*layout.numberOfDataRecords);
+	}
+
+	info.startDate = headerStartDate(layout.fixedHeader);
+
+	return info;
 }
 
 void EDF::openFile()
 {
-	int err = edfopen_file_readonly(getFilePath().c_str(), edfhdr, EDFLIB_READ_ALL_ANNOTATIONS);
+	dataFile.reset(new RandomAccessFile());
+	dataFile->open(getFilePath());
+	layout.reset(new EdfLayout(readEdfLayout(*dataFile, getFilePath())));
+	const EdfLayout& layout = *this->layout;
+
+	// Find where every signal is stored in the data records. The annotation
+	// signals are not channels, so they are skipped.
+	startOfData = layout.headerBytes;
+	recordBytes = layout.recordBytes;
+	bdf = layout.bdf;
+	channelSignal.clear();
+	channelOffset.clear();
+	channelSamplesPerRecord.clear();
+
+	for (int i = 0; i < static_cast<int>(layout.labels.size()); ++i)
+	{
+		if (!layout.isAnnotation(i))
+		{
+			channelSignal.push_back(i);
+			channelOffset.push_back(layout.signalOffset[i]);
+			channelSamplesPerRecord.push_back(layout.samplesPerRecord[i]);
+		}
+	}
+
+	numberOfChannels = static_cast<int>(channelSignal.size());
 
-	if (err < 0)
+	if (numberOfChannels == 0 || channelSamplesPerRecord[0] <= 0 || layout.duration <= 0)
+		throw runtime_error("EDF file '" + getFilePath() + "' has no signal.");
+
+	samplesRecorded = channelSamplesPerRecord[0]*layout.numberOfDataRecords;
+	samplingFrequency = channelSamplesPerRecord[0]/layout.duration;
+
+	// The calibration is (x + digitalOffset)*bitValue.
+	multiplier.resize(numberOfChannels);
+	offset.resize(numberOfChannels);
+
+	for (int i = 0; i < numberOfChannels; ++i)
 	{
-		if (edfhdr->filetype == EDFLIB_FILE_CONTAINS_FORMAT_ERRORS)
-			throw runtime_error("Warning: EDF format error");
-		else
-			throw runtime_error("edfopen_file_readonly error: " + to_string(edfhdr->filetype));
+		double physicalMaximum = getPhysicalMaximum(i), digitalMaximum = getDigitalMaximum(i);
+		double bitValue = (physicalMaximum - getPhysicalMinimum(i))/(digitalMaximum - getDigitalMinimum(i));
+		double digitalOffset = physicalMaximum/bitValue - digitalMaximum;
+
+		multiplier[i] = bitValue;
+		offset[i] = bitValue*digitalOffset;
 	}
 
-	samplesRecorded = edfhdr->signalparam[0].smp_in_file;
+	// Index the runs of contiguous records, so that the time of a sample can
+	// be found by a binary search.
+	string reserved = headerField(layout.fixedHeader, 192, 5);
+	discontinuous = reserved == "EDF+D" || reserved == "BDF+D";
 
-	samplingFrequency = static_cast<double>(samplesRecorded);
-	samplingFrequency /= static_cast<double>(edfhdr->file_duration);
-	samplingFrequency *= 10*1000*1000;
+	segmentOnset.assign(1, 0);
+	segmentFirstSample.assign(1, 0);
 
-	numberOfChannels = edfhdr->edfsignals;
+	if (discontinuous && layout.numberOfDataRecords > 0)
+	{
+		vector<long long> onsets = readRecordOnsets(*dataFile, layout);
+		const long long recordTime = llround(layout.duration*10*1000*1000);
+		const uint64_t samplesPerRecord = channelSamplesPerRecord[0];
 
-	readChunk = edfhdr->signalparam[0].smp_in_datarecord;
-	if (readChunk < MIN_READ_CHUNK || readChunk > MAX_READ_CHUNK)
-		readChunk = OPT_READ_CHUNK;
-	else if (readChunk < OPT_READ_CHUNK)
-		readChunk = OPT_READ_CHUNK - OPT_READ_CHUNK%readChunk;
-	readChunkBuffer = new double[readChunk];
+		for (size_t r = 1; r < onsets.size(); ++r)
+		{
+			// Overlapping records are kept in the same run to keep the index sorted.
+			if (onsets[r] > onsets[r - 1] + recordTime)
+			{
+				segmentOnset.push_back(onsets[r]);
+				segmentFirstSample.push_back(r*samplesPerRecord);
+			}
+		}
+	}
 }
 
 template<typename T>
-void EDF::readChannelsFloatDouble(vector<T*> dataChannels, uint64_t firstSample, uint64_t lastSample)
+void EDF::readChannelsFloatDouble(const vector<T*>& dataChannels, const vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample)
 {
 	assert(firstSample <= lastSample && "Bad parameter order.");
 
 	if (getSamplesRecorded() <= lastSample)
-		invalid_argument("EDF: reading out of bounds");
+		throw invalid_argument("EDF: reading out of bounds");
 
-	if (dataChannels.size() < getChannelCount())
-		invalid_argument("EDF: too few dataChannels");
+	unsigned int channelCount = channels ? static_cast<unsigned int>(channels->size()) : getChannelCount();
+
+	if (dataChannels.size() < channelCount)
+		throw invalid_argument("EDF: too few dataChannels");
+
+	if (channelCount == 0)
+		return;
 
-	int handle = edfhdr->handle;
-	long long err; (void)err;
+	// Find the records that contain the requested samples. The signals can
+	// have different numbers of samples per record, so the slower ones run
+	// out before the end; their samples past the last record are zeros.
+	const uint64_t dataRecords = layout->numberOfDataRecords;
+	uint64_t firstRecord = numeric_limits<uint64_t>::max(), lastRecord = 0;
+	uint64_t requestedBytes = 0;
+	const int sampleBytes = bdf ? 3 : 2;
 
-	for (unsigned int i = 0; i < getChannelCount(); i++)
+	for (unsigned int i = 0; i < channelCount; ++i)
 	{
-		err = edfseek(handle, i, firstSample, EDFSEEK_SET);
+		int signal = channels ? (*channels)[i] : i;
+		uint64_t spr = channelSamplesPerRecord[signal];
+		uint64_t end = dataRecords*spr;
 
-		if (err != static_cast<long long>(firstSample))
-			throw runtime_error("edfseek failed");
+		if (end <= lastSample)
+			fill(dataChannels[i] + (max(firstSample, end) - firstSample), dataChannels[i] + (lastSample - firstSample + 1), static_cast<T>(0));
+
+		if (firstSample < end)
+		{
+			firstRecord = min(firstRecord, firstSample/spr);
+			lastRecord = max(lastRecord, min(lastSample, end - 1)/spr);
+			requestedBytes += (min(lastSample, end - 1) - firstSample + 1)*sampleBytes;
+		}
 	}
 
-	assert(readChunk > 0);
+	if (lastRecord < firstRecord)
+		return;
+
+	SampleType type = bdf ? SampleType::Int24 : SampleType::Int16;
+
+	// Decodes the part of record r of the i-th channel that was requested.
+	// raw points to the start of the channel's samples in that record.
+	auto decodeRecord = [&] (unsigned int i, uint64_t r, const char* raw)
+	{
+		int signal = channels ? (*channels)[i] : i;
+		uint64_t spr = channelSamplesPerRecord[signal];
+		uint64_t recordStart = r*spr;
+
+		if (lastSample < recordStart || recordStart + spr <= firstSample)
+			return;
+
+		uint64_t from = max(firstSample, recordStart);
+		uint64_t to = min(lastSample, recordStart + spr - 1);
+		int n = static_cast<int>(to - from + 1);
+
+		ALENKA_FILE_TIMER(timer, this, decodeNanoseconds);
+		ALENKA_FILE_COUNT(this, samplesConverted, n);
+
+		decodeSamples(raw + (from - recordStart)*sampleBytes, type, !isLittleEndian, multiplier[signal], offset[signal], dataChannels[i] + (from - firstSample), n);
+	};
 
-	uint64_t nextBoundary = (firstSample + readChunk - 1/readChunk);
+	uint64_t spanRecords = lastRecord - firstRecord + 1;
 
-	while (firstSample <= lastSample)
+	// Read whole records when at least a quarter of the bytes they span is
+	// needed, and demultiplex all the channels from the same buffer.
+	if (4*requestedBytes >= spanRecords*recordBytes)
 	{
-		uint64_t last = min(nextBoundary, lastSample + 1);
-		int n = static_cast<int>(last - firstSample);
+		uint64_t recordsPerBatch = max<uint64_t>(1, READ_BATCH_SIZE/recordBytes);
+		thread_local vector<char> buffer;
 
-		for (unsigned int i = 0; i < getChannelCount(); i++)
+		for (uint64_t r0 = firstRecord; r0 <= lastRecord; r0 += recordsPerBatch)
 		{
-			err = edfread_physical_samples(handle, i, n, readChunkBuffer);
+			uint64_t records = min(recordsPerBatch, lastRecord - r0 + 1);
+			buffer.resize(static_cast<size_t>(records*recordBytes));
+			{
+				ALENKA_FILE_TIMER(timer, this, ioNanoseconds);
+				dataFile->read(buffer.data(), buffer.size(), startOfData + r0*recordBytes);
+			}
+			ALENKA_FILE_COUNT(this, ioCalls, 1);
+			ALENKA_FILE_COUNT(this, bytesRead, buffer.size());
+			ALENKA_FILE_COUNT(this, recordsDecoded, records);
+
+			const char* data = buffer.data();
 
-			if (err != n)
-				throw runtime_error("edfread_physical_samples failed");
+			parallelFor(channelCount, [&] (int i)
+			{
+				int signal = channels ? (*channels)[i] : i;
+
+				for (uint64_t r = r0; r < r0 + records; ++r)
+					decodeRecord(i, r, data + (r - r0)*recordBytes + channelOffset[signal]);
+			}, requestedBytes/sampleBytes*records/spanRecords);
+		}
+
+		return;
+	}
+
+	// Otherwise read only the requested samples of each channel.
+	vector<char> raw;
 
-			for (int j = 0; j < n; j++)
-				dataChannels[i][j] = static_cast<T>(readChunkBuffer[j]);
+	for (unsigned int i = 0; i < channelCount; ++i)
+	{
+		int signal = channels ? (*channels)[i] : i;
+		int64_t spr = channelSamplesPerRecord[signal];
+		raw.resize(static_cast<size_t>(spr*sampleBytes));
 
-			dataChannels[i] += n;
+		for (uint64_t r = firstSample/spr; r <= lastSample/spr && r < dataRecords; ++r)
+		{
+			{
+				ALENKA_FILE_TIMER(timer, this, ioNanoseconds);
+				dataFile->read(raw.data(), raw.size(), startOfData + r*recordBytes + channelOffset[signal]);
+			}
+			ALENKA_FILE_COUNT(this, ioCalls, 1);
+			ALENKA_FILE_COUNT(this, bytesRead, raw.size());
+
+			decodeRecord(i, r, raw.data());
 		}
+	}
+}
+
+double EDF::sampleToTime(uint64_t sample) const
+{
+	size_t i = upper_bound(segmentFirstSample.begin(), segmentFirstSample.end(), sample) - segmentFirstSample.begin() - 1;
+	return static_cast<double>(segmentOnset[i])/(10*1000*1000) + (sample - segmentFirstSample[i])/samplingFrequency;
+}
+
+uint64_t EDF::timeToSample(double time) const
+{
+	long long t = llround(time*10*1000*1000);
+	size_t i = upper_bound(segmentOnset.begin(), segmentOnset.end(), t) - segmentOnset.begin();
+
+	if (i == 0)
+		return 0;
+	--i;
+
+	uint64_t end = i + 1 < segmentFirstSample.size() ? segmentFirstSample[i + 1] : samplesRecorded;
+	double offset = static_cast<double>(t - segmentOnset[i])/(10*1000*1000)*samplingFrequency;
+
+	// In a gap.
+	if (offset >= end - segmentFirstSample[i])
+		return end;
+
+	return min(end - 1, segmentFirstSample[i] + static_cast<uint64_t>(llround(offset)));
+}
+
+void EDF::readSignalByTime(float* data, double time, uint64_t sampleCount)
+{
+	readSignalByTimeFloatDouble(data, time, sampleCount);
+}
+
+void EDF::readSignalByTime(double* data, double time, uint64_t sampleCount)
+{
+	readSignalByTimeFloatDouble(data, time, sampleCount);
+}
+
+template<typename T>
+void EDF::readSignalByTimeFloatDouble(T* data, double time, uint64_t sampleCount)
+{
+	fill(data, data + sampleCount*numberOfChannels, static_cast<T>(0));
+
+	if (sampleCount == 0)
+		return;
+
+	// Sample k of segment i falls at grid point j = k - shift, where shift is
+	// the number of samples between the start of the segment and time.
+	long long start = llround(time*10*1000*1000);
+	long long end = start + llround(sampleCount/samplingFrequency*10*1000*1000);
+	size_t i = upper_bound(segmentOnset.begin(), segmentOnset.end(), start) - segmentOnset.begin();
+	i = i == 0 ? 0 : i - 1;
+
+	vector<T*> dataChannels(numberOfChannels);
+
+	for (; i < segmentOnset.size() && segmentOnset[i] < end; ++i)
+	{
+		int64_t segmentSamples = (i + 1 < segmentFirstSample.size() ? segmentFirstSample[i + 1] : samplesRecorded) - segmentFirstSample[i];
+		int64_t shift = llround(static_cast<double>(start - segmentOnset[i])/(10*1000*1000)*samplingFrequency);
+
+		int64_t first = max<int64_t>(0, -shift);
+		int64_t last = min<int64_t>(sampleCount, segmentSamples - shift) - 1;
+
+		if (first > last)
+			continue;
+
+		for (int j = 0; j < numberOfChannels; ++j)
+			dataChannels[j] = data + j*sampleCount + first;
 
-		firstSample += n;
-		nextBoundary += readChunk;
+		readChannelsFloatDouble(dataChannels, nullptr, segmentFirstSample[i] + first + shift, segmentFirstSample[i] + last + shift);
 	}
 }
 
@@ -296,174 +1356,335 @@ void EDF::fillDefaultMontage()
 	assert(0 < getChannelCount());
 
 	AbstractTrackTable* defaultTracks = getDataModel()->montageTable()->trackTable(0);
-	defaultTracks->insertRows(0, getChannelCount());
+	int count = static_cast<int>(getChannelCount());
 
-	for (int i = 0; i < defaultTracks->rowCount(); ++i)
+	vector<Track> tracks;
+	tracks.reserve(count);
+	for (int i = 0; i < count; ++i)
 	{
-		Track t = defaultTracks->row(i);
-		t.label = edfhdr->signalparam[i].label;
-		defaultTracks->row(i, t);
+		tracks.push_back(defaultTracks->defaultValue(i));
+		tracks.back().label = getLabel(i);
 	}
+
+	defaultTracks->insertRows(0, count, tracks.data());
 }
 
 void EDF::loadEvents()
 {
 	assert(0 < getDataModel()->montageTable()->rowCount());
 
-	edf_annotation_struct event;
-	int eventCount = static_cast<int>(edfhdr->annotations_in_file);
+	if (!annotationReader)
+		annotationReader.reset(new EDFAnnotationReader(getFilePath(), getThreadPool()));
+
+	vector<EdfAnnotation> annotations = annotationReader->get();
+	annotationReader.reset();
+
+	int eventCount = static_cast<int>(annotations.size());
 
 	AbstractEventTable* et = getDataModel()->montageTable()->eventTable(0);
 	assert(et->rowCount() == 0);
-	et->insertRows(0, eventCount);
 
+	vector<Event> events;
+	events.reserve(eventCount);
 	for (int i = 0; i < eventCount; ++i)
-	{
-		edf_get_annotation(edfhdr->handle, i, &event);
-
-		Event e = et->row(i);
-
-		e.position = convertEventPositionBack(event.onset, samplingFrequency);
+		events.push_back(et->defaultValue(i));
 
-		double duration = 0;
-		sscanf(event.duration, "%lf", &duration);
-		if (duration != 0)
-			e.duration = static_cast<int>(round(duration*samplingFrequency));
+	// The texts are decoded in parallel, and the rows are then inserted all at once.
+	const int eventsPerJob = 4096;
 
-		sscanf(event.annotation, "t=%d c=%d", &e.type, &e.channel);
-		string annotation = event.annotation;
+	parallelFor((eventCount + eventsPerJob - 1)/eventsPerJob, [&] (int job)
+	{
+		int end = min(eventCount, (job + 1)*eventsPerJob);
 
-		auto first = annotation.find("|") + 1;
-		auto second = annotation.find("|", first);
+		for (int i = job*eventsPerJob; i < end; ++i)
+		{
+			const EdfAnnotation& annotation = annotations[i];
+			Event& e = events[i];
 
-		string label = annotation.substr(first, second - first);
-		if (label.size() > 0)
-			e.label = label;
+			// The records of EDF+D files can have gaps between them.
+			if (discontinuous)
+				e.position = static_cast<int>(timeToSample(static_cast<double>(annotation.onset)/(10*1000*1000)));
+			else
+				e.position = convertEventPositionBack(annotation.onset, samplingFrequency);
 
-		string description = annotation.substr(second + 1);
-		if (description.size() > 0)
-			e.description = description;
+			if (annotation.duration != 0)
+				e.duration = static_cast<int>(round(static_cast<double>(annotation.duration)*samplingFrequency/10000/1000));
 
-		et->row(i, e);
-	}
+			parseEventText(annotation.text, &e);
+		}
+	}, eventCount);
 
-	addUsedEventTypes();
+	addUsedEventTypes(&events);
+	et->insertRows(0, eventCount, events.data());
 }
 
-void EDF::addUsedEventTypes()
+void EDF::addUsedEventTypes(vector<Event>* events)
 {
 	AbstractEventTypeTable* ett = getDataModel()->eventTypeTable();
-	AbstractEventTable* et = getDataModel()->montageTable()->eventTable(0);
 
 	set<int> typesUsed;
-	for (int i = 0; i < et->rowCount(); ++i)
-		typesUsed.insert(et->row(i).type);
+	for (const Event& e : *events)
+		typesUsed.insert(e.type);
 
 	int count = static_cast<int>(typesUsed.size());
 	assert(ett->rowCount() == 0);
-	ett->insertRows(0, count);
+
+	vector<EventType> types;
+	types.reserve(count);
 
 	auto it = typesUsed.begin();
 	for (int i = 0; i < count; ++i)
 	{
-		EventType et = ett->row(i);
+		EventType et = ett->defaultValue(i);
 
 		int id = *it;
 		et.id = id;
 		et.name = "Type " + to_string(id);
 
-		ett->row(i, et);
+		types.push_back(std::move(et));
 
 		++it;
 	}
 
-	for (int i = 0; i < et->rowCount(); ++i)
-	{
-		Event e = et->row(i);
+	ett->insertRows(0, count, types.data());
 
+	for (Event& e : *events)
+	{
 		auto it = typesUsed.find(e.type);
 		assert(it != typesUsed.end());
 
 		e.type = static_cast<int>(distance(typesUsed.begin(), it));
-
-		et->row(i, e);
 	}
 }
 
-void EDF::saveAsWithType(const string& filePath, DataFile* sourceFile, const edf_hdr_struct* edfhdr)
+void EDF::saveAsWithType(const string& filePath, DataFile* sourceFile, const EdfLayout* original, SaveProgress* progress)
 {
 	int numberOfChannels = sourceFile->getChannelCount();
 	double samplingFrequency = sourceFile->getSamplingFrequency();
 	uint64_t samplesRecorded = sourceFile->getSamplesRecorded();
 
-	int type = EDFLIB_FILETYPE_EDFPLUS;
-	if (edfhdr)
-		type = edfhdr->filetype;
-	if (type == EDFLIB_FILETYPE_EDF || type == EDFLIB_FILETYPE_BDF)
-		++type; // This is because edfopen_file_writeonly accepts only these two types.
+	if (round(samplingFrequency) < 1)
+		throw invalid_argument("EDF: the sampling frequency must be at least 1 Hz");
+	if (numberOfChannels < 1 || numberOfChannels >= 9999)
+		throw invalid_argument("EDF: the number of channels must be between 1 and 9998");
+
+	// Every data record holds one second of samples.
+	const bool bdf = original && original->bdf;
+	const int sampleBytes = bdf ? 3 : 2;
+	const int fs = static_cast<int>(round(samplingFrequency));
+	const int64_t records = (samplesRecorded + fs - 1)/fs;
+	const long long recordTime = 10*1000*1000;
+
+	// Place the annotations, and find how big the annotation signal must be.
+	vector<EdfAnnotation> annotations;
+	forEachSavedEvent(sourceFile, [&annotations, samplingFrequency] (const Event& e, const string& text)
+	{
+		long long onset = llround(e.position/samplingFrequency*10*1000*1000);
+		long long duration = e.duration > 0 ? llround(e.duration/samplingFrequency*10*1000*1000) : 0;
+		annotations.push_back(EdfAnnotation{onset, duration, text});
+	});
 
-	int tmpFile = edfopen_file_writeonly(filePath.c_str(), type, numberOfChannels);
+	vector<long long> onsets(static_cast<size_t>(records));
+	for (int64_t r = 0; r < records; ++r)
+		onsets[r] = r*recordTime;
 
-	if (tmpFile < 0)
-		throw runtime_error("edfopen_file_writeonly error: " + to_string(tmpFile));
+	TalList tals(std::move(annotations), 0, onsets);
+	int64_t annotationBytes = tals.estimateSize(talOnset(records*recordTime).size() + 3);
 
-	// Copy data into the new file.
-	writeSignalInfo(tmpFile, sourceFile, edfhdr);
-	writeMetaInfo(tmpFile, edfhdr); // TODO: Write some of this (at least date) even when saving as/exporting.
+	while (true)
+	{
+		annotationBytes = (annotationBytes + sampleBytes - 1)/sampleBytes*sampleBytes;
+		bool fits = true;
 
-	int fs = static_cast<int>(round(samplingFrequency));
-	unique_ptr<double[]> buffer(new double[numberOfChannels*fs*sizeof(double)]);
+		tals.restart();
+		for (int64_t r = 0; r < records && fits; ++r)
+			fits = tals.fill(nullptr, static_cast<size_t>(annotationBytes), talOnset(r*recordTime), r);
 
-	for (uint64_t sampleIndex = 0; sampleIndex < samplesRecorded; sampleIndex += fs)
-	{
-		sourceFile->readSignal(buffer.get(), sampleIndex, sampleIndex + fs - 1);
+		if (fits && tals.done())
+			break;
 
-		for (int i = 0; i < numberOfChannels; ++i)
-		{
-			int res = edfwrite_physical_samples(tmpFile, buffer.get() + i*fs);
+		annotationBytes *= 2;
+	}
 
-			if (res != 0)
-				throw runtime_error("edfwrite_physical_samples failed");
+	tals.restart();
+
+	// The header. The identification of the patient and the recording is
+	// copied from EDF+ files, and made up from the start date otherwise.
+	const int ns = numberOfChannels + 1;
+	string header = bdf ? "\xFF" "BIOSEMI" : "0       ";
+
+	string reserved = original ? headerField(original->fixedHeader, 192, 4) : "";
+	if (reserved == "EDF+" || reserved == "BDF+")
+	{
+		header += string(original->fixedHeader + 8, 168 + 16 - 8);
+	}
+	else
+	{
+		static const char* months[] = {"JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"};
+		double date = original ? headerStartDate(original->fixedHeader) : sourceFile->getStartDate();
+		time_t seconds = static_cast<time_t>(llround((date - daysUpTo1970)*24*60*60));
+		tm time = tm();
+#ifdef _WIN32
+		localtime_s(&time, &seconds);
+#else
+		localtime_r(&seconds, &time);
+#endif
+
+		// The header can hold only the years 1985 to 2084.
+		char buffer[64];
+		if (85 <= time.tm_year && time.tm_year < 185)
+		{
+			snprintf(buffer, sizeof(buffer), "Startdate %02d-%s-%04d X X X", time.tm_mday, months[time.tm_mon], time.tm_year + 1900);
+			header += padField("X X X X", 80) + padField(buffer, 80);
+			snprintf(buffer, sizeof(buffer), "%02d.%02d.%02d%02d.%02d.%02d", time.tm_mday, time.tm_mon + 1, time.tm_year%100,
+				time.tm_hour, time.tm_min, time.tm_sec);
+			header += buffer;
+		}
+		else
+		{
+			header += padField("X X X X", 80) + padField("Startdate X X X X", 80) + "01.01.8500.00.00";
 		}
 	}
 
-	// Write events.
-	AbstractMontageTable* montageTable = sourceFile->getDataModel()->montageTable();
+	header += padField(to_string(256*(ns + 1)), 8);
+	header += padField(bdf ? "BDF+C" : "EDF+C", 44);
+	header += padField(to_string(records), 8);
+	header += padField("1", 8);
+	header += padField(to_string(ns), 4);
 
-	for (int i = 0; i < montageTable->rowCount(); ++i)
+	// The signal headers are stored field after field. The annotation signal goes last.
+	vector<int> originalSignal;
+	for (int i = 0; original && i < static_cast<int>(original->labels.size()); ++i)
 	{
-		if (montageTable->row(i).save)
+		if (!original->isAnnotation(i))
+			originalSignal.push_back(i);
+	}
+
+	auto originalField = [&] (int channel, int offset, int size)
+	{
+		return channel < static_cast<int>(originalSignal.size()) ? original->signalField(originalSignal[channel], offset, size) : "";
+	};
+
+	const int digitalLimit = bdf ? 8388607 : 32767;
+	vector<double> bitValue(numberOfChannels), digitalOffset(numberOfChannels);
+	vector<int> digitalMinimum(numberOfChannels), digitalMaximum(numberOfChannels);
+	string physicalMinimumFields, physicalMaximumFields;
+
+	for (int i = 0; i < numberOfChannels; ++i)
+	{
+		digitalMinimum[i] = static_cast<int>(max<double>(sourceFile->getDigitalMinimum(i), -digitalLimit - 1));
+		digitalMaximum[i] = static_cast<int>(min<double>(sourceFile->getDigitalMaximum(i), digitalLimit));
+		if (digitalMaximum[i] <= digitalMinimum[i])
+		{
+			digitalMinimum[i] = -digitalLimit - 1;
+			digitalMaximum[i] = digitalLimit;
+		}
+
+		// The calibration uses the values as they are written.
+		string physicalMinimum = formatHeaderNumber(sourceFile->getPhysicalMinimum(i));
+		string physicalMaximum = formatHeaderNumber(sourceFile->getPhysicalMaximum(i));
+		if (parseHeaderNumber(physicalMaximum) <= parseHeaderNumber(physicalMinimum))
+			physicalMaximum = formatHeaderNumber(parseHeaderNumber(physicalMinimum) + 1);
+
+		physicalMinimumFields += padField(physicalMinimum, 8);
+		physicalMaximumFields += padField(physicalMaximum, 8);
+
+		bitValue[i] = (parseHeaderNumber(physicalMaximum) - parseHeaderNumber(physicalMinimum))/(digitalMaximum[i] - digitalMinimum[i]);
+		digitalOffset[i] = parseHeaderNumber(physicalMaximum)/bitValue[i] - digitalMaximum[i];
+	}
+
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(sourceFile->getLabel(i), 16);
+	header += padField(bdf ? "BDF Annotations" : "EDF Annotations", 16);
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(originalField(i, 16, 80), 80);
+	header += string(80, ' ');
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(originalField(i, 96, 8), 8);
+	header += string(8, ' ');
+	header += physicalMinimumFields + padField("-1", 8);
+	header += physicalMaximumFields + padField("1", 8);
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(to_string(digitalMinimum[i]), 8);
+	header += padField(to_string(-digitalLimit - 1), 8);
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(to_string(digitalMaximum[i]), 8);
+	header += padField(to_string(digitalLimit), 8);
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(originalField(i, 136, 80), 80);
+	header += string(80, ' ');
+	for (int i = 0; i < numberOfChannels; ++i)
+		header += padField(to_string(fs), 8);
+	header += padField(to_string(annotationBytes/sampleBytes), 8);
+	header += string(32*ns, ' ');
+
+	assert(static_cast<int>(header.size()) == 256*(ns + 1));
+
+	if (progress)
+		progress->start(samplesRecorded);
+
+	ofstream output(filePath, ios_base::binary | ios_base::trunc);
+	output.write(header.data(), header.size());
+
+	// The export is a pipeline: the next blocks are read ahead on a thread of
+	// its own while the current one is encoded and written. The blocks are
+	// whole, so the samples past the end of the last record are zeros.
+	const int64_t recordBytes = static_cast<int64_t>(numberOfChannels)*fs*sampleBytes + annotationBytes;
+	uint64_t blockSeconds = max<uint64_t>(1, EXPORT_BLOCK_SIZE/(sizeof(double)*numberOfChannels*fs));
+	uint64_t blockSamples = blockSeconds*fs;
+	uint64_t blockCount = (samplesRecorded + blockSamples - 1)/blockSamples;
+
+	vector<char> outputBuffer;
+
+	try
+	{
+		ReadAhead reader(sourceFile, blockCount*blockSamples, blockSamples, EXPORT_BUFFER_COUNT);
+
+		for (uint64_t block = 0; block < blockCount; ++block)
 		{
-			AbstractEventTable* eventTable = montageTable->eventTable(i);
+			const double* buffer = reader.next().data();
+			uint64_t seconds = min(blockSeconds, (samplesRecorded - block*blockSamples + fs - 1)/fs);
+			outputBuffer.resize(static_cast<size_t>(seconds*recordBytes));
 
-			for (int j = 0; j < eventTable->rowCount(); ++j)
+			for (uint64_t second = 0; second < seconds; ++second)
 			{
-				Event e = eventTable->row(j);
+				char* out = outputBuffer.data() + second*recordBytes;
 
-				// Skip events belonging to tracks greater thatn the number of channels in the file.
-				// TODO: Perhaps make a warning about this?
-				if (-1 <= e.channel && e.channel < static_cast<int>(numberOfChannels) && e.type >= 0)
+				for (int i = 0; i < numberOfChannels; ++i, out += fs*sampleBytes)
 				{
-					long long onset = convertEventPosition(e.position, samplingFrequency);
-					long long duration = convertEventPosition(e.duration, samplingFrequency);
+					encodeSamples(buffer + i*blockSamples + second*fs, fs, bitValue[i], digitalOffset[i],
+						digitalMinimum[i], digitalMaximum[i], sampleBytes, out);
+				}
+
+				int64_t r = block*blockSeconds + second;
+				tals.fill(out, static_cast<size_t>(annotationBytes), talOnset(r*recordTime), r);
+			}
 
-					stringstream ss;
-					ss << "t=" << e.type << " c=" << e.channel << "|" << e.label << "|" << e.description;
+			output.write(outputBuffer.data(), outputBuffer.size());
 
-					int res = edfwrite_annotation_utf8(tmpFile, onset, duration, ss.str().c_str());
+			if (!output)
+				throw runtime_error("Error writing file '" + filePath + "'.");
 
-					if (res != 0)
-						throw runtime_error("edfwrite_annotation_utf8 failed");
-				}
+			if (progress)
+			{
+				uint64_t samples = min(blockSamples, samplesRecorded - block*blockSamples);
+				progress->update(samples, outputBuffer.size());
 			}
 		}
-	}
 
-	// Close the open files.
-	int res = edfclose_file(tmpFile);
+		assert(tals.done());
+		output.close();
 
-	if (res != 0)
-		throw runtime_error("Closing tmp EDF file failed");
+		if (!output)
+			throw runtime_error("Error writing file '" + filePath + "'.");
+	}
+	catch (...)
+	{
+		output.close();
+		system::error_code ec;
+		filesystem::remove(filePath, ec);
+		throw;
+	}
 }
 
 } // namespace AlenkaFile
@@ -0,0 +1,109 @@
+#include "../include/AlenkaFile/fileinfo.h"
+
+#include "../include/AlenkaFile/edf.h"
+#include "../include/AlenkaFile/gdf2.h"
+#include "../include/AlenkaFile/mat.h"
+#include "../include/AlenkaFile/threadpool.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <memory>
+#include <stdexcept>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+template<class Iterator>
+void collectFiles(const boost::filesystem::path& directory, vector<string>* filePaths)
+{
+	for (Iterator it(directory), end; it != end; ++it)
+	{
+		boost::system::error_code ec;
+
+		if (boost::filesystem::is_regular_file(it->path(), ec) && formatFromExtension(it->path().string()) != FileFormat::Unknown)
+			filePaths->push_back(it->path().string());
+	}
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+FileFormat formatFromExtension(const string& filePath)
+{
+	string extension = boost::filesystem::path(filePath).extension().string();
+	transform(extension.begin(), extension.end(), extension.begin(), [] (char c) { return static_cast<char>(tolower(c)); });
+
+	if (extension == ".gdf")
+		return FileFormat::GDF2;
+	if (extension == ".edf")
+		return FileFormat::EDF;
+	if (extension == ".bdf")
+		return FileFormat::BDF;
+	if (extension == ".mat")
+		return FileFormat::MAT;
+
+	return FileFormat::Unknown;
+}
+
+FileInfo probeFile(const string& filePath)
+{
+	switch (formatFromExtension(filePath))
+	{
+	case FileFormat::GDF2:
+		return GDF2::probe(filePath);
+	case FileFormat::EDF:
+	case FileFormat::BDF:
+		return EDF::probe(filePath);
+	case FileFormat::MAT:
+		return MAT::probe(filePath);
+	default:
+		throw runtime_error("Unknown file type '" + filePath + "'.");
+	}
+}
+
+vector<FileInfo> scanDirectory(const string& directory, ThreadPool* pool, bool recursive)
+{
+	vector<string> filePaths;
+
+	if (recursive)
+		collectFiles<boost::filesystem::recursive_directory_iterator>(directory, &filePaths);
+	else
+		collectFiles<boost::filesystem::directory_iterator>(directory, &filePaths);
+
+	sort(filePaths.begin(), filePaths.end());
+
+	unique_ptr<ThreadPool> localPool;
+	if (!pool)
+	{
+		localPool.reset(new ThreadPool());
+		pool = localPool.get();
+	}
+
+	vector<FileInfo> infos(filePaths.size());
+
+	pool->parallelFor(static_cast<int>(filePaths.size()), [&] (int i)
+	{
+		try
+		{
+			infos[i] = probeFile(filePaths[i]);
+		}
+		catch (exception& e)
+		{
+			infos[i] = FileInfo();
+			infos[i].filePath = filePaths[i];
+			infos[i].format = formatFromExtension(filePaths[i]);
+			infos[i].error = e.what();
+		}
+	});
+
+	return infos;
+}
+
+} // namespace AlenkaFile
@@ -1,12 +1,22 @@
 #include "../include/AlenkaFile/gdf2.h"
 
+#include "../include/AlenkaFile/saveprogress.h"
+#include "randomaccessfile.h"
+#include "readahead.h"
+#include "readcounters.h"
+#include "sampleconversion.h"
+
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
 #include <set>
 #include <stdexcept>
 #include <cassert>
+#include <cstdint>
 
 using namespace std;
 using namespace AlenkaFile;
@@ -17,6 +27,23 @@ namespace
 
 const bool isLittleEndian = DataFile::testLittleEndian();
 
+/**
+ * @brief Returns a page-aligned buffer of at least size bytes owned by this thread.
+ *
+ * The buffer is reused by the following calls on the same thread.
+ */
+char* scratchBuffer(size_t size)
+{
+	const size_t alignment = 4096;
+	thread_local vector<char> buffer;
+
+	if (buffer.size() < size + alignment)
+		buffer.resize(size + alignment);
+
+	size_t misalignment = reinterpret_cast<uintptr_t>(buffer.data())%alignment;
+	return buffer.data() + (alignment - misalignment)%alignment;
+}
+
 template<typename T>
 void readFile(fstream& file, T* val, unsigned int elements = 1)
 {
@@ -69,66 +96,219 @@ void writeFile(fstream& file, const T* val, unsigned int elements = 1)
 	}
 }
 
+/**
+ * @brief Copies the elements from the header buffer at p and returns the position after them.
+ */
+template<typename T>
+const char* parseArray(const char* p, T* val, unsigned int elements)
+{
+	memcpy(val, p, sizeof(T)*elements);
+
+	if (isLittleEndian == false)
+	{
+		for (unsigned int i = 0; i < elements; ++i)
+			DataFile::changeEndianness(val + i);
+	}
+
+	return p + sizeof(T)*elements;
+}
+
 streampos tellFile(fstream& file, bool isGet = true)
 {
 	(void)tellFile;
 	return isGet ? file.tellg() : file.tellp();
 }
 
-template<class T>
-void convertSamples(T* dataBuffer, double* samples, int n)
+/**
+ * @brief Returns the decoding format for the GDF typeOfData code.
+ */
+SampleType gdfSampleType(int typeOfData)
 {
-	for (int i = 0; i < n; i++)
+	switch (typeOfData)
 	{
-		samples[i] = static_cast<double>(dataBuffer[i]);
+	case 1: return SampleType::Int8;
+	case 2: return SampleType::UInt8;
+	case 3: return SampleType::Int16;
+	case 4: return SampleType::UInt16;
+	case 5: return SampleType::Int32;
+	case 6: return SampleType::UInt32;
+	case 7: return SampleType::Int64;
+	case 8: return SampleType::UInt64;
+	case 16: return SampleType::Float32;
+	case 17: return SampleType::Float64;
+	case 279: return SampleType::Int24;
+	default:
+		throw runtime_error("Unsupported data type for GDF2");
+	}
+}
+
+/**
+ * @brief The approximate size of the blocks GDF2::saveAs() reads and writes at a time.
+ */
+const size_t SAVE_BLOCK_SIZE = 4*1024*1024;
+
+/**
+ * @brief Collects the events of the montages marked 'save' in the GDF event table layout.
+ */
+void collectGdfEvents(DataFile* file, vector<uint32_t>* positions, vector<uint16_t>* types, vector<uint16_t>* channels, vector<uint32_t>* durations)
+{
+	AbstractMontageTable* montageTable = file->getDataModel()->montageTable();
+
+	for (int i = 0; i < montageTable->rowCount(); ++i)
+	{
+		if (montageTable->row(i).save)
+		{
+			AbstractEventTable* eventTable = montageTable->eventTable(i);
+
+			for (int j = 0; j < eventTable->rowCount(); ++j)
+			{
+				Event e = eventTable->row(j);
+
+				// Skip events belonging to tracks greater thatn the number of channels in the file.
+				// TODO: Perhaps make a warning about this?
+				if (-1 <= e.channel && e.channel < static_cast<int>(file->getChannelCount()) && e.type >= 0)
+				{
+					positions->push_back(e.position + 1);
+					types->push_back(static_cast<uint16_t>(file->getDataModel()->eventTypeTable()->row(e.type).id));
+					channels->push_back(static_cast<uint16_t>(e.channel + 1)); // TODO: Make a warning if these values cannot be converted properly.
+					durations->push_back(e.duration);
+				}
+			}
+		}
 	}
 }
 
-void readRecord(fstream& file, char* rawBuffer, double* samples, int n, int sampleSize, int dataType, bool isLittleEndian)
+/**
+ * @brief Writes the events of the montages marked 'save' as a mode 3 event table.
+ *
+ * The file must be positioned at the start of the event table.
+ */
+void writeGdfEventTable(fstream& file, DataFile* sourceFile)
 {
-	file.read(rawBuffer, sampleSize*n);
+	vector<uint32_t> positions;
+	vector<uint16_t> types;
+	vector<uint16_t> channels;
+	vector<uint32_t> durations;
+
+	collectGdfEvents(sourceFile, &positions, &types, &channels, &durations);
+
+	// Write mode, NEV and SR.
+	uint8_t eventTableMode = 3;
+	writeFile(file, &eventTableMode);
 
+	int numberOfEvents = min(static_cast<int>(positions.size()), (1 << 24) - 1); // 2^24 - 1 is the maximum length of the gdf event table
+	uint8_t nev[3];
+	int tmp = numberOfEvents;
+	nev[0] = static_cast<uint8_t>(tmp%256);
+	tmp >>= 8;
+	nev[1] = static_cast<uint8_t>(tmp%256);
+	tmp >>= 8;
+	nev[2] = static_cast<uint8_t>(tmp%256);
 	if (isLittleEndian == false)
+		DataFile::changeEndianness(reinterpret_cast<char*>(nev), 3);
+	writeFile(file, nev, 3);
+
+	float sr = static_cast<float>(sourceFile->getSamplingFrequency());
+	writeFile(file, &sr);
+
+	// Write the events to the gdf event table.
+	writeFile(file, positions.data(), numberOfEvents);
+	writeFile(file, types.data(), numberOfEvents);
+	writeFile(file, channels.data(), numberOfEvents);
+	writeFile(file, durations.data(), numberOfEvents);
+}
+
+/**
+ * @brief Returns the record length for GDF2::saveAs().
+ *
+ * The records are one second long (rounded to whole samples), whatever the
+ * length of the signal; the last one is padded.
+ */
+uint32_t savedSamplesPerRecord(double samplingFrequency)
+{
+	return static_cast<uint32_t>(max(1., min(round(samplingFrequency), 1024.*1024)));
+}
+
+/**
+ * @brief Removes a partially written file when the writing fails.
+ *
+ * Declare it before the stream, so that the file is closed first.
+ */
+class RemoveOnFailure
+{
+public:
+	explicit RemoveOnFailure(const string& filePath) : filePath(filePath) {}
+	~RemoveOnFailure()
 	{
-		for (int i = 0; i < n; ++i)
-			DataFile::changeEndianness(rawBuffer + i*sampleSize, sampleSize);
+		if (!done)
+		{
+			system::error_code ec;
+			filesystem::remove(filePath, ec);
+		}
 	}
 
-#define CASE(a_, b_) case a_: convertSamples(reinterpret_cast<b_*>(rawBuffer), samples, n); break;
-	switch (dataType)
+	void dismiss()
 	{
-		CASE(1, int8_t);
-		CASE(2, uint8_t);
-		CASE(3, int16_t);
-		CASE(4, uint16_t);
-		CASE(5, int32_t);
-		CASE(6, uint32_t);
-		CASE(7, int64_t);
-		CASE(8, uint64_t);
-		CASE(16, float);
-		CASE(17, double);
-	default:
-		assert(0);
+		done = true;
 	}
-#undef CASE
-}
+
+private:
+	string filePath;
+	bool done = false;
+};
 
 /**
- * @brief calibrateSamples
- *
- * This must be used in order to scale the samples properly.
- * The samples are usually stored as ineger values and must be "adjusted"
- * to get the proper floating point value.
+ * @brief Copies a file in blocks, so that the progress can be reported.
  *
- * When this is not used, the raw data is returned.
+ * The samples reported are proportional to the bytes copied.
  */
-void calibrateSamples(double* samples, int n, double digitalMinimum, double scale, double physicalMinimum)
+void copyFile(const string& from, const string& to, uint64_t totalSamples, SaveProgress* progress)
 {
-	for (int i = 0; i < n; i++)
+	RemoveOnFailure guard(to);
+	ifstream input(from, ios_base::binary);
+	ofstream output(to, ios_base::binary | ios_base::trunc);
+
+	if (!input.is_open() || !output.is_open())
+		throw runtime_error("Unable to copy file '" + from + "'.");
+
+	input.seekg(0, ios_base::end);
+	uint64_t size = input.tellg();
+	input.seekg(0);
+
+	vector<char> buffer(SAVE_BLOCK_SIZE);
+	uint64_t copied = 0, samplesReported = 0;
+
+	while (copied < size)
 	{
-		samples[i] -= digitalMinimum;
-		samples[i] /= scale;
-		samples[i] += physicalMinimum;
+		size_t n = static_cast<size_t>(min<uint64_t>(buffer.size(), size - copied));
+		input.read(buffer.data(), n);
+		output.write(buffer.data(), n);
+
+		if (!input || !output)
+			throw runtime_error("Error copying file '" + from + "'.");
+
+		copied += n;
+		uint64_t samples = static_cast<uint64_t>(static_cast<double>(totalSamples)*copied/size);
+		progress->update(samples - samplesReported, n);
+		samplesReported = samples;
+	}
+
+	output.close();
+	if (!output)
+		throw runtime_error("Error copying file '" + from + "'.");
+
+	guard.dismiss();
+}
+
+template<typename T>
+void encodeSamples(const double* in, char* out, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		T value = static_cast<T>(in[i]);
+		if (isLittleEndian == false)
+			DataFile::changeEndianness(&value);
+		memcpy(out + i*sizeof(T), &value, sizeof(T));
 	}
 }
 
@@ -139,7 +319,7 @@ void calibrateSamples(double* samples, int n, double digitalMinimum, double scal
 namespace AlenkaFile
 {
 
-GDF2::GDF2(const string& filePath, bool uncalibrated) : DataFile(filePath)
+GDF2::GDF2(const string& filePath, bool uncalibrated, bool memoryMapped) : DataFile(filePath), uncalibrated(uncalibrated), memoryMapped(memoryMapped)
 {
 	file.open(filePath, file.in | file.out | file.binary);
 
@@ -217,54 +397,12 @@ GDF2::GDF2(const string& filePath, bool uncalibrated) : DataFile(filePath)
 
 	readFile(file, &fh.numberOfChannels);
 
-	// Load variable header.
 	seekFile(file, 2);
 	assert(tellFile(file) == streampos(256) && "Make sure we read all of the fixed header.");
 
-	vh.label = new char[getChannelCount()][16 + 1];
-	for (unsigned int i = 0; i < getChannelCount(); ++i)
-	{
-		readFile(file, vh.label[i], 16);
-		vh.label[i][16] = 0;
-	}
-
-	vh.typeOfSensor = new char[getChannelCount()][80 + 1];
-	for (unsigned int i = 0; i < getChannelCount(); ++i)
-	{
-		readFile(file, vh.typeOfSensor[i], 80);
-		vh.typeOfSensor[i][80] = 0;
-	}
-
-	seekFile(file, 6*getChannelCount());
-
-	vh.physicalDimensionCode = new uint16_t[getChannelCount()];
-	readFile(file, vh.physicalDimensionCode, getChannelCount());
-
-	vh.physicalMinimum = new double[getChannelCount()];
-	readFile(file, vh.physicalMinimum, getChannelCount());
-
-	vh.physicalMaximum = new double[getChannelCount()];
-	readFile(file, vh.physicalMaximum, getChannelCount());
-
-	vh.digitalMinimum = new double[getChannelCount()];
-	readFile(file, vh.digitalMinimum, getChannelCount());
-
-	vh.digitalMaximum = new double[getChannelCount()];
-	readFile(file, vh.digitalMaximum, getChannelCount());
-
-	seekFile(file, 64*getChannelCount());
-
-	vh.timeOffset = new float[getChannelCount()];
-	readFile(file, vh.timeOffset, getChannelCount());
-
-	vh.lowpass = new float[getChannelCount()];
-	readFile(file, vh.lowpass, getChannelCount());
-
-	vh.highpass = new float[getChannelCount()];
-	readFile(file, vh.highpass, getChannelCount());
-
-	vh.notch = new float[getChannelCount()];
-	readFile(file, vh.notch, getChannelCount());
+	// Only the layout of the records is read from the variable header now;
+	// the rest waits for loadVariableHeader().
+	seekFile(file, 216*getChannelCount());
 
 	vh.samplesPerRecord = new uint32_t[getChannelCount()];
 	readFile(file, vh.samplesPerRecord, getChannelCount());
@@ -272,64 +410,37 @@ GDF2::GDF2(const string& filePath, bool uncalibrated) : DataFile(filePath)
 	vh.typeOfData = new uint32_t[getChannelCount()];
 	readFile(file, vh.typeOfData, getChannelCount());
 
-	vh.sensorPosition = new float[getChannelCount()][3];
-	readFile(file, *vh.sensorPosition, 3*getChannelCount());
-
-	vh.sensorInfo = new char[getChannelCount()][20];
-	readFile(file, *vh.sensorInfo, 20*getChannelCount());
-
-	assert((tellFile(file) == streampos(-1) || tellFile(file) == streampos(256 + 256*getChannelCount())) && "Make sure we read all of the variable header.");
-
 	// Initialize other members.
-	samplesRecorded = vh.samplesPerRecord[0]*fh.numberOfDataRecords;
-
 	startOfData = 256*fh.headerLength;
 
-#define CASE(a_, b_) case a_: dataTypeSize = sizeof(b_); break;
-	switch (dataType = vh.typeOfData[0])
-	{
-		CASE(1, int8_t);
-		CASE(2, uint8_t);
-		CASE(3, int16_t);
-		CASE(4, uint16_t);
-		CASE(5, int32_t);
-		CASE(6, uint32_t);
-		CASE(7, int64_t);
-		CASE(8, uint64_t);
-		CASE(16, float);
-		CASE(17, double);
-	default:
-		throw runtime_error("Unsupported data type for GDF2");
-	}
-#undef CASE
+	// Find where every channel's block starts inside a record, so that any
+	// sample can be located without walking the record.
+	samplesPerRecord = 0;
+	recordBytes = 0;
+	channelOffset.resize(getChannelCount());
+	channelTypeSize.resize(getChannelCount());
 
-	if (uncalibrated == false)
-	{
-		scale = new double[getChannelCount()];
-		for (unsigned int i = 0; i < getChannelCount(); ++i)
-		{
-			scale[i] = (vh.digitalMaximum[i] - vh.digitalMinimum[i])/(vh.physicalMaximum[i] - vh.physicalMinimum[i]);
-		}
-	}
-	else
+	for (unsigned int i = 0; i < getChannelCount(); ++i)
 	{
-		scale = nullptr;
+		channelTypeSize[i] = sampleTypeSize(gdfSampleType(vh.typeOfData[i]));
+		channelOffset[i] = recordBytes;
+		recordBytes += static_cast<int64_t>(vh.samplesPerRecord[i])*channelTypeSize[i];
+		samplesPerRecord = max<int>(samplesPerRecord, vh.samplesPerRecord[i]);
 	}
 
-	samplingFrequency = vh.samplesPerRecord[0]/duration;
+	samplesRecorded = static_cast<uint64_t>(samplesPerRecord)*fh.numberOfDataRecords;
 
-	int64_t dataRecordBytes = vh.samplesPerRecord[0]*getChannelCount()*dataTypeSize;
-	startOfEventTable = startOfData + dataRecordBytes*fh.numberOfDataRecords;
+	samplingFrequency = samplesPerRecord/duration;
 
-	recordRawBuffer = new char[vh.samplesPerRecord[0]*dataTypeSize];
-	recordDoubleBuffer = new double[vh.samplesPerRecord[0]];
+	startOfEventTable = startOfData + recordBytes*fh.numberOfDataRecords;
 }
 
 GDF2::~GDF2()
 {
-	delete[] recordRawBuffer;
-	delete[] recordDoubleBuffer;
-	delete[] scale;
+	stopBackgroundWork();
+
+	delete[] multiplier;
+	delete[] offset;
 
 	// Delete variable header.
 	delete[] vh.label;
@@ -349,74 +460,250 @@ GDF2::~GDF2()
 	delete[] vh.sensorInfo;
 }
 
-void GDF2::save()
+void GDF2::save(SaveProgress* progress)
 {
 	saveSecondaryFile();
 
-	// Collect events from montages marked 'save'.
-	vector<uint32_t> positions;
-	vector<uint16_t> types;
-	vector<uint16_t> channels;
-	vector<uint32_t> durations;
+	if (progress)
+		progress->start(getSamplesRecorded());
 
-	AbstractMontageTable* montageTable = getDataModel()->montageTable();
+	// Make a backup copy. This is the slow part, so it reports the progress.
+	filesystem::path backupPath = getFilePath() + ".backup";
+	if (!filesystem::exists(backupPath))
+	{
+		if (progress)
+			copyFile(getFilePath(), backupPath.string(), getSamplesRecorded(), progress);
+		else
+			filesystem::copy(getFilePath(), backupPath);
+	}
+	else if (progress)
+	{
+		progress->update(getSamplesRecorded(), 0);
+	}
 
-	for (int i = 0; i < montageTable->rowCount(); ++i)
+	seekFile(file, startOfEventTable, true);
+	writeGdfEventTable(file, this);
+
+	file.sync();
+}
+
+void GDF2::saveAs(const string& filePath, DataFile* sourceFile, int typeOfData, SaveProgress* progress)
+{
+	if (typeOfData != 16 && typeOfData != 17)
+		throw invalid_argument("GDF2: only float32 (16) and float64 (17) samples can be written");
+
+	const unsigned int numberOfChannels = sourceFile->getChannelCount();
+	const double samplingFrequency = sourceFile->getSamplingFrequency();
+	const uint64_t samplesRecorded = sourceFile->getSamplesRecorded();
+
+	// The header length in 256 B blocks must fit into 16 bits.
+	if (numberOfChannels == 0 || numberOfChannels >= 0xFFFF)
+		throw invalid_argument("GDF2: unsupported number of channels");
+
+	if (!(samplingFrequency > 0))
+		throw invalid_argument("GDF2: the sampling frequency must be positive");
+
+	const uint32_t samplesPerRecord = savedSamplesPerRecord(samplingFrequency);
+	const int64_t numberOfDataRecords = (samplesRecorded + samplesPerRecord - 1)/samplesPerRecord;
+	const uint64_t savedSamples = numberOfDataRecords*samplesPerRecord;
+	const int typeSize = typeOfData == 16 ? 4 : 8;
+	const size_t channelBytes = static_cast<size_t>(samplesPerRecord)*typeSize;
+	const size_t recordBytes = channelBytes*numberOfChannels;
+
+	if (progress)
+		progress->start(samplesRecorded);
+
+	RemoveOnFailure guard(filePath);
+	fstream file(filePath, ios_base::out | ios_base::trunc | ios_base::binary);
+
+	if (!file.is_open())
 	{
-		if (montageTable->row(i).save)
+		guard.dismiss();
+		throw runtime_error("GDF2 file could not be successfully created");
+	}
+
+	file.exceptions(ifstream::failbit | ifstream::badbit);
+
+	// Write fixed header.
+	const vector<char> zeros(256*numberOfChannels);
+
+	writeFile(file, "GDF 2.51", 8);
+	writeFile(file, zeros.data(), 66 + 10 + 4 + 64 + 16); // patientID to recordingLocation
+
+	double date = max(0., sourceFile->getStartDate());
+	double days = floor(date);
+	uint32_t startDate[2];
+	startDate[0] = static_cast<uint32_t>(min(ldexp(date - days, 32), 4294967295.));
+	startDate[1] = static_cast<uint32_t>(days);
+	writeFile(file, startDate, 2);
+
+	writeFile(file, zeros.data(), 8); // birthday
+
+	uint16_t headerLength = static_cast<uint16_t>(1 + numberOfChannels);
+	writeFile(file, &headerLength);
+
+	writeFile(file, zeros.data(), 6 + 8 + 6 + 6 + 12 + 12); // ICD to positionGE
+
+	writeFile(file, &numberOfDataRecords);
+
+	double duration = samplesPerRecord/samplingFrequency;
+	writeFile(file, &duration);
+
+	uint16_t ns = static_cast<uint16_t>(numberOfChannels);
+	writeFile(file, &ns);
+
+	writeFile(file, zeros.data(), 2);
+
+	// Write variable header.
+	for (unsigned int i = 0; i < numberOfChannels; ++i)
+	{
+		char label[16] = {};
+		string tmp = sourceFile->getLabel(i);
+		memcpy(label, tmp.data(), min<size_t>(tmp.size(), 16));
+		writeFile(file, label, 16);
+	}
+
+	writeFile(file, zeros.data(), (80 + 6 + 2)*numberOfChannels); // typeOfSensor, physicalDimension and its code
+
+	vector<double> physicalMinimum(numberOfChannels), physicalMaximum(numberOfChannels);
+
+	for (unsigned int i = 0; i < numberOfChannels; ++i)
+	{
+		physicalMinimum[i] = sourceFile->getPhysicalMinimum(i);
+		physicalMaximum[i] = sourceFile->getPhysicalMaximum(i);
+
+		// An empty range would make the calibration undefined.
+		if (!(physicalMinimum[i] < physicalMaximum[i]))
 		{
-			AbstractEventTable* eventTable = montageTable->eventTable(i);
+			physicalMinimum[i] = -1;
+			physicalMaximum[i] = 1;
+		}
+	}
 
-			for (int j = 0; j < eventTable->rowCount(); ++j)
+	// The digital range equals the physical one, so the calibration is identity.
+	writeFile(file, physicalMinimum.data(), numberOfChannels);
+	writeFile(file, physicalMaximum.data(), numberOfChannels);
+	writeFile(file, physicalMinimum.data(), numberOfChannels);
+	writeFile(file, physicalMaximum.data(), numberOfChannels);
+
+	writeFile(file, zeros.data(), (64 + 4*4)*numberOfChannels); // prefiltering to notch
+
+	vector<uint32_t> samplesPerRecordField(numberOfChannels, samplesPerRecord);
+	writeFile(file, samplesPerRecordField.data(), numberOfChannels);
+
+	vector<uint32_t> typeOfDataField(numberOfChannels, static_cast<uint32_t>(typeOfData));
+	writeFile(file, typeOfDataField.data(), numberOfChannels);
+
+	writeFile(file, zeros.data(), (12 + 20)*numberOfChannels); // sensorPosition and sensorInfo
+
+	assert(tellFile(file, false) == streampos(256*headerLength) && "Make sure we wrote all of the header.");
+
+	// Write the data records. The next block is read from sourceFile while the
+	// current one is being encoded and written.
+	const uint64_t recordsPerBlock = max<uint64_t>(1, SAVE_BLOCK_SIZE/recordBytes);
+	const uint64_t blockSamples = recordsPerBlock*samplesPerRecord;
+
+	vector<char> records(recordsPerBlock*recordBytes);
+
+	// The padding of the last record comes from readSignal(), which returns
+	// zeros past the end of the signal.
+	ReadAhead reader(sourceFile, savedSamples, blockSamples, 2);
+
+	for (uint64_t firstSample = 0; firstSample < savedSamples; firstSample += blockSamples)
+	{
+		const vector<double>& signal = reader.next();
+
+		const uint64_t n = min(blockSamples, savedSamples - firstSample);
+		const uint64_t blockRecords = n/samplesPerRecord;
+
+		for (uint64_t r = 0; r < blockRecords; ++r)
+		{
+			for (unsigned int i = 0; i < numberOfChannels; ++i)
 			{
-				Event e = eventTable->row(j);
+				const double* in = signal.data() + i*n + r*samplesPerRecord;
+				char* out = records.data() + r*recordBytes + i*channelBytes;
 
-				// Skip events belonging to tracks greater thatn the number of channels in the file.
-				// TODO: Perhaps make a warning about this?
-				if (-1 <= e.channel && e.channel < static_cast<int>(getChannelCount()) && e.type >= 0)
-				{
-					positions.push_back(e.position + 1);
-					types.push_back(static_cast<uint16_t>(getDataModel()->eventTypeTable()->row(e.type).id));
-					channels.push_back(static_cast<uint16_t>(e.channel + 1)); // TODO: Make a warning if these values cannot be converted properly.
-					durations.push_back(e.duration);
-				}
+				if (typeOfData == 16)
+					encodeSamples<float>(in, out, samplesPerRecord);
+				else
+					encodeSamples<double>(in, out, samplesPerRecord);
 			}
 		}
+
+		file.write(records.data(), blockRecords*recordBytes);
+
+		if (progress)
+			progress->update(min(n, samplesRecorded - firstSample), blockRecords*recordBytes);
 	}
 
-	// Make a backup copy.
-	filesystem::path backupPath = getFilePath() + ".backup";
-	if (!filesystem::exists(backupPath))
-		filesystem::copy(getFilePath(), backupPath);
+	writeGdfEventTable(file, sourceFile);
 
-	// Write mode, NEV and SR.
-	seekFile(file, startOfEventTable, true);
+	file.close();
+	guard.dismiss();
+}
 
-	uint8_t eventTableMode = 3;
-	writeFile(file, &eventTableMode);
+FileInfo GDF2::probe(const string& filePath)
+{
+	RandomAccessFile file;
+	file.open(filePath);
 
-	int numberOfEvents = min(static_cast<int>(positions.size()), (1 << 24) - 1); // 2^24 - 1 is the maximum length of the gdf event table
-	uint8_t nev[3];
-	int tmp = numberOfEvents;
-	nev[0] = static_cast<uint8_t>(tmp%256);
-	tmp >>= 8;
-	nev[1] = static_cast<uint8_t>(tmp%256);
-	tmp >>= 8;
-	nev[2] = static_cast<uint8_t>(tmp%256);
-	if (isLittleEndian == false)
-		changeEndianness(reinterpret_cast<char*>(nev), 3);
-	writeFile(file, nev, 3);
+	char fixedHeader[256];
+	file.read(fixedHeader, 256, 0);
 
-	float sr = static_cast<float>(getSamplingFrequency());
-	writeFile(file, &sr);
+	int major, minor;
+	if (string(fixedHeader, 3) != "GDF" || sscanf(fixedHeader + 4, "%d.%d", &major, &minor) != 2 || major != 2)
+		throw runtime_error("Unrecognized file format.");
 
-	// Write the events to the gdf event table.
-	writeFile(file, positions.data(), numberOfEvents);
-	writeFile(file, types.data(), numberOfEvents);
-	writeFile(file, channels.data(), numberOfEvents);
-	writeFile(file, durations.data(), numberOfEvents);
+	uint32_t startDate[2];
+	int64_t numberOfDataRecords;
+	uint16_t numberOfChannels;
+	parseArray(fixedHeader + 168, startDate, 2);
+	parseArray(fixedHeader + 236, &numberOfDataRecords, 1);
+	parseArray(fixedHeader + 252, &numberOfChannels, 1);
 
-	file.sync();
+	double duration;
+	if (minor + 100*major > 220)
+	{
+		parseArray(fixedHeader + 244, &duration, 1);
+	}
+	else
+	{
+		uint32_t ratio[2];
+		parseArray(fixedHeader + 244, ratio, 2);
+		duration = static_cast<double>(ratio[0])/static_cast<double>(ratio[1]);
+	}
+
+	unsigned int ns = numberOfChannels;
+
+	vector<char> labels(16*ns);
+	vector<uint32_t> samplesPerRecord(ns);
+
+	if (ns > 0)
+	{
+		file.read(labels.data(), labels.size(), 256);
+
+		vector<char> buffer(4*ns);
+		file.read(buffer.data(), buffer.size(), 256 + 216*ns);
+		parseArray(buffer.data(), samplesPerRecord.data(), ns);
+	}
+
+	FileInfo info;
+	info.filePath = filePath;
+	info.format = FileFormat::GDF2;
+	info.channelCount = ns;
+
+	for (unsigned int i = 0; i < ns; ++i)
+	{
+		const char* label = labels.data() + 16*i;
+		info.labels.push_back(string(label, find(label, label + 16, 0)));
+	}
+
+	uint32_t spr = ns > 0 ? *max_element(samplesPerRecord.begin(), samplesPerRecord.end()) : 0;
+	info.samplingFrequency = spr/duration;
+	info.samplesRecorded = numberOfDataRecords < 0 ? 0 : static_cast<uint64_t>(spr)*numberOfDataRecords;
+	info.startDate = startDate[1] + ldexp(static_cast<double>(startDate[0]), -32);
+
+	return info;
 }
 
 bool GDF2::load()
@@ -431,47 +718,400 @@ bool GDF2::load()
 	return true;
 }
 
+double GDF2::getChannelSamplingFrequency(unsigned int channel) const
+{
+	if (getChannelCount() <= channel)
+		throw invalid_argument("Channel index out of range.");
+
+	return samplingFrequency*vh.samplesPerRecord[channel]/samplesPerRecord;
+}
+
+uint64_t GDF2::getChannelSamplesRecorded(unsigned int channel) const
+{
+	if (getChannelCount() <= channel)
+		throw invalid_argument("Channel index out of range.");
+
+	return static_cast<uint64_t>(vh.samplesPerRecord[channel])*fh.numberOfDataRecords;
+}
+
+void GDF2::readChannelNative(unsigned int channel, float* data, uint64_t firstSample, uint64_t lastSample)
+{
+	readChannelNativeFloatDouble(channel, data, firstSample, lastSample);
+}
+
+void GDF2::readChannelNative(unsigned int channel, double* data, uint64_t firstSample, uint64_t lastSample)
+{
+	readChannelNativeFloatDouble(channel, data, firstSample, lastSample);
+}
+
 template<typename T>
-void GDF2::readChannelsFloatDouble(vector<T*> dataChannels, const uint64_t firstSample, const uint64_t lastSample)
+void GDF2::readChannelsFloatDouble(const vector<T*>& dataChannels, const vector<unsigned int>* channels, const uint64_t firstSample, const uint64_t lastSample)
 {
 	assert(firstSample <= lastSample && "Bad parameter order.");
 
 	if (getSamplesRecorded() <= lastSample)
-		invalid_argument("GDF2: reading out of bounds");
+		throw invalid_argument("GDF2: reading out of bounds");
 
-	if (dataChannels.size() < getChannelCount())
-		invalid_argument("GDF2: too few dataChannels");
+	unsigned int channelCount = channels ? static_cast<unsigned int>(channels->size()) : getChannelCount();
 
-	int samplesPerRecord = vh.samplesPerRecord[0];
-	int recordChannelBytes = samplesPerRecord*dataTypeSize;
+	if (dataChannels.size() < channelCount)
+		throw invalid_argument("GDF2: too few dataChannels");
 
-	uint64_t recordI = firstSample/samplesPerRecord;
-	seekFile(file, startOfData + recordI*recordChannelBytes*getChannelCount(), true);
+	// The channels at the common rate are decoded straight to the output. The
+	// slower ones are decoded at their own rate first, and then resampled.
+	vector<unsigned int> nativeChannels;
+	vector<uint64_t> nativeFirst, nativeLast;
+	vector<T*> nativeOutput;
+	vector<vector<T>> resampleBuffers;
+	vector<unsigned int> resampled;
 
-	int firstSampleToCopy = static_cast<int>(firstSample%samplesPerRecord);
+	for (unsigned int i = 0; i < channelCount; ++i)
+	{
+		unsigned int channelI = channels ? (*channels)[i] : i;
+		assert(channelI < getChannelCount());
+
+		uint64_t spr = vh.samplesPerRecord[channelI];
 
-	for (; recordI <= lastSample/samplesPerRecord; ++recordI)
+		if (spr == static_cast<uint64_t>(samplesPerRecord))
+		{
+			nativeChannels.push_back(channelI);
+			nativeFirst.push_back(firstSample);
+			nativeLast.push_back(lastSample);
+			nativeOutput.push_back(dataChannels[i]);
+		}
+		else if (spr == 0)
+		{
+			fill(dataChannels[i], dataChannels[i] + (lastSample - firstSample + 1), T(0));
+		}
+		else
+		{
+			// Linear interpolation needs one more sample after the last one.
+			uint64_t first = firstSample*spr/samplesPerRecord;
+			uint64_t last = lastSample*spr/samplesPerRecord;
+			if (resampling == Resampling::Linear)
+				last = min(last + 1, getChannelSamplesRecorded(channelI) - 1);
+
+			resampleBuffers.emplace_back(last - first + 1);
+			resampled.push_back(i);
+
+			nativeChannels.push_back(channelI);
+			nativeFirst.push_back(first);
+			nativeLast.push_back(last);
+			nativeOutput.push_back(resampleBuffers.back().data());
+		}
+	}
+
+	readNative(nativeChannels, nativeFirst, nativeLast, nativeOutput);
+
+	for (unsigned int k = 0; k < resampled.size(); ++k)
 	{
-		int copyCount = min(samplesPerRecord - firstSampleToCopy, static_cast<int>(lastSample - recordI*samplesPerRecord) - firstSampleToCopy + 1);
+		unsigned int i = resampled[k];
+		unsigned int channelI = channels ? (*channels)[i] : i;
+		uint64_t spr = vh.samplesPerRecord[channelI];
+		const vector<T>& native = resampleBuffers[k];
 
-		assert(copyCount > 0 && "Ensure there is something to copy");
-		assert(firstSample + copyCount - 1 <= lastSample && "Make sure we don't write beyond the output buffer.");
-		assert(firstSampleToCopy + copyCount <= samplesPerRecord && "Make sure we don't acceed tmp buffer size.");
+		// Sample j of the common rate lies at native position j*spr/samplesPerRecord.
+		uint64_t first = firstSample*spr/samplesPerRecord;
 
-		for (unsigned int channelI = 0; channelI < getChannelCount(); ++channelI)
+		for (uint64_t j = firstSample; j <= lastSample; ++j)
 		{
-			readRecord(file, recordRawBuffer, recordDoubleBuffer, samplesPerRecord, dataTypeSize, dataType, isLittleEndian);
+			uint64_t position = j*spr;
+			uint64_t n = position/samplesPerRecord - first;
+			T value = native[n];
 
-			if (scale != nullptr)
-				calibrateSamples(recordDoubleBuffer, samplesPerRecord, vh.digitalMinimum[channelI], scale[channelI], vh.physicalMinimum[channelI]);
+			if (resampling == Resampling::Linear && n + 1 < native.size())
+			{
+				double fraction = static_cast<double>(position%samplesPerRecord)/samplesPerRecord;
+				value = static_cast<T>(native[n] + (native[n + 1] - native[n])*fraction);
+			}
 
-			for (int i = 0; i < copyCount; i++)
-				dataChannels[channelI][i] = static_cast<T>(recordDoubleBuffer[firstSampleToCopy + i]);
+			dataChannels[i][j - firstSample] = value;
+		}
+	}
+}
+
+template<typename T>
+void GDF2::readChannelNativeFloatDouble(unsigned int channel, T* data, uint64_t firstSample, uint64_t lastSample)
+{
+	if (getChannelCount() <= channel)
+		throw invalid_argument("Channel index out of range.");
+
+	if (lastSample < firstSample || getChannelSamplesRecorded(channel) <= lastSample)
+		throw invalid_argument("GDF2: reading out of bounds");
+
+	readNative(vector<unsigned int>{channel}, vector<uint64_t>{firstSample}, vector<uint64_t>{lastSample}, vector<T*>{data});
+}
+
+template<typename T>
+void GDF2::readNative(const vector<unsigned int>& channels, const vector<uint64_t>& firstSamples, const vector<uint64_t>& lastSamples, const vector<T*>& dataChannels)
+{
+	int channelCount = static_cast<int>(channels.size());
+
+	if (channelCount == 0)
+		return;
 
-			dataChannels[channelI] += copyCount;
+	loadVariableHeader();
+	openDataSection();
+
+	// Find the records that contain the requested samples.
+	uint64_t firstRecord = numeric_limits<uint64_t>::max(), lastRecord = 0;
+	uint64_t requestedBytes = 0, requestedSamples = 0;
+
+	for (int i = 0; i < channelCount; ++i)
+	{
+		uint64_t spr = vh.samplesPerRecord[channels[i]];
+		firstRecord = min(firstRecord, firstSamples[i]/spr);
+		lastRecord = max(lastRecord, lastSamples[i]/spr);
+
+		requestedSamples += lastSamples[i] - firstSamples[i] + 1;
+		requestedBytes += (lastSamples[i] - firstSamples[i] + 1)*channelTypeSize[channels[i]];
+	}
+
+	// Finds the part of record r of the i-th channel that falls into its
+	// range, and where it goes in the output. Returns false if there is none.
+	auto recordWindow = [&] (int i, uint64_t r, int* firstToCopy, int* copyCount, uint64_t* outputOffset) -> bool
+	{
+		uint64_t spr = vh.samplesPerRecord[channels[i]];
+		uint64_t recordStart = r*spr;
+
+		if (lastSamples[i] < recordStart || recordStart + spr <= firstSamples[i])
+			return false;
+
+		uint64_t from = max(firstSamples[i], recordStart);
+		uint64_t to = min(lastSamples[i], recordStart + spr - 1);
+
+		*firstToCopy = static_cast<int>(from - recordStart);
+		*copyCount = static_cast<int>(to - from + 1);
+		*outputOffset = from - firstSamples[i];
+		return true;
+	};
+
+	auto decode = [&] (int i, const char* rawSamples, int copyCount, uint64_t outputOffset)
+	{
+		ALENKA_FILE_TIMER(timer, this, decodeNanoseconds);
+		ALENKA_FILE_COUNT(this, samplesConverted, copyCount);
+
+		unsigned int channelI = channels[i];
+		decodeSamples(rawSamples, gdfSampleType(vh.typeOfData[channelI]), !isLittleEndian, multiplier[channelI], offset[channelI], dataChannels[i] + outputOffset, copyCount);
+	};
+
+	// Decodes records [r0, r1) that are stored in memory starting at data.
+	// Every channel writes to its own output, so they can be decoded in parallel.
+	auto decodeRecords = [&] (const char* data, uint64_t r0, uint64_t r1)
+	{
+		ALENKA_FILE_COUNT(this, recordsDecoded, r1 - r0);
+
+		parallelFor(channelCount, [&] (int i)
+		{
+			for (uint64_t r = r0; r < r1; ++r)
+			{
+				int firstToCopy, copyCount;
+				uint64_t outputOffset;
+
+				if (recordWindow(i, r, &firstToCopy, &copyCount, &outputOffset))
+				{
+					const char* rawSamples = data + (r - r0)*recordBytes + channelOffset[channels[i]] + firstToCopy*channelTypeSize[channels[i]];
+					decode(i, rawSamples, copyCount, outputOffset);
+				}
+			}
+		}, requestedSamples*(r1 - r0)/(lastRecord - firstRecord + 1));
+	};
+
+	if (mappedData)
+	{
+		ALENKA_FILE_COUNT(this, bytesRead, (lastRecord - firstRecord + 1)*recordBytes);
+		decodeRecords(mappedData + firstRecord*recordBytes, firstRecord, lastRecord + 1);
+		return;
+	}
+
+	// Read whole records in large batches when at least a quarter of the bytes
+	// they span is needed. Otherwise seek to each channel's block separately.
+	if (4*requestedBytes >= (lastRecord - firstRecord + 1)*recordBytes)
+	{
+		uint64_t recordsPerBatch = max<uint64_t>(1, readBatchSize/recordBytes);
+
+		for (uint64_t recordI = firstRecord; recordI <= lastRecord;)
+		{
+			uint64_t batchRecords = min(recordsPerBatch, lastRecord - recordI + 1);
+			size_t batchBytes = static_cast<size_t>(batchRecords*recordBytes);
+			char* arena = scratchBuffer(batchBytes);
+			{
+				ALENKA_FILE_TIMER(timer, this, ioNanoseconds);
+				dataFile->read(arena, batchBytes, startOfData + recordI*recordBytes);
+			}
+			ALENKA_FILE_COUNT(this, ioCalls, 1);
+			ALENKA_FILE_COUNT(this, bytesRead, batchBytes);
+
+			decodeRecords(arena, recordI, recordI + batchRecords);
+			recordI += batchRecords;
 		}
 
-		firstSampleToCopy = 0;
+		return;
+	}
+
+	char* rawSamples = scratchBuffer(static_cast<size_t>(recordBytes));
+
+	for (uint64_t recordI = firstRecord; recordI <= lastRecord; ++recordI)
+	{
+		ALENKA_FILE_COUNT(this, recordsDecoded, 1);
+
+		for (int i = 0; i < channelCount; ++i)
+		{
+			int firstToCopy, copyCount;
+			uint64_t outputOffset;
+
+			// Read only the requested part of each selected channel's block.
+			if (recordWindow(i, recordI, &firstToCopy, &copyCount, &outputOffset))
+			{
+				unsigned int channelI = channels[i];
+				int64_t position = startOfData + recordI*recordBytes + channelOffset[channelI] + firstToCopy*channelTypeSize[channelI];
+
+				{
+					ALENKA_FILE_TIMER(timer, this, ioNanoseconds);
+					dataFile->read(rawSamples, copyCount*channelTypeSize[channelI], position);
+				}
+				ALENKA_FILE_COUNT(this, ioCalls, 1);
+				ALENKA_FILE_COUNT(this, bytesRead, copyCount*channelTypeSize[channelI]);
+
+				decode(i, rawSamples, copyCount, outputOffset);
+			}
+		}
+	}
+}
+
+void GDF2::loadVariableHeader()
+{
+	call_once(variableHeaderFlag, [this] () { parseVariableHeader(); });
+}
+
+void GDF2::parseVariableHeader()
+{
+	// This can run on any thread that reads samples, so the shared fstream is
+	// not used here.
+	unsigned int ns = getChannelCount();
+	vector<char> buffer(256*ns);
+
+	RandomAccessFile headerFile;
+	headerFile.open(getFilePath());
+	headerFile.read(buffer.data(), buffer.size(), 256);
+
+	unique_ptr<char[][16 + 1]> label(new char[ns][16 + 1]);
+	unique_ptr<char[][80 + 1]> typeOfSensor(new char[ns][80 + 1]);
+	unique_ptr<uint16_t[]> physicalDimensionCode(new uint16_t[ns]);
+	unique_ptr<double[]> physicalMinimum(new double[ns]), physicalMaximum(new double[ns]);
+	unique_ptr<double[]> digitalMinimum(new double[ns]), digitalMaximum(new double[ns]);
+	unique_ptr<float[]> timeOffset(new float[ns]), lowpass(new float[ns]), highpass(new float[ns]), notch(new float[ns]);
+	unique_ptr<float[][3]> sensorPosition(new float[ns][3]);
+	unique_ptr<char[][20]> sensorInfo(new char[ns][20]);
+
+	const char* p = buffer.data();
+
+	for (unsigned int i = 0; i < ns; ++i)
+	{
+		p = parseArray(p, label[i], 16);
+		label[i][16] = 0;
+	}
+
+	for (unsigned int i = 0; i < ns; ++i)
+	{
+		p = parseArray(p, typeOfSensor[i], 80);
+		typeOfSensor[i][80] = 0;
+	}
+
+	p += 6*ns;
+	p = parseArray(p, physicalDimensionCode.get(), ns);
+	p = parseArray(p, physicalMinimum.get(), ns);
+	p = parseArray(p, physicalMaximum.get(), ns);
+	p = parseArray(p, digitalMinimum.get(), ns);
+	p = parseArray(p, digitalMaximum.get(), ns);
+	p += 64*ns;
+	p = parseArray(p, timeOffset.get(), ns);
+	p = parseArray(p, lowpass.get(), ns);
+	p = parseArray(p, highpass.get(), ns);
+	p = parseArray(p, notch.get(), ns);
+	p += 8*ns; // samplesPerRecord and typeOfData were read by the constructor.
+	p = parseArray(p, *sensorPosition.get(), 3*ns);
+	p = parseArray(p, *sensorInfo.get(), 20*ns);
+
+	assert(p == buffer.data() + buffer.size() && "Make sure we read all of the variable header.");
+
+	// The calibration (x - digitalMinimum)/scale + physicalMinimum is evaluated
+	// as a single multiply-add x*multiplier + offset.
+	unique_ptr<double[]> multiplier(new double[ns]), offset(new double[ns]);
+
+	for (unsigned int i = 0; i < ns; ++i)
+	{
+		if (uncalibrated)
+		{
+			multiplier[i] = 1;
+			offset[i] = 0;
+		}
+		else
+		{
+			double scale = (digitalMaximum[i] - digitalMinimum[i])/(physicalMaximum[i] - physicalMinimum[i]);
+			multiplier[i] = 1/scale;
+			offset[i] = physicalMinimum[i] - digitalMinimum[i]*multiplier[i];
+		}
+	}
+
+	vh.label = label.release();
+	vh.typeOfSensor = typeOfSensor.release();
+	vh.physicalDimensionCode = physicalDimensionCode.release();
+	vh.physicalMinimum = physicalMinimum.release();
+	vh.physicalMaximum = physicalMaximum.release();
+	vh.digitalMinimum = digitalMinimum.release();
+	vh.digitalMaximum = digitalMaximum.release();
+	vh.timeOffset = timeOffset.release();
+	vh.lowpass = lowpass.release();
+	vh.highpass = highpass.release();
+	vh.notch = notch.release();
+	vh.sensorPosition = sensorPosition.release();
+	vh.sensorInfo = sensorInfo.release();
+	this->multiplier = multiplier.release();
+	this->offset = offset.release();
+}
+
+void GDF2::openDataSection()
+{
+	call_once(dataSectionFlag, [this] ()
+	{
+		if (memoryMapped)
+			mapDataSection();
+
+		if (!mappedData)
+		{
+			dataFile.reset(new RandomAccessFile());
+			dataFile->open(getFilePath());
+		}
+	});
+}
+
+void GDF2::mapDataSection()
+{
+	int64_t dataBytes = startOfEventTable - startOfData;
+
+	if (dataBytes <= 0)
+		return;
+
+	// Touching the pages past the end of a truncated file would raise SIGBUS.
+	// RandomAccessFile throws runtime_error for the missing part instead.
+	system::error_code ec;
+	uintmax_t fileSize = filesystem::file_size(getFilePath(), ec);
+
+	if (ec || fileSize < static_cast<uintmax_t>(startOfEventTable))
+		return;
+
+	try
+	{
+		interprocess::file_mapping mapping(getFilePath().c_str(), interprocess::read_only);
+		dataMapping.reset(new interprocess::mapped_region(mapping, interprocess::read_only, startOfData, static_cast<size_t>(dataBytes)));
+		mappedData = reinterpret_cast<const char*>(dataMapping->get_address());
+	}
+	catch (interprocess::interprocess_exception&)
+	{
+		// Fall back to reading through RandomAccessFile.
+		dataMapping.reset();
+		mappedData = nullptr;
 	}
 }
 
@@ -493,18 +1133,22 @@ void GDF2::readGdfEventTable()
 	if (numberOfEvents == 0)
 		return;
 
+	// The events are assembled here, and the rows are inserted all at once.
 	AbstractEventTable* defaultEvents = getDataModel()->montageTable()->eventTable(0);
-	defaultEvents->insertRows(0, numberOfEvents);
+	int firstRow = defaultEvents->rowCount();
+
+	vector<Event> events;
+	events.reserve(numberOfEvents);
+	for (int i = 0; i < numberOfEvents; ++i)
+		events.push_back(defaultEvents->defaultValue(firstRow + i));
 
 	for (int i = 0; i < numberOfEvents; ++i)
 	{
 		uint32_t position;
 		readFile(file, &position);
 
-		Event e = defaultEvents->row(i);
 		int tmp = position;
-		e.position = tmp - 1;
-		defaultEvents->row(i, e);
+		events[i].position = tmp - 1;
 	}
 
 	set<int> eventTypesUsed;
@@ -514,22 +1158,13 @@ void GDF2::readGdfEventTable()
 		uint16_t type;
 		readFile(file, &type);
 		eventTypesUsed.insert(type);
-		
-		Event e = defaultEvents->row(i);
-		e.type = type;
-		defaultEvents->row(i, e);
-	}
-
-	for (int i = 0; i < numberOfEvents; ++i)
-	{
-		int type = defaultEvents->row(i).type;
-		type = static_cast<int>(distance(eventTypesUsed.begin(), eventTypesUsed.find(type)));
 
-		Event e = defaultEvents->row(i);
-		e.type = type;
-		defaultEvents->row(i, e);
+		events[i].type = type;
 	}
 
+	for (Event& e : events)
+		e.type = static_cast<int>(distance(eventTypesUsed.begin(), eventTypesUsed.find(e.type)));
+
 	if (eventTableMode & 0x02)
 	{
 		for (int i = 0; i < numberOfEvents; ++i)
@@ -541,9 +1176,7 @@ void GDF2::readGdfEventTable()
 			if (tmp >= static_cast<int>(getChannelCount()))
 				tmp = -1;
 
-			Event e = defaultEvents->row(i);
-			e.channel = tmp;
-			defaultEvents->row(i, e);
+			events[i].channel = tmp;
 		}
 
 		for (int i = 0; i < numberOfEvents; ++i)
@@ -551,42 +1184,50 @@ void GDF2::readGdfEventTable()
 			uint32_t duration;
 			readFile(file, &duration);
 
-			Event e = defaultEvents->row(i);
-			e.duration = duration;
-			defaultEvents->row(i, e);
+			events[i].duration = duration;
 		}
 	}
 
+	defaultEvents->insertRows(firstRow, numberOfEvents, events.data());
+
 	// Add all event types used in the gdf event table.
 	AbstractEventTypeTable* ett = getDataModel()->eventTypeTable();
+	int firstType = ett->rowCount();
+
+	vector<EventType> types;
+	types.reserve(eventTypesUsed.size());
 
 	for (const auto& e : eventTypesUsed)
 	{
-		int row = ett->rowCount();
-		ett->insertRows(row);
-
-		EventType et = ett->row(row);
+		EventType et = ett->defaultValue(firstType + static_cast<int>(types.size()));
 		et.id = e;
 		et.name = "Type " + to_string(e);
-		ett->row(row, et);
+		types.push_back(std::move(et));
 	}
+
+	ett->insertRows(firstType, static_cast<int>(types.size()), types.data());
 }
 
 void GDF2::fillDefaultMontage()
 {
+	loadVariableHeader();
+
 	getDataModel()->montageTable()->insertRows(0);
 
 	assert(0 < getChannelCount());
 
 	AbstractTrackTable* defaultTracks = getDataModel()->montageTable()->trackTable(0);
-	defaultTracks->insertRows(0, getChannelCount());
+	int count = static_cast<int>(getChannelCount());
 
-	for (int i = 0; i < defaultTracks->rowCount(); ++i)
+	vector<Track> tracks;
+	tracks.reserve(count);
+	for (int i = 0; i < count; ++i)
 	{
-		Track t = defaultTracks->row(i);
-		t.label = vh.label[i];
-		defaultTracks->row(i, t);
+		tracks.push_back(defaultTracks->defaultValue(i));
+		tracks.back().label = vh.label[i];
 	}
+
+	defaultTracks->insertRows(0, count, tracks.data());
 }
 
 } // namespace AlenkaFile
@@ -1,5 +1,7 @@
 #include "../include/AlenkaFile/mat.h"
 
+#include "readcounters.h"
+
 #include <matio.h>
 
 #include <cstdint>
@@ -133,6 +135,8 @@ MAT::MAT(const std::vector<string>& filePaths, const MATvars& vars) : DataFile(f
 
 MAT::~MAT()
 {
+	stopBackgroundWork();
+
 	for (auto e : dataToFree)
 		Mat_VarFree(e);
 
@@ -140,9 +144,9 @@ MAT::~MAT()
 		Mat_Close(e);
 }
 
-void MAT::save()
+void MAT::save(SaveProgress* progress)
 {
-	DataFile::save();
+	DataFile::save(progress);
 }
 
 bool MAT::load()
@@ -157,6 +161,22 @@ bool MAT::load()
 	return true;
 }
 
+FileInfo MAT::probe(const string& filePath, const MATvars& vars)
+{
+	MAT file(filePath, vars);
+
+	FileInfo info;
+	info.filePath = filePath;
+	info.format = FileFormat::MAT;
+	info.channelCount = file.getChannelCount();
+	info.samplingFrequency = file.getSamplingFrequency();
+	info.samplesRecorded = file.getSamplesRecorded();
+	info.startDate = file.getStartDate();
+	info.labels = file.readLabels();
+
+	return info;
+}
+
 void MAT::openMatFile(const string& filePath)
 {
 	mat_t* file = Mat_Open(filePath.c_str(), MAT_ACC_RDONLY);
@@ -384,50 +404,78 @@ void MAT::readEvents(vector<int>* eventPositions, vector<int>* eventDurations, v
 }
 
 template<typename T>
-void MAT::readChannelsFloatDouble(vector<T*> dataChannels, uint64_t firstSample, uint64_t lastSample)
+void MAT::readChannelsFloatDouble(vector<T*> dataChannels, const vector<unsigned int>* channels, uint64_t firstSample, uint64_t lastSample)
 {
 	assert(firstSample <= lastSample && "Bad parameter order.");
 
 	if (getSamplesRecorded() <= lastSample)
-		invalid_argument("MAT: reading out of bounds");
+		throw invalid_argument("MAT: reading out of bounds");
+
+	int channelCount = channels ? static_cast<int>(channels->size()) : numberOfChannels;
+
+	if (static_cast<int>(dataChannels.size()) < channelCount)
+		throw invalid_argument("MAT: too few dataChannels");
+
+	// Matio reads through a shared file handle.
+	lock_guard<mutex> lock(readMutex);
+
+	// Read only the span of columns that covers the selected channels.
+	int firstChannel = 0, lastChannel = numberOfChannels - 1;
+
+	if (channels && !channels->empty())
+	{
+		firstChannel = *min_element(channels->begin(), channels->end());
+		lastChannel = *max_element(channels->begin(), channels->end());
+	}
 
-	if (dataChannels.size() < getChannelCount())
-		invalid_argument("MAT: too few dataChannels");
+	int spanChannels = lastChannel - firstChannel + 1;
 
 	int i = 0;
 	uint64_t lastInChunk = 0;
 
-	while (lastInChunk += sizes[i], lastInChunk < firstSample)
+	while (lastInChunk += sizes[i], lastInChunk <= firstSample)
 		++i;
 
 	uint64_t firstInChunk = lastInChunk - sizes[i];
 	--lastInChunk;
 
-	for (uint64_t j = firstSample; j < lastSample;)
+	for (uint64_t j = firstSample; j <= lastSample;)
 	{
 		uint64_t last = min(lastSample, lastInChunk);
 		int length = static_cast<int>(last - j + 1);
-		tmpBuffer.resize(numberOfChannels*length*8);
+		tmpBuffer.resize(spanChannels*length*8);
 
-		int start[2] = {static_cast<int>(j - firstInChunk), 0};
+		int start[2] = {static_cast<int>(j - firstInChunk), firstChannel};
 		int stride[2] = {1, 1};
-		int edge[2] = {length, numberOfChannels};
+		int edge[2] = {length, spanChannels};
 
-		int err = Mat_VarReadData(files[dataFileIndex[i]], data[i], tmpBuffer.data(), start, stride, edge);
+		int err;
+		{
+			ALENKA_FILE_TIMER(timer, this, ioNanoseconds);
+			err = Mat_VarReadData(files[dataFileIndex[i]], data[i], tmpBuffer.data(), start, stride, edge);
+		}
 		assert(err == 0); (void)err;
 
-		for (int k = 0; k < numberOfChannels; ++k)
+		ALENKA_FILE_COUNT(this, ioCalls, 1);
+		ALENKA_FILE_COUNT(this, bytesRead, static_cast<uint64_t>(spanChannels)*length*data[i]->data_size);
+		ALENKA_FILE_COUNT(this, samplesConverted, static_cast<uint64_t>(length)*channelCount);
+
+		parallelFor(channelCount, [&] (int k)
 		{
-			decodeArray(tmpBuffer.data(), dataChannels[k], data[i]->data_type, length, k*length);
+			ALENKA_FILE_TIMER(timer, this, decodeNanoseconds);
+			int channel = channels ? (*channels)[k] : k;
+			assert(firstChannel <= channel && channel <= lastChannel);
+
+			decodeArray(tmpBuffer.data(), dataChannels[k], data[i]->data_type, length, (channel - firstChannel)*length);
 
 			if (!multipliers.empty())
 			{
-				T multi = static_cast<T>(multipliers[k]);
+				T multi = static_cast<T>(multipliers[channel]);
 
 				for (int l = 0; l < length; ++l)
 					dataChannels[k][l] *= multi;
 			}
-		}
+		}, static_cast<uint64_t>(length)*channelCount);
 
 		for (auto& e : dataChannels)
 			e += length;
@@ -444,19 +492,21 @@ void MAT::fillDefaultMontage()
 	assert(getChannelCount() > 0);
 
 	AbstractTrackTable* defaultTracks = getDataModel()->montageTable()->trackTable(0);
-	defaultTracks->insertRows(0, getChannelCount());
+	int count = static_cast<int>(getChannelCount());
 
 	vector<string> labels = readLabels();
 
-	for (unsigned int i = 0; i < getChannelCount(); ++i)
+	vector<Track> tracks;
+	tracks.reserve(count);
+	for (int i = 0; i < count; ++i)
 	{
+		tracks.push_back(defaultTracks->defaultValue(i));
+
 		if (!labels[i].empty())
-		{
-			auto r = defaultTracks->row(i);
-			r.label = labels[i];
-			defaultTracks->row(i, r);
-		}
+			tracks.back().label = std::move(labels[i]);
 	}
+
+	defaultTracks->insertRows(0, count, tracks.data());
 }
 
 void MAT::loadEvents()
@@ -480,19 +530,22 @@ void MAT::loadEvents()
 		et.name = "MAT events";
 		ett->row(0, et);
 
-		eventTable->insertRows(0, count);
+		vector<Event> events;
+		events.reserve(count);
 
 		for (int i = 0; i < count; ++i)
 		{
-			Event e = eventTable->row(i);
+			Event e = eventTable->defaultValue(i);
 
 			e.type = 0;
 			e.position = eventPositions[i];
 			e.duration = eventDurations[i];
 			e.channel = eventChannels[i];
 
-			eventTable->row(i, e);
+			events.push_back(std::move(e));
 		}
+
+		eventTable->insertRows(0, count, events.data());
 	}
 }
 
@@ -0,0 +1,320 @@
+#include "../include/AlenkaFile/overview.h"
+
+#include "../include/AlenkaFile/datafile.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+const char MAGIC[8] = {'A', 'L', 'E', 'N', 'K', 'A', 'O', 'V'};
+const uint32_t VERSION = 1;
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// About this many floats are read from the file at a time.
+const uint64_t COMPUTE_CHUNK = 4*1024*1024;
+
+void reduceSamples(const float* samples, uint64_t n, float* minimum, float* maximum, float* mean)
+{
+	assert(n > 0);
+
+	float mn = samples[0], mx = samples[0];
+	double sum = 0;
+
+	for (uint64_t i = 0; i < n; ++i)
+	{
+		mn = min(mn, samples[i]);
+		mx = max(mx, samples[i]);
+		sum += samples[i];
+	}
+
+	*minimum = mn;
+	*maximum = mx;
+	*mean = static_cast<float>(sum/n);
+}
+
+template<typename T>
+void writeValue(ofstream& file, const T& val)
+{
+	file.write(reinterpret_cast<const char*>(&val), sizeof(T));
+}
+
+template<typename T>
+bool readValue(ifstream& file, T* val)
+{
+	file.read(reinterpret_cast<char*>(val), sizeof(T));
+	return static_cast<bool>(file);
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+Overview::Overview(unsigned int channelCount, uint64_t samplesRecorded, int baseBinSize, int levelFactor) :
+	channelCount(channelCount), samplesRecorded(samplesRecorded), baseBinSize(max(1, baseBinSize)), levelFactor(max(2, levelFactor))
+{
+	uint64_t binCount = (samplesRecorded + this->baseBinSize - 1)/this->baseBinSize;
+
+	while (binCount > 0)
+	{
+		Level level;
+		level.binCount = binCount;
+		level.minimum.resize(channelCount*binCount);
+		level.maximum.resize(channelCount*binCount);
+		level.mean.resize(channelCount*binCount);
+		levels.push_back(move(level));
+
+		if (binCount == 1)
+			break;
+		binCount = (binCount + this->levelFactor - 1)/this->levelFactor;
+	}
+}
+
+uint64_t Overview::getBinSize(int level) const
+{
+	assert(0 <= level && level < getLevelCount());
+
+	uint64_t size = baseBinSize;
+	for (int i = 0; i < level; ++i)
+		size *= levelFactor;
+
+	return size;
+}
+
+int Overview::findLevel(double samplesPerBin) const
+{
+	if (levels.empty())
+		return -1;
+
+	int level = 0;
+	while (level + 1 < getLevelCount() && getBinSize(level + 1) <= samplesPerBin)
+		++level;
+
+	return level;
+}
+
+void Overview::readEnvelope(int level, int64_t firstBin, int64_t lastBin, float* minimum, float* maximum, float* mean) const
+{
+	if (lastBin < firstBin)
+		throw invalid_argument("'lastBin' must be greater than or equal to 'firstBin'.");
+
+	const Level& l = levels.at(level);
+	int64_t len = lastBin - firstBin + 1;
+
+	float* outputs[3] = {minimum, maximum, mean};
+	const vector<float>* sources[3] = {&l.minimum, &l.maximum, &l.mean};
+
+	for (int k = 0; k < 3; ++k)
+	{
+		if (!outputs[k])
+			continue;
+
+		for (unsigned int i = 0; i < channelCount; ++i)
+		{
+			float* out = outputs[k] + i*len;
+			const float* in = sources[k]->data() + i*l.binCount;
+
+			for (int64_t b = firstBin; b <= lastBin; ++b)
+				*out++ = 0 <= b && b < static_cast<int64_t>(l.binCount) ? in[b] : 0;
+		}
+	}
+}
+
+unique_ptr<Overview> Overview::compute(DataFile* file, const atomic<bool>* cancel)
+{
+	unique_ptr<Overview> overview(new Overview(file->getChannelCount(), file->getSamplesRecorded()));
+
+	if (overview->levels.empty() || overview->channelCount == 0)
+		return overview;
+
+	Level& level0 = overview->levels[0];
+	uint64_t binSize = overview->baseBinSize;
+	uint64_t binsPerChunk = max<uint64_t>(1, COMPUTE_CHUNK/(overview->channelCount*binSize));
+
+	vector<float> buffer(overview->channelCount*binsPerChunk*binSize);
+
+	for (uint64_t firstBin = 0; firstBin < level0.binCount; firstBin += binsPerChunk)
+	{
+		if (cancel && *cancel)
+			return nullptr;
+
+		uint64_t bins = min(binsPerChunk, level0.binCount - firstBin);
+		uint64_t firstSample = firstBin*binSize;
+		uint64_t lastSample = min(overview->samplesRecorded, (firstBin + bins)*binSize) - 1;
+		uint64_t len = lastSample - firstSample + 1;
+
+		file->readSignal(buffer.data(), firstSample, lastSample);
+
+		for (unsigned int i = 0; i < overview->channelCount; ++i)
+		{
+			for (uint64_t b = 0; b < bins; ++b)
+			{
+				uint64_t n = min(binSize, len - b*binSize);
+				uint64_t index = i*level0.binCount + firstBin + b;
+
+				reduceSamples(buffer.data() + i*len + b*binSize, n, &level0.minimum[index], &level0.maximum[index], &level0.mean[index]);
+			}
+		}
+	}
+
+	overview->computeUpperLevels();
+	return overview;
+}
+
+bool Overview::matches(DataFile* file) const
+{
+	if (file->getChannelCount() != channelCount || file->getSamplesRecorded() != samplesRecorded)
+		return false;
+
+	if (levels.empty())
+		return true;
+
+	uint64_t n = min<uint64_t>(baseBinSize, samplesRecorded);
+	vector<float> buffer(channelCount*n);
+	file->readSignal(buffer.data(), 0, n - 1);
+
+	const Level& level0 = levels[0];
+
+	for (unsigned int i = 0; i < channelCount; ++i)
+	{
+		float mn, mx, mean;
+		reduceSamples(buffer.data() + i*n, n, &mn, &mx, &mean);
+
+		uint64_t index = i*level0.binCount;
+		if (mn != level0.minimum[index] || mx != level0.maximum[index] || mean != level0.mean[index])
+			return false;
+	}
+
+	return true;
+}
+
+void Overview::save(const string& filePath) const
+{
+	ofstream file(filePath, ios_base::binary | ios_base::trunc);
+
+	if (!file.is_open())
+		throw runtime_error("Unable to open file '" + filePath + "'.");
+
+	file.write(MAGIC, sizeof(MAGIC));
+	writeValue(file, VERSION);
+	writeValue(file, BYTE_ORDER_MARK);
+	writeValue(file, static_cast<uint32_t>(channelCount));
+	writeValue(file, samplesRecorded);
+	writeValue(file, static_cast<uint32_t>(baseBinSize));
+	writeValue(file, static_cast<uint32_t>(levelFactor));
+
+	for (const Level& e : levels)
+	{
+		size_t bytes = e.minimum.size()*sizeof(float);
+		file.write(reinterpret_cast<const char*>(e.minimum.data()), bytes);
+		file.write(reinterpret_cast<const char*>(e.maximum.data()), bytes);
+		file.write(reinterpret_cast<const char*>(e.mean.data()), bytes);
+	}
+
+	if (!file)
+		throw runtime_error("Error writing " + filePath);
+}
+
+unique_ptr<Overview> Overview::load(const string& filePath)
+{
+	ifstream file(filePath, ios_base::binary);
+
+	if (!file.is_open())
+		return nullptr;
+
+	char magic[sizeof(MAGIC)];
+	uint32_t version, byteOrderMark, channels, base, factor;
+	uint64_t samples;
+
+	file.read(magic, sizeof(magic));
+
+	if (!file || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		return nullptr;
+
+	if (!readValue(file, &version) || version != VERSION || !readValue(file, &byteOrderMark) || byteOrderMark != BYTE_ORDER_MARK)
+		return nullptr;
+
+	if (!readValue(file, &channels) || !readValue(file, &samples) || !readValue(file, &base) || !readValue(file, &factor))
+		return nullptr;
+
+	if (base < 1 || factor < 2 || base != static_cast<uint32_t>(static_cast<int>(base)))
+		return nullptr;
+
+	// Check the size first, so that a damaged header cannot cause a huge allocation.
+	uint64_t floatCount = 0;
+	for (uint64_t binCount = (samples + base - 1)/base; binCount > 0; binCount = binCount == 1 ? 0 : (binCount + factor - 1)/factor)
+		floatCount += 3*static_cast<uint64_t>(channels)*binCount;
+
+	streamoff headerEnd = file.tellg();
+	file.seekg(0, ios_base::end);
+
+	if (static_cast<uint64_t>(file.tellg() - headerEnd) != floatCount*sizeof(float))
+		return nullptr;
+
+	file.seekg(headerEnd);
+
+	unique_ptr<Overview> overview(new Overview(channels, samples, base, factor));
+
+	for (Level& e : overview->levels)
+	{
+		streamsize bytes = e.minimum.size()*sizeof(float);
+		file.read(reinterpret_cast<char*>(e.minimum.data()), bytes);
+		file.read(reinterpret_cast<char*>(e.maximum.data()), bytes);
+		file.read(reinterpret_cast<char*>(e.mean.data()), bytes);
+	}
+
+	if (!file)
+		return nullptr;
+
+	return overview;
+}
+
+void Overview::computeUpperLevels()
+{
+	for (int l = 1; l < getLevelCount(); ++l)
+	{
+		const Level& lower = levels[l - 1];
+		Level& level = levels[l];
+		uint64_t lowerBinSize = getBinSize(l - 1);
+
+		for (unsigned int i = 0; i < channelCount; ++i)
+		{
+			for (uint64_t b = 0; b < level.binCount; ++b)
+			{
+				uint64_t first = b*levelFactor;
+				uint64_t last = min<uint64_t>(first + levelFactor, lower.binCount);
+				uint64_t lowerIndex = i*lower.binCount + first;
+
+				float mn = lower.minimum[lowerIndex], mx = lower.maximum[lowerIndex];
+				double sum = 0;
+				uint64_t count = 0;
+
+				for (uint64_t j = first; j < last; ++j, ++lowerIndex)
+				{
+					// The bins are weighted by the number of samples they cover.
+					uint64_t n = min(lowerBinSize, samplesRecorded - j*lowerBinSize);
+
+					mn = min(mn, lower.minimum[lowerIndex]);
+					mx = max(mx, lower.maximum[lowerIndex]);
+					sum += static_cast<double>(lower.mean[lowerIndex])*n;
+					count += n;
+				}
+
+				uint64_t index = i*level.binCount + b;
+				level.minimum[index] = mn;
+				level.maximum[index] = mx;
+				level.mean[index] = static_cast<float>(sum/count);
+			}
+		}
+	}
+}
+
+} // namespace AlenkaFile
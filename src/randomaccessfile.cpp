@@ -0,0 +1,121 @@
+#include "randomaccessfile.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace AlenkaFile
+{
+
+RandomAccessFile::~RandomAccessFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+
+void RandomAccessFile::open(const string& filePath)
+{
+	close();
+
+	HANDLE h = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (h == INVALID_HANDLE_VALUE)
+		throw runtime_error("Unable to open file '" + filePath + "'.");
+
+	handle = h;
+}
+
+void RandomAccessFile::close()
+{
+	if (handle)
+	{
+		CloseHandle(handle);
+		handle = nullptr;
+	}
+}
+
+bool RandomAccessFile::isOpen() const
+{
+	return handle != nullptr;
+}
+
+void RandomAccessFile::read(char* data, size_t size, uint64_t position) const
+{
+	while (size > 0)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(position);
+		overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+		DWORD toRead = static_cast<DWORD>(min<size_t>(size, 1 << 30));
+		DWORD bytesRead = 0;
+
+		if (!ReadFile(handle, data, toRead, &bytesRead, &overlapped) || bytesRead == 0)
+			throw runtime_error("Error while reading file.");
+
+		data += bytesRead;
+		size -= bytesRead;
+		position += bytesRead;
+	}
+}
+
+#else
+
+void RandomAccessFile::open(const string& filePath)
+{
+	close();
+
+	fd = ::open(filePath.c_str(), O_RDONLY);
+
+	if (fd < 0)
+		throw runtime_error("Unable to open file '" + filePath + "'.");
+}
+
+void RandomAccessFile::close()
+{
+	if (fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+}
+
+bool RandomAccessFile::isOpen() const
+{
+	return fd >= 0;
+}
+
+void RandomAccessFile::read(char* data, size_t size, uint64_t position) const
+{
+	while (size > 0)
+	{
+		ssize_t bytesRead = pread(fd, data, min<size_t>(size, 1 << 30), static_cast<off_t>(position));
+
+		if (bytesRead < 0 && errno == EINTR)
+			continue;
+
+		if (bytesRead <= 0)
+			throw runtime_error("Error while reading file.");
+
+		data += bytesRead;
+		size -= static_cast<size_t>(bytesRead);
+		position += static_cast<uint64_t>(bytesRead);
+	}
+}
+
+#endif
+
+} // namespace AlenkaFile
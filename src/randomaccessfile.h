@@ -0,0 +1,53 @@
+#ifndef RANDOMACCESSFILE_H
+#define RANDOMACCESSFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief A read-only file that reads at explicit positions.
+ *
+ * There is no file position shared between the calls (pread() on POSIX,
+ * ReadFile() with an offset on Windows), so one object can be used by several
+ * threads at the same time.
+ */
+class RandomAccessFile
+{
+public:
+	RandomAccessFile() {}
+	~RandomAccessFile();
+
+	RandomAccessFile(const RandomAccessFile&) = delete;
+	RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+	/**
+	 * @brief Opens the file for reading; throws runtime_error on failure.
+	 */
+	void open(const std::string& filePath);
+	void close();
+
+	bool isOpen() const;
+
+	/**
+	 * @brief Reads exactly size bytes starting at position.
+	 *
+	 * Throws runtime_error if the bytes cannot be read (e.g. the file is
+	 * shorter).
+	 */
+	void read(char* data, size_t size, uint64_t position) const;
+
+private:
+#ifdef _WIN32
+	void* handle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+} // namespace AlenkaFile
+
+#endif // RANDOMACCESSFILE_H
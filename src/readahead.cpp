@@ -0,0 +1,87 @@
+#include "readahead.h"
+
+#include "../include/AlenkaFile/datafile.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace AlenkaFile
+{
+
+ReadAhead::ReadAhead(DataFile* file, uint64_t sampleCount, uint64_t blockSamples, int bufferCount) :
+	file(file), sampleCount(sampleCount), blockSamples(blockSamples),
+	blockCount((sampleCount + blockSamples - 1)/blockSamples), buffers(static_cast<size_t>(bufferCount))
+{
+	assert(0 < blockSamples && 2 <= bufferCount);
+
+	if (0 < blockCount)
+		worker = thread(&ReadAhead::workerLoop, this);
+}
+
+ReadAhead::~ReadAhead()
+{
+	{
+		lock_guard<mutex> lock(stateMutex);
+		stopping = true;
+	}
+	stateCondition.notify_all();
+
+	if (worker.joinable())
+		worker.join();
+}
+
+const vector<double>& ReadAhead::next()
+{
+	assert(nextBlock < blockCount);
+	unique_lock<mutex> lock(stateMutex);
+
+	// The caller is done with the previous block.
+	releasedBlocks = nextBlock;
+	stateCondition.notify_all();
+
+	stateCondition.wait(lock, [this] () { return nextBlock < readBlocks || error; });
+
+	if (readBlocks <= nextBlock)
+		rethrow_exception(error);
+
+	return buffers[nextBlock++%buffers.size()];
+}
+
+void ReadAhead::workerLoop()
+{
+	for (uint64_t block = 0; block < blockCount; ++block)
+	{
+		{
+			unique_lock<mutex> lock(stateMutex);
+			stateCondition.wait(lock, [this, block] () { return block < releasedBlocks + buffers.size() || stopping; });
+
+			if (stopping)
+				return;
+		}
+
+		vector<double>& buffer = buffers[block%buffers.size()];
+		uint64_t firstSample = block*blockSamples;
+		uint64_t n = min(blockSamples, sampleCount - firstSample);
+
+		try
+		{
+			buffer.resize(static_cast<size_t>(file->getChannelCount()*n));
+			file->readSignal(buffer.data(), firstSample, firstSample + n - 1);
+		}
+		catch (...)
+		{
+			lock_guard<mutex> lock(stateMutex);
+			error = current_exception();
+			stateCondition.notify_all();
+			return;
+		}
+
+		lock_guard<mutex> lock(stateMutex);
+		++readBlocks;
+		stateCondition.notify_all();
+	}
+}
+
+} // namespace AlenkaFile
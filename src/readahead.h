@@ -0,0 +1,74 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace AlenkaFile
+{
+
+class DataFile;
+
+/**
+ * @brief Reads consecutive blocks of a file on its own thread for the save functions.
+ *
+ * One worker thread reads the blocks with DataFile::readSignal() directly
+ * into a ring of buffers, so the next blocks are being read while the
+ * current one is encoded and written. It doesn't go through the file's
+ * asynchronous queue, so cancelAsyncReads() called by other users of the
+ * file has no effect on it.
+ *
+ * Block k holds the samples from k*blockSamples up to sampleCount, at most
+ * blockSamples of them, with the channels one after another.
+ */
+class ReadAhead
+{
+public:
+	/**
+	 * @brief ReadAhead constructor; starts reading immediately.
+	 * @param bufferCount The number of blocks kept in memory, at least 2.
+	 */
+	ReadAhead(DataFile* file, uint64_t sampleCount, uint64_t blockSamples, int bufferCount);
+
+	/**
+	 * @brief Stops the worker; the block being read is finished first.
+	 */
+	~ReadAhead();
+
+	ReadAhead(const ReadAhead&) = delete;
+	ReadAhead& operator=(const ReadAhead&) = delete;
+
+	/**
+	 * @brief Waits for the next block and returns it.
+	 *
+	 * The previous block is given back for reading, so the returned one is
+	 * valid only until the next call. If the read failed, the exception is
+	 * rethrown here.
+	 */
+	const std::vector<double>& next();
+
+private:
+	DataFile* file;
+	uint64_t sampleCount;
+	uint64_t blockSamples;
+	uint64_t blockCount;
+	std::vector<std::vector<double>> buffers;
+	std::thread worker;
+	std::mutex stateMutex;
+	std::condition_variable stateCondition;
+	uint64_t readBlocks = 0;
+	uint64_t releasedBlocks = 0;
+	uint64_t nextBlock = 0;
+	std::exception_ptr error;
+	bool stopping = false;
+
+	void workerLoop();
+};
+
+} // namespace AlenkaFile
+
+#endif // READAHEAD_H
@@ -0,0 +1,101 @@
+#ifndef READCOUNTERS_H
+#define READCOUNTERS_H
+
+#include "../include/AlenkaFile/datafile.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief The counters behind DataFile::getReadStats().
+ *
+ * The counters are updated with relaxed atomic operations, so that several
+ * threads can read from one file at the same time. Use the ALENKA_FILE_COUNT
+ * and ALENKA_FILE_TIMER macros to update them; they compile to nothing unless
+ * ALENKA_FILE_STATS is defined.
+ */
+struct ReadCounters
+{
+	std::atomic<uint64_t> readSignalCalls {0};
+	std::atomic<uint64_t> bytesRead {0};
+	std::atomic<uint64_t> ioCalls {0};
+	std::atomic<uint64_t> recordsDecoded {0};
+	std::atomic<uint64_t> samplesConverted {0};
+	std::atomic<uint64_t> samplesZeroFilled {0};
+
+	std::atomic<uint64_t> totalNanoseconds {0};
+	std::atomic<uint64_t> ioNanoseconds {0};
+	std::atomic<uint64_t> decodeNanoseconds {0};
+	std::atomic<uint64_t> zeroFillNanoseconds {0};
+
+	void reset()
+	{
+		for (std::atomic<uint64_t>* e : {&readSignalCalls, &bytesRead, &ioCalls, &recordsDecoded, &samplesConverted, &samplesZeroFilled,
+			&totalNanoseconds, &ioNanoseconds, &decodeNanoseconds, &zeroFillNanoseconds})
+		{
+			e->store(0, std::memory_order_relaxed);
+		}
+	}
+};
+
+/**
+ * @brief Adds the time from construction to destruction to one of the counters.
+ */
+class StageTimer
+{
+public:
+	StageTimer(ReadCounters* counters, std::atomic<uint64_t> ReadCounters::* counter) : counters(counters), counter(counter)
+	{
+		if (counters)
+			start = std::chrono::steady_clock::now();
+	}
+	~StageTimer()
+	{
+		if (counters)
+		{
+			auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			(counters->*counter).fetch_add(static_cast<uint64_t>(ns), std::memory_order_relaxed);
+		}
+	}
+
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+	ReadCounters* counters;
+	std::atomic<uint64_t> ReadCounters::* counter;
+	std::chrono::steady_clock::time_point start;
+};
+
+} // namespace AlenkaFile
+
+#ifdef ALENKA_FILE_STATS
+
+/**
+ * @brief Adds n to the counter of the DataFile pointed to by file.
+ */
+#define ALENKA_FILE_COUNT(file, counter, n) \
+	do \
+	{ \
+		if (AlenkaFile::ReadCounters* alenkaFileCounters_ = (file)->getReadCounters()) \
+			alenkaFileCounters_->counter.fetch_add(static_cast<uint64_t>(n), std::memory_order_relaxed); \
+	} while (false)
+
+/**
+ * @brief Declares a StageTimer called name that times the rest of the enclosing scope.
+ */
+#define ALENKA_FILE_TIMER(name, file, counter) \
+	AlenkaFile::StageTimer name((file)->getReadCounters(), &AlenkaFile::ReadCounters::counter)
+
+#else
+
+#define ALENKA_FILE_COUNT(file, counter, n) ((void)0)
+#define ALENKA_FILE_TIMER(name, file, counter)
+
+#endif
+
+#endif // READCOUNTERS_H
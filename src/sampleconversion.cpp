@@ -0,0 +1,614 @@
+#include "sampleconversion.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ALENKA_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang need the target attribute to use the intrinsics without
+// compiling the whole library for the newer instruction sets.
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+const int TYPE_COUNT = static_cast<int>(SampleType::size);
+
+template<class S>
+S loadValue(const char* raw, bool swap)
+{
+	S value;
+
+	if (swap)
+	{
+		char tmp[sizeof(S)];
+		for (size_t i = 0; i < sizeof(S); ++i)
+			tmp[i] = raw[sizeof(S) - 1 - i];
+		memcpy(&value, tmp, sizeof(S));
+	}
+	else
+	{
+		memcpy(&value, raw, sizeof(S));
+	}
+
+	return value;
+}
+
+/**
+ * @brief Scalar loading of a single sample of the given type.
+ */
+template<SampleType type>
+struct Sample;
+
+#define SAMPLE(a_, b_) \
+template<> \
+struct Sample<SampleType::a_> \
+{ \
+	static const int size = sizeof(b_); \
+	static double load(const char* raw, bool swap) \
+	{ \
+		return static_cast<double>(loadValue<b_>(raw, swap)); \
+	} \
+};
+SAMPLE(Int8, int8_t)
+SAMPLE(UInt8, uint8_t)
+SAMPLE(Int16, int16_t)
+SAMPLE(UInt16, uint16_t)
+SAMPLE(Int32, int32_t)
+SAMPLE(UInt32, uint32_t)
+SAMPLE(Int64, int64_t)
+SAMPLE(UInt64, uint64_t)
+SAMPLE(Float32, float)
+SAMPLE(Float64, double)
+#undef SAMPLE
+
+template<>
+struct Sample<SampleType::Int24>
+{
+	static const int size = 3;
+	static double load(const char* raw, bool swap)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(raw);
+		int32_t value = swap ? (bytes[2] | bytes[1] << 8 | bytes[0] << 16) : (bytes[0] | bytes[1] << 8 | bytes[2] << 16);
+
+		if (value & 0x800000)
+			value -= 0x1000000;
+
+		return static_cast<double>(value);
+	}
+};
+
+template<SampleType type, bool swap, class T>
+void decodeScalar(const char* raw, T* out, int n, double multiplier, double offset)
+{
+	for (int i = 0; i < n; ++i)
+	{
+		double sample = Sample<type>::load(raw + i*Sample<type>::size, swap);
+		out[i] = static_cast<T>(sample*multiplier + offset);
+	}
+}
+
+#ifdef ALENKA_X86
+
+// Shuffle masks that reverse the bytes of every element, and the ones that move
+// the packed 24-bit samples to the upper three bytes of 32-bit lanes.
+#define SWAP16_MASK 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14
+#define SWAP32_MASK 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+#define SWAP64_MASK 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+#define INT24_MASK -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+#define INT24_SWAP_MASK -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9
+
+// SSE4.1 loaders: each one converts two samples to doubles.
+template<SampleType type, bool swap>
+struct Sse41;
+
+template<bool swap>
+struct Sse41<SampleType::Int8, swap>
+{
+	static const int bytesRead = 2;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		uint16_t v;
+		memcpy(&v, raw, 2);
+		return _mm_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v)));
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::UInt8, swap>
+{
+	static const int bytesRead = 2;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		uint16_t v;
+		memcpy(&v, raw, 2);
+		return _mm_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::Int16, swap>
+{
+	static const int bytesRead = 4;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		int32_t v;
+		memcpy(&v, raw, 4);
+		__m128i x = _mm_cvtsi32_si128(v);
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP16_MASK));
+		return _mm_cvtepi32_pd(_mm_cvtepi16_epi32(x));
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::UInt16, swap>
+{
+	static const int bytesRead = 4;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		int32_t v;
+		memcpy(&v, raw, 4);
+		__m128i x = _mm_cvtsi32_si128(v);
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP16_MASK));
+		return _mm_cvtepi32_pd(_mm_cvtepu16_epi32(x));
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::Int24, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		x = _mm_shuffle_epi8(x, swap ? _mm_setr_epi8(INT24_SWAP_MASK) : _mm_setr_epi8(INT24_MASK));
+		return _mm_cvtepi32_pd(_mm_srai_epi32(x, 8));
+	}
+};
+
+TARGET_SSE41 inline __m128d uint32ToDouble2(__m128i x)
+{
+	__m128d d = _mm_cvtepi32_pd(x);
+	return _mm_add_pd(d, _mm_and_pd(_mm_cmplt_pd(d, _mm_setzero_pd()), _mm_set1_pd(4294967296.0)));
+}
+
+template<bool swap>
+struct Sse41<SampleType::Int32, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return _mm_cvtepi32_pd(x);
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::UInt32, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return uint32ToDouble2(x);
+	}
+};
+
+// The 64-bit integers are split into halves that convert exactly, so the final
+// addition is the only rounding, the same as in the scalar conversion.
+template<bool isSigned, bool swap>
+TARGET_SSE41 inline __m128d int64ToDouble2(const char* raw)
+{
+	__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+	if (swap)
+		x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP64_MASK));
+
+	x = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 1, 2, 0));
+	__m128i high = _mm_srli_si128(x, 8);
+
+	__m128d h = isSigned ? _mm_cvtepi32_pd(high) : uint32ToDouble2(high);
+	h = _mm_mul_pd(h, _mm_set1_pd(4294967296.0));
+	return _mm_add_pd(h, uint32ToDouble2(x));
+}
+
+template<bool swap>
+struct Sse41<SampleType::Int64, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		return int64ToDouble2<true, swap>(raw);
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::UInt64, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		return int64ToDouble2<false, swap>(raw);
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::Float32, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return _mm_cvtps_pd(_mm_castsi128_ps(x));
+	}
+};
+
+template<bool swap>
+struct Sse41<SampleType::Float64, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_SSE41 static __m128d load(const char* raw)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP64_MASK));
+		return _mm_castsi128_pd(x);
+	}
+};
+
+TARGET_SSE41 inline void store2(double* out, __m128d d)
+{
+	_mm_storeu_pd(out, d);
+}
+
+TARGET_SSE41 inline void store2(float* out, __m128d d)
+{
+	_mm_storel_pi(reinterpret_cast<__m64*>(out), _mm_cvtpd_ps(d));
+}
+
+template<SampleType type, bool swap, class T>
+TARGET_SSE41 void decodeSse41(const char* raw, T* out, int n, double multiplier, double offset)
+{
+	typedef Sse41<type, swap> Loader;
+	const int size = Sample<type>::size;
+
+	__m128d m = _mm_set1_pd(multiplier);
+	__m128d o = _mm_set1_pd(offset);
+
+	int i = 0;
+	for (; static_cast<int64_t>(i)*size + Loader::bytesRead <= static_cast<int64_t>(n)*size; i += 2)
+	{
+		__m128d d = Loader::load(raw + i*size);
+		d = _mm_add_pd(_mm_mul_pd(d, m), o);
+		store2(out + i, d);
+	}
+
+	decodeScalar<type, swap>(raw + i*size, out + i, n - i, multiplier, offset);
+}
+
+// AVX2 loaders: each one converts four samples to doubles.
+template<SampleType type, bool swap>
+struct Avx2;
+
+template<bool swap>
+struct Avx2<SampleType::Int8, swap>
+{
+	static const int bytesRead = 4;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		int32_t v;
+		memcpy(&v, raw, 4);
+		return _mm256_cvtepi32_pd(_mm_cvtepi8_epi32(_mm_cvtsi32_si128(v)));
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::UInt8, swap>
+{
+	static const int bytesRead = 4;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		int32_t v;
+		memcpy(&v, raw, 4);
+		return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::Int16, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP16_MASK));
+		return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(x));
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::UInt16, swap>
+{
+	static const int bytesRead = 8;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP16_MASK));
+		return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(x));
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::Int24, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+		x = _mm_shuffle_epi8(x, swap ? _mm_setr_epi8(INT24_SWAP_MASK) : _mm_setr_epi8(INT24_MASK));
+		return _mm256_cvtepi32_pd(_mm_srai_epi32(x, 8));
+	}
+};
+
+TARGET_AVX2 inline __m256d uint32ToDouble4(__m128i x)
+{
+	__m256d d = _mm256_cvtepi32_pd(x);
+	__m256d negative = _mm256_cmp_pd(d, _mm256_setzero_pd(), _CMP_LT_OQ);
+	return _mm256_add_pd(d, _mm256_and_pd(negative, _mm256_set1_pd(4294967296.0)));
+}
+
+template<bool swap>
+struct Avx2<SampleType::Int32, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return _mm256_cvtepi32_pd(x);
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::UInt32, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return uint32ToDouble4(x);
+	}
+};
+
+template<bool isSigned, bool swap>
+TARGET_AVX2 inline __m256d int64ToDouble4(const char* raw)
+{
+	__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw));
+	if (swap)
+		x = _mm256_shuffle_epi8(x, _mm256_setr_epi8(SWAP64_MASK, SWAP64_MASK));
+
+	x = _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+	__m128i low = _mm256_castsi256_si128(x);
+	__m128i high = _mm256_extracti128_si256(x, 1);
+
+	__m256d h = isSigned ? _mm256_cvtepi32_pd(high) : uint32ToDouble4(high);
+	h = _mm256_mul_pd(h, _mm256_set1_pd(4294967296.0));
+	return _mm256_add_pd(h, uint32ToDouble4(low));
+}
+
+template<bool swap>
+struct Avx2<SampleType::Int64, swap>
+{
+	static const int bytesRead = 32;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		return int64ToDouble4<true, swap>(raw);
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::UInt64, swap>
+{
+	static const int bytesRead = 32;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		return int64ToDouble4<false, swap>(raw);
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::Float32, swap>
+{
+	static const int bytesRead = 16;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(raw));
+		if (swap)
+			x = _mm_shuffle_epi8(x, _mm_setr_epi8(SWAP32_MASK));
+		return _mm256_cvtps_pd(_mm_castsi128_ps(x));
+	}
+};
+
+template<bool swap>
+struct Avx2<SampleType::Float64, swap>
+{
+	static const int bytesRead = 32;
+	TARGET_AVX2 static __m256d load(const char* raw)
+	{
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(raw));
+		if (swap)
+			x = _mm256_shuffle_epi8(x, _mm256_setr_epi8(SWAP64_MASK, SWAP64_MASK));
+		return _mm256_castsi256_pd(x);
+	}
+};
+
+TARGET_AVX2 inline void store4(double* out, __m256d d)
+{
+	_mm256_storeu_pd(out, d);
+}
+
+TARGET_AVX2 inline void store4(float* out, __m256d d)
+{
+	_mm_storeu_ps(out, _mm256_cvtpd_ps(d));
+}
+
+template<SampleType type, bool swap, class T>
+TARGET_AVX2 void decodeAvx2(const char* raw, T* out, int n, double multiplier, double offset)
+{
+	typedef Avx2<type, swap> Loader;
+	const int size = Sample<type>::size;
+
+	__m256d m = _mm256_set1_pd(multiplier);
+	__m256d o = _mm256_set1_pd(offset);
+
+	int i = 0;
+	for (; static_cast<int64_t>(i)*size + Loader::bytesRead <= static_cast<int64_t>(n)*size; i += 4)
+	{
+		__m256d d = Loader::load(raw + i*size);
+		d = _mm256_add_pd(_mm256_mul_pd(d, m), o);
+		store4(out + i, d);
+	}
+
+	decodeScalar<type, swap>(raw + i*size, out + i, n - i, multiplier, offset);
+}
+
+#else
+
+#define decodeSse41 decodeScalar
+#define decodeAvx2 decodeScalar
+
+#endif // ALENKA_X86
+
+template<class T>
+struct Kernels
+{
+	typedef void (*Kernel)(const char*, T*, int, double, double);
+
+	static const Kernel table[3][TYPE_COUNT][2];
+};
+
+#define ROW(kernel_, type_) {&kernel_<SampleType::type_, false, T>, &kernel_<SampleType::type_, true, T>}
+#define TABLE(kernel_) { \
+	ROW(kernel_, Int8), ROW(kernel_, UInt8), ROW(kernel_, Int16), ROW(kernel_, UInt16), ROW(kernel_, Int24), ROW(kernel_, Int32), \
+	ROW(kernel_, UInt32), ROW(kernel_, Int64), ROW(kernel_, UInt64), ROW(kernel_, Float32), ROW(kernel_, Float64)}
+
+template<class T>
+const typename Kernels<T>::Kernel Kernels<T>::table[3][TYPE_COUNT][2] = {TABLE(decodeScalar), TABLE(decodeSse41), TABLE(decodeAvx2)};
+
+#undef TABLE
+#undef ROW
+
+atomic<int>& currentInstructionSet()
+{
+	static atomic<int> set(static_cast<int>(detectInstructionSet()));
+	return set;
+}
+
+template<class T>
+void decodeSamplesT(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, T* out, int n)
+{
+	assert(0 <= static_cast<int>(type) && static_cast<int>(type) < TYPE_COUNT);
+
+	int set = currentInstructionSet().load(memory_order_relaxed);
+	Kernels<T>::table[set][static_cast<int>(type)][swapBytes ? 1 : 0](raw, out, n, multiplier, offset);
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+int sampleTypeSize(SampleType type)
+{
+	const int sizes[TYPE_COUNT] = {1, 1, 2, 2, 3, 4, 4, 8, 8, 4, 8};
+	return sizes[static_cast<int>(type)];
+}
+
+void decodeSamples(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, float* out, int n)
+{
+	decodeSamplesT(raw, type, swapBytes, multiplier, offset, out, n);
+}
+
+void decodeSamples(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, double* out, int n)
+{
+	decodeSamplesT(raw, type, swapBytes, multiplier, offset, out, n);
+}
+
+InstructionSet detectInstructionSet()
+{
+#ifdef ALENKA_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osUsesAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osUsesAvx)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse41 = __builtin_cpu_supports("sse4.1") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+
+	if (avx2)
+		return InstructionSet::AVX2;
+	if (sse41)
+		return InstructionSet::SSE41;
+#endif
+
+	return InstructionSet::Scalar;
+}
+
+InstructionSet getInstructionSet()
+{
+	return static_cast<InstructionSet>(currentInstructionSet().load());
+}
+
+void setInstructionSet(InstructionSet set)
+{
+	InstructionSet best = detectInstructionSet();
+
+	if (static_cast<int>(best) < static_cast<int>(set))
+		set = best;
+
+	currentInstructionSet().store(static_cast<int>(set));
+}
+
+} // namespace AlenkaFile
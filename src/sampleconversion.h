@@ -0,0 +1,65 @@
+#ifndef SAMPLECONVERSION_H
+#define SAMPLECONVERSION_H
+
+namespace AlenkaFile
+{
+
+/**
+ * @brief Sample formats that can be decoded by decodeSamples().
+ */
+enum class SampleType
+{
+	Int8, UInt8, Int16, UInt16, Int24, Int32, UInt32, Int64, UInt64, Float32, Float64, size
+};
+
+/**
+ * @brief Instruction sets used by the decoding kernels.
+ */
+enum class InstructionSet
+{
+	Scalar, SSE41, AVX2
+};
+
+/**
+ * @brief Returns the size of one sample in bytes.
+ */
+int sampleTypeSize(SampleType type);
+
+/**
+ * @brief Decodes raw samples and calibrates them in one pass.
+ *
+ * Computes out[i] = raw[i]*multiplier + offset. The raw samples don't have to be
+ * aligned. If swapBytes is true, the byte order of every sample is reversed
+ * before the conversion.
+ *
+ * All the kernels use the same operations in the same order, so the result
+ * doesn't depend on the instruction set.
+ */
+void decodeSamples(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, float* out, int n);
+
+/**
+ * \overload void decodeSamples(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, float* out, int n)
+ */
+void decodeSamples(const char* raw, SampleType type, bool swapBytes, double multiplier, double offset, double* out, int n);
+
+/**
+ * @brief Returns the best instruction set supported by this CPU.
+ */
+InstructionSet detectInstructionSet();
+
+/**
+ * @brief Returns the instruction set currently used by decodeSamples().
+ */
+InstructionSet getInstructionSet();
+
+/**
+ * @brief Overrides the instruction set used by decodeSamples().
+ *
+ * This is meant for testing and benchmarking. Sets that are not supported by
+ * the CPU are replaced by the best supported one.
+ */
+void setInstructionSet(InstructionSet set);
+
+} // namespace AlenkaFile
+
+#endif // SAMPLECONVERSION_H
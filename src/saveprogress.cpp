@@ -0,0 +1,62 @@
+#include "../include/AlenkaFile/saveprogress.h"
+
+#include <chrono>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+int64_t now()
+{
+	return chrono::steady_clock::now().time_since_epoch().count();
+}
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+double SaveProgress::getBytesPerSecond() const
+{
+	double seconds = elapsedSeconds();
+	return seconds > 0 ? bytesProcessed/seconds : 0;
+}
+
+double SaveProgress::getSamplesPerSecond() const
+{
+	double seconds = elapsedSeconds();
+	return seconds > 0 ? samplesProcessed/seconds : 0;
+}
+
+void SaveProgress::start(uint64_t totalSamples)
+{
+	this->totalSamples = totalSamples;
+	samplesProcessed = 0;
+	bytesProcessed = 0;
+	startTime = now();
+
+	if (cancelled)
+		throw SaveCancelled();
+}
+
+void SaveProgress::update(uint64_t samples, uint64_t bytes)
+{
+	samplesProcessed += samples;
+	bytesProcessed += bytes;
+
+	if (callback)
+		callback(*this);
+
+	if (cancelled)
+		throw SaveCancelled();
+}
+
+double SaveProgress::elapsedSeconds() const
+{
+	typedef chrono::steady_clock::duration Duration;
+	return chrono::duration<double>(Duration(now() - startTime)).count();
+}
+
+} // namespace AlenkaFile
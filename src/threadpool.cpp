@@ -0,0 +1,136 @@
+#include "../include/AlenkaFile/threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+/**
+ * @brief The state of one parallelFor() call shared by all the threads taking part.
+ */
+struct Job
+{
+	const function<void(int)>* body;
+	int count;
+	atomic<int> next{0};
+	int finished = 0;
+	exception_ptr error;
+	mutex jobMutex;
+	condition_variable done;
+
+	// Runs the remaining iterations until there are none left.
+	void run()
+	{
+		int i;
+
+		while ((i = next++) < count)
+		{
+			exception_ptr e;
+
+			try
+			{
+				(*body)(i);
+			}
+			catch (...)
+			{
+				e = current_exception();
+			}
+
+			lock_guard<mutex> lock(jobMutex);
+
+			if (e && !error)
+				error = e;
+
+			if (++finished == count)
+				done.notify_all();
+		}
+	}
+};
+
+} // namespace
+
+namespace AlenkaFile
+{
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+{
+	if (threadCount == 0)
+		threadCount = max(1u, thread::hardware_concurrency());
+
+	for (unsigned int i = 0; i < threadCount; ++i)
+		threads.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(queueMutex);
+		stop = true;
+	}
+	queueCondition.notify_all();
+
+	for (auto& e : threads)
+		e.join();
+}
+
+void ThreadPool::parallelFor(int count, const function<void(int)>& body)
+{
+	if (count <= 0)
+		return;
+
+	auto job = make_shared<Job>();
+	job->body = &body;
+	job->count = count;
+
+	// The helpers hold a reference to the job, so that the ones that start
+	// after all the work is done can still see that there is nothing left.
+	int helpers = min(count - 1, static_cast<int>(threads.size()));
+
+	if (helpers > 0)
+	{
+		{
+			lock_guard<mutex> lock(queueMutex);
+
+			for (int i = 0; i < helpers; ++i)
+				queue.push_back([job] () { job->run(); });
+		}
+		queueCondition.notify_all();
+	}
+
+	job->run();
+
+	unique_lock<mutex> lock(job->jobMutex);
+	job->done.wait(lock, [&job] () { return job->finished == job->count; });
+
+	if (job->error)
+		rethrow_exception(job->error);
+}
+
+void ThreadPool::workerLoop()
+{
+	while (true)
+	{
+		function<void()> task;
+
+		{
+			unique_lock<mutex> lock(queueMutex);
+			queueCondition.wait(lock, [this] () { return stop || !queue.empty(); });
+
+			if (stop && queue.empty())
+				return;
+
+			task = move(queue.front());
+			queue.pop_front();
+		}
+
+		task();
+	}
+}
+
+} // namespace AlenkaFile
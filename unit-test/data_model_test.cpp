@@ -385,3 +385,77 @@ TEST(data_model_test, test_primary_EDF)
 
 	delete dataModel;
 }
+
+namespace
+{
+
+// Implements only the per-row functions, so that the default bulk functions are used.
+class PerRowEventTable : public AbstractEventTable
+{
+	EventTable table;
+
+public:
+	virtual int rowCount() const override { return table.rowCount(); }
+	virtual void insertRows(int row, int count = 1) override { table.insertRows(row, count); }
+	virtual void removeRows(int row, int count = 1) override { table.removeRows(row, count); }
+	virtual Event row(int i) const override { return table.row(i); }
+	virtual void row(int i, const Event& value) override { table.row(i, value); }
+	virtual Event defaultValue(int row) const override { return table.defaultValue(row); }
+};
+
+void testBulkRows(AbstractEventTable* table)
+{
+	table->insertRows(0, 2);
+
+	vector<Event> events(3);
+	for (int i = 0; i < 3; ++i)
+	{
+		events[i] = table->defaultValue(i);
+		events[i].label = "Bulk " + to_string(i);
+		events[i].position = 10*i;
+	}
+
+	table->insertRows(1, 3, events.data());
+	ASSERT_EQ(table->rowCount(), 5);
+
+	vector<Event> rows(5);
+	table->getRows(0, 5, rows.data());
+
+	EXPECT_EQ(rows[0].label, "Event 0");
+	for (int i = 0; i < 3; ++i)
+	{
+		EXPECT_EQ(rows[i + 1].label, "Bulk " + to_string(i));
+		EXPECT_EQ(rows[i + 1].position, 10*i);
+	}
+	EXPECT_EQ(rows[4].label, "Event 1");
+
+	rows[0].label = "First";
+	rows[1].description = "Second";
+	table->setRows(0, 2, rows.data());
+
+	EXPECT_EQ(table->row(0).label, "First");
+	EXPECT_EQ(table->row(1).label, "Bulk 0");
+	EXPECT_EQ(table->row(1).description, "Second");
+
+	Event e = table->row(4);
+	e.duration = 7;
+	table->row(4, std::move(e));
+	EXPECT_EQ(table->row(4).duration, 7);
+	EXPECT_EQ(table->row(4).label, "Event 1");
+}
+
+} // namespace
+
+TEST(data_model_test, bulk_rows)
+{
+	EventTable table;
+	testBulkRows(&table);
+
+	PerRowEventTable perRowTable;
+	testBulkRows(&perRowTable);
+
+	TrackTable tracks;
+	tracks.insertRows(0, 3);
+	EXPECT_EQ(tracks.row(2).label, "T 2");
+	EXPECT_EQ(tracks.row(2).code, "out = in(2);");
+}
@@ -1,6 +1,20 @@
 #include <gtest/gtest.h>
 #include "common.h"
 
+#include <AlenkaFile/datamodel.h>
+#include <AlenkaFile/fileinfo.h>
+#include <AlenkaFile/overview.h>
+#include <AlenkaFile/saveprogress.h>
+#include <AlenkaFile/threadpool.h>
+
+#include <boost/filesystem.hpp>
+
+#include <atomic>
+#include <clocale>
+#include <cstring>
+
+#include <thread>
+
 namespace
 {
 
@@ -117,6 +131,311 @@ void dataTest(DataFile* file, TestFile* testFile, double maxRelErrDouble = MAX_R
 	EXPECT_LT(absErr, maxAbsErrFloat);
 }
 
+void compareFilesTest(DataFile* file, DataFile* reference)
+{
+	ASSERT_EQ(file->getChannelCount(), reference->getChannelCount());
+	ASSERT_EQ(file->getSamplesRecorded(), reference->getSamplesRecorded());
+
+	int channelCount = file->getChannelCount();
+	int sampleCount = static_cast<int>(file->getSamplesRecorded());
+	int n = channelCount*sampleCount;
+
+	vector<double> a(n), b(n);
+	file->readSignal(a.data(), 0, sampleCount - 1);
+	reference->readSignal(b.data(), 0, sampleCount - 1);
+
+	double relErr, absErr;
+	compareMatrix(a.data(), b.data(), channelCount, sampleCount, &relErr, &absErr);
+	EXPECT_DOUBLE_EQ(relErr, 0);
+	EXPECT_DOUBLE_EQ(absErr, 0);
+}
+
+template<class T>
+void channelSubsetTest(DataFile* file, int64_t firstSample, int64_t lastSample)
+{
+	int channelCount = file->getChannelCount();
+	int len = static_cast<int>(lastSample - firstSample + 1);
+
+	vector<T> all(channelCount*len);
+	file->readSignal(all.data(), firstSample, lastSample);
+
+	vector<unsigned int> channels;
+	for (int i = channelCount - 1; i >= 0; i -= 3)
+		channels.push_back(i);
+	channels.push_back(channels[0]);
+
+	vector<T> subset(channels.size()*len);
+	file->readSignal(subset.data(), channels, firstSample, lastSample);
+
+	for (unsigned int i = 0; i < channels.size(); i++)
+	{
+		double relErr, absErr;
+		compareMatrix(subset.data() + i*len, all.data() + channels[i]*len, 1, len, &relErr, &absErr);
+		EXPECT_DOUBLE_EQ(relErr, 0);
+		EXPECT_DOUBLE_EQ(absErr, 0);
+	}
+}
+
+void channelSubsetTest(DataFile* file)
+{
+	int64_t last = file->getSamplesRecorded() - 1;
+
+	channelSubsetTest<double>(file, 0, last);
+	channelSubsetTest<float>(file, 0, last);
+	channelSubsetTest<double>(file, -10, 10);
+	channelSubsetTest<double>(file, last/2, last/2);
+	channelSubsetTest<float>(file, last - 150, last + 20);
+
+	vector<double> data(100);
+	EXPECT_THROW(file->readSignal(data.data(), vector<unsigned int>{file->getChannelCount()}, 0, 10), invalid_argument);
+}
+
+template<class T>
+void blockCacheTest(DataFile* file, DataFile* reference, int64_t firstSample, int64_t lastSample, const vector<unsigned int>& channels)
+{
+	int len = static_cast<int>(lastSample - firstSample + 1);
+	int channelCount = static_cast<int>(channels.size());
+
+	vector<T> a(channelCount*len), b(channelCount*len);
+	file->readSignal(a.data(), channels, firstSample, lastSample);
+	reference->readSignal(b.data(), channels, firstSample, lastSample);
+
+	double relErr, absErr;
+	compareMatrix(a.data(), b.data(), channelCount, len, &relErr, &absErr);
+	EXPECT_DOUBLE_EQ(relErr, 0);
+	EXPECT_DOUBLE_EQ(absErr, 0);
+}
+
+// Scrolls forward and back over the file with the cache and compares the result to reference.
+void blockCacheTest(DataFile* file, DataFile* reference)
+{
+	file->setCacheSize(64*1024, 100);
+	file->setCacheReadAhead(true);
+
+	vector<unsigned int> all, some;
+	for (unsigned int i = 0; i < file->getChannelCount(); i++)
+		all.push_back(i);
+	for (unsigned int i = 0; i < file->getChannelCount(); i += 2)
+		some.push_back(i);
+
+	int64_t last = file->getSamplesRecorded() - 1;
+	int64_t step = max<int64_t>(1, last/20);
+
+	for (int64_t i = -step; i <= last + step; i += step)
+	{
+		blockCacheTest<double>(file, reference, i, i + 3*step, all);
+		blockCacheTest<float>(file, reference, i, i + 2*step, some);
+	}
+
+	for (int64_t i = last; i >= -step; i -= step)
+	{
+		blockCacheTest<double>(file, reference, i, i + 3*step, some);
+		blockCacheTest<float>(file, reference, i + 1, i + 1, all);
+	}
+
+	BlockCacheStats stats = file->getCacheStats();
+	EXPECT_GT(stats.hits, 0u);
+	EXPECT_GT(stats.misses, 0u);
+	EXPECT_LE(stats.bytesUsed, 64u*1024);
+
+	file->setCacheSize(0);
+	EXPECT_EQ(file->getCacheStats().blockCount, 0);
+}
+
+void concurrentReadsTest(DataFile* file)
+{
+	int channelCount = file->getChannelCount();
+	int64_t last = file->getSamplesRecorded() - 1;
+	const int n = 50, len = 100, threadCount = 4;
+
+	vector<vector<double>> expected(n, vector<double>(channelCount*len));
+	for (int i = 0; i < n; i++)
+		file->readSignal(expected[i].data(), i*last/n, i*last/n + len - 1);
+
+	// All the threads read the same ranges in a different order.
+	vector<int> errors(threadCount, 0);
+	vector<thread> threads;
+	for (int t = 0; t < threadCount; t++)
+	{
+		threads.emplace_back([&, t] ()
+		{
+			vector<double> data(channelCount*len);
+
+			for (int j = 0; j < n; j++)
+			{
+				int i = (j*(2*t + 1))%n;
+				file->readSignal(data.data(), i*last/n, i*last/n + len - 1);
+
+				if (data != expected[i])
+					errors[t]++;
+			}
+		});
+	}
+
+	for (auto& e : threads)
+		e.join();
+
+	for (int t = 0; t < threadCount; t++)
+		EXPECT_EQ(errors[t], 0);
+}
+
+// Writes a GDF 2.51 file with three channels at 4, 2 and 1 samples per record,
+// stored as int16, float32 and int8. Sample i of channel c has the value 10*c + i.
+void writeMixedRateGdf(const string& filePath, int records)
+{
+	const int channels = 3;
+	const uint32_t samplesPerRecord[channels] = {4, 2, 1};
+	const uint32_t typeOfData[channels] = {3, 16, 1};
+
+	vector<char> header(256*(1 + channels), 0);
+	auto put = [&header] (int offset, const void* value, size_t size) { memcpy(header.data() + offset, value, size); };
+
+	put(0, "GDF 2.51", 8);
+	uint16_t headerLength = 1 + channels;
+	put(184, &headerLength, 2);
+	int64_t numberOfRecords = records;
+	put(236, &numberOfRecords, 8);
+	double duration = 1;
+	put(244, &duration, 8);
+	uint16_t numberOfChannels = channels;
+	put(252, &numberOfChannels, 2);
+
+	int offset = 256 + (16 + 80 + 6 + 2)*channels;
+	for (double value : {-100., 100., -100., 100.})
+	{
+		for (int i = 0; i < channels; i++, offset += 8)
+			put(offset, &value, 8);
+	}
+
+	offset += (64 + 16)*channels;
+	put(offset, samplesPerRecord, sizeof(samplesPerRecord));
+	put(offset + 4*channels, typeOfData, sizeof(typeOfData));
+
+	ofstream file(filePath, ios_base::binary);
+	file.write(header.data(), header.size());
+
+	for (int r = 0; r < records; r++)
+	{
+		for (uint32_t i = r*4; i < (r + 1)*4u; i++)
+		{
+			int16_t value = static_cast<int16_t>(i);
+			file.write(reinterpret_cast<char*>(&value), 2);
+		}
+		for (uint32_t i = r*2; i < (r + 1)*2u; i++)
+		{
+			float value = 10.f + static_cast<float>(i);
+			file.write(reinterpret_cast<char*>(&value), 4);
+		}
+		int8_t value = static_cast<int8_t>(20 + r);
+		file.write(reinterpret_cast<char*>(&value), 1);
+	}
+
+	// An empty event table.
+	const char eventTable[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+	file.write(eventTable, sizeof(eventTable));
+}
+
+// Writes an EDF+ file of the given type ("EDF+C" or "EDF+D") with one 10 Hz signal and
+// an annotation signal of 60 bytes. There is a record of 1 s for every element of
+// records, which holds its TALs. Sample i has the value i.
+void writeSmallEdfPlus(const string& filePath, const string& type, const vector<string>& records)
+{
+	string patient = "X X X X", recording = "Startdate 24-DEC-2016 X X X";
+	string header = "0       " + patient + string(80 - patient.size(), ' ') + recording + string(80 - recording.size(), ' ')
+		+ "24.12.16" + "13.14.15" + "768     " + type + string(39, ' ');
+	string count = to_string(records.size());
+	header += count + string(8 - count.size(), ' ') + "1       " + "2   ";
+	header += "Fp1             " "EDF Annotations ";
+	header += string((80 + 8)*2, ' ');
+	header += "-32768  " "-1      " "32767   " "1       " "-32768  " "-32768  " "32767   " "32767   ";
+	header += string(80*2, ' ');
+	header += "10      " "30      ";
+	header += string(32*2, ' ');
+
+	ofstream file(filePath, ios_base::binary);
+	file << header;
+
+	for (size_t r = 0; r < records.size(); r++)
+	{
+		for (int16_t i = static_cast<int16_t>(10*r); i < static_cast<int16_t>(10*(r + 1)); i++)
+			file.write(reinterpret_cast<char*>(&i), 2);
+
+		file << records[r] << string(60 - records[r].size(), '\0');
+	}
+}
+
+// Writes a plain EDF file with many signals of 10 Hz. Sample j of signal c is c - j.
+void writeWideEdf(const string& filePath, int signals, int records)
+{
+	string header = "0       " + string(160, ' ') + "24.12.16" + "13.14.15";
+	string headerBytes = to_string(256*(signals + 1)), count = to_string(records), ns = to_string(signals);
+	header += headerBytes + string(8 - headerBytes.size(), ' ') + string(44, ' ');
+	header += count + string(8 - count.size(), ' ') + "1       " + ns + string(4 - ns.size(), ' ');
+
+	for (int c = 0; c < signals; c++)
+	{
+		string label = "C" + to_string(c);
+		header += label + string(16 - label.size(), ' ');
+	}
+	header += string((80 + 8)*signals, ' ');
+	for (const char* e : {"-32768  ", "32767   ", "-32768  ", "32767   "})
+	{
+		for (int c = 0; c < signals; c++)
+			header += e;
+	}
+	header += string(80*signals, ' ');
+	for (int c = 0; c < signals; c++)
+		header += "10      ";
+	header += string(32*signals, ' ');
+
+	ofstream file(filePath, ios_base::binary);
+	file << header;
+
+	for (int r = 0; r < records; r++)
+	{
+		for (int c = 0; c < signals; c++)
+		{
+			for (int j = 10*r; j < 10*(r + 1); j++)
+			{
+				int16_t value = static_cast<int16_t>(c - j);
+				file.write(reinterpret_cast<char*>(&value), 2);
+			}
+		}
+	}
+}
+
+// Writes a plain EDF file with a signal of 10 samples per record and one of 3.
+// Sample j of the first signal is j and of the second 100 + j.
+void writeMixedRateEdf(const string& filePath, int records)
+{
+	string count = to_string(records);
+	string header = "0       " + string(160, ' ') + "24.12.16" + "13.14.15" + "768     " + string(44, ' ');
+	header += count + string(8 - count.size(), ' ') + "1       " + "2   ";
+	header += "Fast            " "Slow            ";
+	header += string((80 + 8)*2, ' ');
+	header += "-32768  " "-32768  " "32767   " "32767   " "-32768  " "-32768  " "32767   " "32767   ";
+	header += string(80*2, ' ');
+	header += "10      " "3       ";
+	header += string(32*2, ' ');
+
+	ofstream file(filePath, ios_base::binary);
+	file << header;
+
+	for (int r = 0; r < records; r++)
+	{
+		for (int j = 10*r; j < 10*(r + 1); j++)
+		{
+			int16_t value = static_cast<int16_t>(j);
+			file.write(reinterpret_cast<char*>(&value), 2);
+		}
+		for (int j = 3*r; j < 3*(r + 1); j++)
+		{
+			int16_t value = static_cast<int16_t>(100 + j);
+			file.write(reinterpret_cast<char*>(&value), 2);
+		}
+	}
+}
+
 template<class T>
 void gdfStartTimeTest()
 {
@@ -165,6 +484,265 @@ TEST_F(primary_file_test, outOfBounds)
 	//mat4.outOfBoundsTest(unique_ptr<DataFile>(mat4.makeMAT()).get()); // TODO: Fix this
 }
 
+TEST_F(primary_file_test, channelSubset)
+{
+	channelSubsetTest(unique_ptr<DataFile>(gdf00.makeGDF2()).get());
+	channelSubsetTest(unique_ptr<DataFile>(gdf01.makeGDF2()).get());
+
+	channelSubsetTest(unique_ptr<DataFile>(edf00.makeEDF()).get());
+
+	MATvars vars;
+	vars.data = vector<string>{"data0", "data1"};
+	vars.frequency = "Fs";
+	channelSubsetTest(unique_ptr<DataFile>(mat7.makeMAT(vars)).get());
+}
+
+TEST_F(primary_file_test, blockCache)
+{
+	blockCacheTest(unique_ptr<DataFile>(gdf00.makeGDF2()).get(), unique_ptr<DataFile>(gdf00.makeGDF2()).get());
+	blockCacheTest(unique_ptr<DataFile>(edf00.makeEDF()).get(), unique_ptr<DataFile>(edf00.makeEDF()).get());
+
+	MATvars vars;
+	vars.data = vector<string>{"data0", "data1"};
+	vars.frequency = "Fs";
+	blockCacheTest(unique_ptr<DataFile>(mat7.makeMAT(vars)).get(), unique_ptr<DataFile>(mat7.makeMAT(vars)).get());
+}
+
+TEST_F(primary_file_test, asyncRead)
+{
+	unique_ptr<DataFile> file(gdf00.makeGDF2());
+	unique_ptr<DataFile> reference(gdf00.makeGDF2());
+
+	int channelCount = file->getChannelCount();
+	int64_t last = file->getSamplesRecorded() - 1;
+	const int n = 20, len = 100;
+
+	// Overlapping requests out of order, some of them beyond the end of the file.
+	vector<vector<double>> buffers(n, vector<double>(channelCount*len));
+	vector<future<void>> results;
+	for (int i = 0; i < n; i++)
+	{
+		int64_t first = (i*7919)%(last + 50) - 25;
+		results.push_back(file->readSignalAsync(buffers[i].data(), first, first + len - 1));
+	}
+
+	vector<float> floatBuffer(channelCount*len);
+	promise<exception_ptr> callbackResult;
+	file->readSignalAsync(floatBuffer.data(), 0, len - 1, [&callbackResult] (exception_ptr e) { callbackResult.set_value(e); });
+
+	for (int i = 0; i < n; i++)
+	{
+		ASSERT_NO_THROW(results[i].get());
+
+		int64_t first = (i*7919)%(last + 50) - 25;
+		vector<double> expected(channelCount*len);
+		reference->readSignal(expected.data(), first, first + len - 1);
+
+		EXPECT_EQ(buffers[i], expected);
+	}
+
+	EXPECT_EQ(callbackResult.get_future().get(), nullptr);
+	vector<float> expected(channelCount*len);
+	reference->readSignal(expected.data(), 0, len - 1);
+	EXPECT_EQ(floatBuffer, expected);
+
+	// Cancelled requests report ReadCancelled; the others complete normally.
+	for (int i = 0; i < n; i++)
+		results[i] = file->readSignalAsync(buffers[i].data(), i*len, i*len + len - 1);
+
+	file->cancelAsyncReads(0, len - 1);
+
+	for (int i = 0; i < n; i++)
+	{
+		try
+		{
+			results[i].get();
+		}
+		catch (ReadCancelled&)
+		{
+			EXPECT_NE(i, 0);
+		}
+	}
+
+	vector<double> data(100);
+	EXPECT_THROW(file->readSignalAsync(data.data(), 10, 5), invalid_argument);
+}
+
+TEST_F(primary_file_test, asyncReadRuns)
+{
+	using namespace boost::filesystem;
+
+	const int channels = 100, len = 1000, n = 20;
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(edfPath.string(), channels, n*len/10 + 100);
+
+	{
+		EDF file(edfPath.string());
+
+		// Submits a request whose callback keeps the worker busy until release is set.
+		vector<double> blocker(channels*10);
+		auto blockWorker = [&file, &blocker] (promise<void>& started, promise<void>& release)
+		{
+			shared_future<void> released = release.get_future().share();
+			file.readSignalAsync(blocker.data(), 0, 9, [&started, released] (exception_ptr)
+			{
+				started.set_value();
+				released.wait();
+			});
+		};
+
+		// The second blocker and the separate requests are queued together,
+		// but the worker takes only the blocker; the rest can still be cancelled.
+		promise<void> started1, release1, started2, release2;
+		blockWorker(started1, release1);
+		started1.get_future().wait();
+		blockWorker(started2, release2);
+
+		vector<vector<double>> buffers(n, vector<double>(channels*len));
+		vector<future<void>> results;
+		for (int i = 0; i < n; i++)
+			results.push_back(file.readSignalAsync(buffers[i].data(), 100 + 2*i*len, 100 + 2*i*len + len - 1));
+
+		release1.set_value();
+		started2.get_future().wait();
+		file.cancelAsyncReads(100, 100 + len - 1);
+		release2.set_value();
+
+		for (int i = 0; i < n; i++)
+		{
+			if (i == 0)
+				EXPECT_NO_THROW(results[i].get());
+			else
+				EXPECT_THROW(results[i].get(), ReadCancelled) << "i = " << i;
+		}
+
+		// A long chain of touching requests is read in several runs.
+		promise<void> started3, release3;
+		blockWorker(started3, release3);
+		started3.get_future().wait();
+
+		results.clear();
+		for (int i = 0; i < n; i++)
+			results.push_back(file.readSignalAsync(buffers[i].data(), 100 + i*len, 100 + i*len + len - 1));
+
+		release3.set_value();
+
+		for (int i = 0; i < n; i++)
+		{
+			ASSERT_NO_THROW(results[i].get());
+
+			for (int c = 0; c < channels; c++)
+			{
+				for (int j = 0; j < len; j += 97)
+					ASSERT_EQ(buffers[i][c*len + j], c - j - 100 - i*len) << "i = " << i << ", c = " << c << ", j = " << j;
+			}
+		}
+	}
+
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, GDF2_concurrent_reads)
+{
+	for (bool memoryMapped : {true, false})
+		concurrentReadsTest(unique_ptr<DataFile>(new GDF2(gdf00.path + ".gdf", false, memoryMapped)).get());
+}
+
+TEST_F(primary_file_test, EDF_concurrent_reads)
+{
+	concurrentReadsTest(unique_ptr<DataFile>(edf00.makeEDF()).get());
+}
+
+TEST_F(primary_file_test, overview)
+{
+	using namespace boost::filesystem;
+
+	path tmpPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	copy_file(gdf00.path + ".gdf", tmpPath);
+
+	{
+		unique_ptr<DataFile> file(new GDF2(tmpPath.string()));
+		file->buildOverview();
+
+		shared_ptr<const Overview> overview = file->getOverview();
+		ASSERT_NE(overview, nullptr);
+		ASSERT_GT(overview->getLevelCount(), 0);
+		EXPECT_EQ(overview->getBinCount(overview->getLevelCount() - 1), 1u);
+
+		int channelCount = file->getChannelCount();
+		int64_t sampleCount = file->getSamplesRecorded();
+		vector<float> signal(channelCount*sampleCount);
+		file->readSignal(signal.data(), 0, sampleCount - 1);
+
+		for (int level = 0; level < overview->getLevelCount(); level++)
+		{
+			int64_t binSize = overview->getBinSize(level);
+			int64_t binCount = overview->getBinCount(level);
+
+			vector<float> minimum(channelCount*binCount), maximum(channelCount*binCount), mean(channelCount*binCount);
+			overview->readEnvelope(level, 0, binCount - 1, minimum.data(), maximum.data(), mean.data());
+
+			for (int i = 0; i < channelCount; i++)
+			{
+				for (int64_t b = 0; b < binCount; b++)
+				{
+					auto first = signal.begin() + i*sampleCount + b*binSize;
+					auto last = signal.begin() + i*sampleCount + min(sampleCount, (b + 1)*binSize);
+					double sum = 0;
+					for (auto it = first; it != last; ++it)
+						sum += *it;
+					double n = static_cast<double>(last - first);
+
+					EXPECT_EQ(minimum[i*binCount + b], *min_element(first, last));
+					EXPECT_EQ(maximum[i*binCount + b], *max_element(first, last));
+					EXPECT_NEAR(mean[i*binCount + b], sum/n, 1e-4*(1 + abs(sum/n)));
+				}
+			}
+		}
+	}
+
+	EXPECT_TRUE(exists(tmpPath.string() + ".overview"));
+
+	// The second file loads the sidecar in the background.
+	{
+		unique_ptr<DataFile> file(new GDF2(tmpPath.string()));
+		file->buildOverview(true);
+
+		while (!file->getOverview())
+			this_thread::yield();
+
+		EXPECT_TRUE(file->getOverview()->matches(file.get()));
+	}
+
+	remove(tmpPath.string() + ".overview");
+	remove(tmpPath);
+}
+
+TEST_F(primary_file_test, threadPool)
+{
+	ThreadPool pool(3);
+
+	for (bool memoryMapped : {true, false})
+	{
+		unique_ptr<DataFile> file(new GDF2(gdf00.path + ".gdf", false, memoryMapped));
+		unique_ptr<DataFile> reference(new GDF2(gdf00.path + ".gdf", false, memoryMapped));
+		file->setThreadPool(&pool);
+
+		compareFilesTest(file.get(), reference.get());
+		channelSubsetTest(file.get());
+	}
+
+	MATvars vars;
+	vars.data = vector<string>{"data0", "data1"};
+	vars.frequency = "Fs";
+
+	unique_ptr<DataFile> file(mat7.makeMAT(vars));
+	unique_ptr<DataFile> reference(mat7.makeMAT(vars));
+	file->setThreadPool(&pool);
+
+	compareFilesTest(file.get(), reference.get());
+}
+
 // TODO: Add all kinds of crazy tests that read samples and compare them to data read from the whole file. Like read only one sample long block.
 // TODO: Test whether readSignal modifies immediately before and after the bufer size -- whether it writes out of bounds.
 
@@ -206,7 +784,443 @@ TEST_F(primary_file_test, GDF2_data_01)
 	dataTest(unique_ptr<DataFile>(gdf01.makeGDF2()).get(), &gdf01);
 }
 
-// Tests of EDFlib.
+TEST_F(primary_file_test, GDF2_memory_mapped)
+{
+	unique_ptr<DataFile> mapped(new GDF2(gdf00.path + ".gdf", false, true));
+	unique_ptr<DataFile> streamed(new GDF2(gdf00.path + ".gdf", false, false));
+
+	compareFilesTest(mapped.get(), streamed.get());
+	outOfBoundsTest(streamed.get(), 100, 10);
+}
+
+TEST_F(primary_file_test, GDF2_read_batch_size)
+{
+	unique_ptr<DataFile> mapped(new GDF2(gdf00.path + ".gdf", false, true));
+
+	// Batches smaller than a record, spanning a few records and the whole file.
+	for (size_t batchSize : {1, 10000, 1 << 30})
+	{
+		unique_ptr<GDF2> batched(new GDF2(gdf00.path + ".gdf", false, false));
+		batched->setReadBatchSize(batchSize);
+
+		compareFilesTest(mapped.get(), batched.get());
+	}
+}
+
+TEST_F(primary_file_test, GDF2_truncated)
+{
+	using namespace boost::filesystem;
+
+	path tmpPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	writeMixedRateGdf(tmpPath.string(), 400);
+	resize_file(tmpPath, file_size(tmpPath)/2);
+
+	// The default memory mapping must not be used for the missing part.
+	{
+		GDF2 file(tmpPath.string());
+		uint64_t n = file.getSamplesRecorded();
+		vector<float> data(file.getChannelCount()*n);
+
+		EXPECT_NO_THROW(file.readSignal(data.data(), 0, 0));
+		EXPECT_THROW(file.readSignal(data.data(), 0, n - 1), runtime_error);
+	}
+
+	remove(tmpPath);
+}
+
+TEST_F(primary_file_test, GDF2_mixed_rates)
+{
+	using namespace boost::filesystem;
+
+	path tmpPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	const int records = 3;
+	writeMixedRateGdf(tmpPath.string(), records);
+
+	for (bool memoryMapped : {true, false})
+	{
+		unique_ptr<GDF2> file(new GDF2(tmpPath.string(), false, memoryMapped));
+
+		// The cache must not keep the samples resampled the other way.
+		if (memoryMapped)
+			file->setCacheSize(1 << 20, 4);
+
+		ASSERT_EQ(file->getChannelCount(), 3u);
+		ASSERT_EQ(file->getSamplesRecorded(), 4u*records);
+		EXPECT_DOUBLE_EQ(file->getSamplingFrequency(), 4);
+		EXPECT_DOUBLE_EQ(file->getChannelSamplingFrequency(1), 2);
+		EXPECT_EQ(file->getChannelSamplesRecorded(2), 1u*records);
+		EXPECT_THROW(file->getChannelSamplingFrequency(3), invalid_argument);
+		EXPECT_THROW(file->getChannelSamplesRecorded(3), invalid_argument);
+
+		for (unsigned int channel = 0; channel < 3; channel++)
+		{
+			vector<double> native(file->getChannelSamplesRecorded(channel));
+			file->readChannelNative(channel, native.data(), 0, native.size() - 1);
+
+			for (unsigned int i = 0; i < native.size(); i++)
+				EXPECT_DOUBLE_EQ(native[i], 10*channel + i);
+		}
+
+		int n = 4*records;
+		vector<double> data(3*n);
+		file->readSignal(data.data(), 0, n - 1);
+
+		for (int i = 0; i < n; i++)
+		{
+			EXPECT_DOUBLE_EQ(data[i], i);
+			EXPECT_DOUBLE_EQ(data[n + i], 10 + i/2);
+			EXPECT_DOUBLE_EQ(data[2*n + i], 20 + i/4);
+		}
+
+		file->setResampling(GDF2::Resampling::Linear);
+		file->readSignal(data.data(), 0, n - 1);
+
+		for (int i = 0; i < n; i++)
+		{
+			EXPECT_DOUBLE_EQ(data[n + i], min(10 + i/2., 10 + 2*records - 1.));
+			EXPECT_DOUBLE_EQ(data[2*n + i], min(20 + i/4., 20 + records - 1.));
+		}
+
+		EXPECT_THROW(file->readChannelNative(1, data.data(), 0, 2*records), invalid_argument);
+
+		vector<double*> dataChannels = {data.data(), data.data() + n, data.data() + 2*n};
+		EXPECT_THROW(file->readChannels(dataChannels, 0, n), invalid_argument);
+		dataChannels.pop_back();
+		EXPECT_THROW(file->readChannels(dataChannels, 0, n - 1), invalid_argument);
+	}
+
+	remove(tmpPath);
+}
+
+TEST_F(primary_file_test, GDF2_lazy_header)
+{
+	using namespace boost::filesystem;
+
+	path tmpPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	const int records = 5;
+	writeMixedRateGdf(tmpPath.string(), records);
+
+	for (bool memoryMapped : {true, false})
+	{
+		// The first reads come from several threads at once, so they race to
+		// parse the rest of the header and open the data section.
+		unique_ptr<GDF2> file(new GDF2(tmpPath.string(), false, memoryMapped));
+		int n = 4*records;
+		const int threadCount = 4;
+
+		vector<int> errors(threadCount, 0);
+		vector<thread> threads;
+		for (int t = 0; t < threadCount; t++)
+		{
+			threads.emplace_back([&, t] ()
+			{
+				vector<double> data(3*n);
+				file->readSignal(data.data(), 0, n - 1);
+
+				for (int i = 0; i < n; i++)
+				{
+					if (data[i] != i || data[n + i] != 10 + i/2 || data[2*n + i] != 20 + i/4)
+						errors[t]++;
+				}
+			});
+		}
+
+		for (auto& e : threads)
+			e.join();
+
+		for (int t = 0; t < threadCount; t++)
+			EXPECT_EQ(errors[t], 0);
+
+		unique_ptr<GDF2> fresh(new GDF2(tmpPath.string(), false, memoryMapped));
+		EXPECT_DOUBLE_EQ(fresh->getPhysicalMinimum(1), -100);
+		EXPECT_DOUBLE_EQ(fresh->getDigitalMaximum(2), 100);
+		EXPECT_EQ(fresh->getLabel(0), "");
+	}
+
+	remove(tmpPath);
+}
+
+TEST_F(primary_file_test, GDF2_save_as)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	path outputPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	const int records = 5;
+	writeMixedRateGdf(sourcePath.string(), records);
+
+	GDF2 source(sourcePath.string());
+	source.setResampling(GDF2::Resampling::Linear);
+
+	DataModel sourceModel(new EventTypeTable(), new MontageTable());
+	source.setDataModel(&sourceModel);
+	source.load();
+
+	Montage montage = sourceModel.montageTable()->row(0);
+	montage.save = true;
+	sourceModel.montageTable()->row(0, montage);
+
+	AbstractEventTypeTable* ett = sourceModel.eventTypeTable();
+	ett->insertRows(0);
+	EventType et = ett->row(0);
+	et.id = 7;
+	ett->row(0, et);
+
+	AbstractEventTable* events = sourceModel.montageTable()->eventTable(0);
+	events->insertRows(0);
+	Event e = events->row(0);
+	e.position = 3;
+	e.duration = 2;
+	e.channel = 1;
+	e.type = 0;
+	events->row(0, e);
+
+	const int n = static_cast<int>(source.getSamplesRecorded());
+	vector<double> expected(3*n), data(3*n);
+	source.readSignal(expected.data(), 0, n - 1);
+
+	for (int typeOfData : {16, 17})
+	{
+		GDF2::saveAs(outputPath.string(), &source, typeOfData);
+
+		GDF2 file(outputPath.string());
+		ASSERT_EQ(file.getChannelCount(), 3u);
+		ASSERT_EQ(file.getSamplesRecorded(), source.getSamplesRecorded());
+		EXPECT_DOUBLE_EQ(file.getSamplingFrequency(), source.getSamplingFrequency());
+		EXPECT_DOUBLE_EQ(file.getStartDate(), source.getStartDate());
+
+		file.readSignal(data.data(), 0, n - 1);
+		for (int i = 0; i < 3*n; i++)
+			EXPECT_DOUBLE_EQ(data[i], typeOfData == 16 ? static_cast<float>(expected[i]) : expected[i]);
+
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		AbstractEventTable* savedEvents = dataModel.montageTable()->eventTable(0);
+		ASSERT_EQ(savedEvents->rowCount(), 1);
+		EXPECT_EQ(savedEvents->row(0).position, 3);
+		EXPECT_EQ(savedEvents->row(0).duration, 2);
+		EXPECT_EQ(savedEvents->row(0).channel, 1);
+		EXPECT_EQ(dataModel.eventTypeTable()->row(savedEvents->row(0).type).id, 7);
+	}
+
+	EXPECT_THROW(GDF2::saveAs(outputPath.string(), &source, 3), invalid_argument);
+
+	remove(sourcePath);
+	remove(outputPath);
+}
+
+TEST_F(primary_file_test, GDF2_save_as_padding)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	path outputPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	writeMixedRateGdf(sourcePath.string(), 7);
+
+	// Records of 0.8 s make it 28 samples at 5 Hz, which is not a whole number of seconds.
+	{
+		std::fstream file(sourcePath.string(), ios_base::in | ios_base::out | ios_base::binary);
+		double duration = 0.8;
+		file.seekp(244);
+		file.write(reinterpret_cast<char*>(&duration), 8);
+	}
+
+	GDF2 source(sourcePath.string());
+	ASSERT_EQ(source.getSamplesRecorded(), 28u);
+
+	DataModel sourceModel(new EventTypeTable(), new MontageTable());
+	source.setDataModel(&sourceModel);
+	source.load();
+
+	vector<double> expected(3*30);
+	source.readSignal(expected.data(), 0, 29);
+
+	GDF2::saveAs(outputPath.string(), &source, 17);
+
+	{
+		GDF2 file(outputPath.string());
+		ASSERT_EQ(file.getSamplesRecorded(), 30u);
+		EXPECT_DOUBLE_EQ(file.getSamplingFrequency(), 5);
+
+		vector<double> data(3*30);
+		file.readSignal(data.data(), 0, 29);
+
+		for (int i = 0; i < 3*30; i++)
+		{
+			EXPECT_EQ(data[i], expected[i]) << "i = " << i;
+
+			if (i%30 >= 28)
+			{
+				EXPECT_EQ(data[i], 0) << "i = " << i;
+			}
+		}
+	}
+
+	remove(sourcePath);
+	remove(outputPath);
+}
+
+TEST_F(primary_file_test, GDF2_save_progress)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	path outputPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	writeMixedRateGdf(sourcePath.string(), 5);
+
+	GDF2 source(sourcePath.string());
+	DataModel dataModel(new EventTypeTable(), new MontageTable());
+	source.setDataModel(&dataModel);
+	source.load();
+
+	int calls = 0;
+	SaveProgress progress([&calls] (SaveProgress&) { ++calls; });
+	GDF2::saveAs(outputPath.string(), &source, 17, &progress);
+
+	EXPECT_LT(0, calls);
+	EXPECT_EQ(progress.getTotalSamples(), source.getSamplesRecorded());
+	EXPECT_EQ(progress.getSamplesProcessed(), source.getSamplesRecorded());
+	EXPECT_EQ(progress.getBytesProcessed(), 8*3*source.getSamplesRecorded());
+	EXPECT_LE(0, progress.getBytesPerSecond());
+	EXPECT_TRUE(exists(outputPath));
+
+	// A cancelled export leaves no file behind.
+	remove(outputPath);
+	SaveProgress cancelled([] (SaveProgress& p) { p.cancel(); });
+	EXPECT_THROW(GDF2::saveAs(outputPath.string(), &source, 17, &cancelled), SaveCancelled);
+	EXPECT_FALSE(exists(outputPath));
+
+	// The same goes for the backup made by save().
+	SaveProgress cancelledSave;
+	cancelledSave.cancel();
+	EXPECT_THROW(source.save(&cancelledSave), SaveCancelled);
+	EXPECT_FALSE(exists(sourcePath.string() + ".backup"));
+
+	SaveProgress saveProgress;
+	source.save(&saveProgress);
+	EXPECT_EQ(saveProgress.getSamplesProcessed(), source.getSamplesRecorded());
+	EXPECT_EQ(saveProgress.getBytesProcessed(), file_size(sourcePath.string() + ".backup"));
+
+	remove(sourcePath);
+	remove(sourcePath.string() + ".backup");
+	remove(sourcePath.string() + ".mont");
+}
+
+TEST_F(primary_file_test, GDF2_read_stats)
+{
+	using namespace boost::filesystem;
+
+	path filePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	writeMixedRateGdf(filePath.string(), 5);
+
+	{
+		GDF2 file(filePath.string(), false, false);
+		file.setCacheSize(1024*1024, 4);
+
+		uint64_t n = file.getSamplesRecorded();
+		vector<float> buffer(3*(n + 4));
+		file.readSignal(buffer.data(), -2, n + 1);
+		file.readSignal(buffer.data(), -2, n + 1);
+
+		ReadStats stats = file.getReadStats();
+		EXPECT_GT(stats.cacheHits, 0u);
+		EXPECT_GT(stats.cacheMisses, 0u);
+
+		if (stats.enabled)
+		{
+			EXPECT_EQ(stats.readSignalCalls, 2u);
+			EXPECT_EQ(stats.samplesZeroFilled, 2*3*4u);
+			EXPECT_GT(stats.ioCalls, 0u);
+			EXPECT_GT(stats.bytesRead, 0u);
+			EXPECT_EQ(stats.recordsDecoded, 5u);
+			EXPECT_EQ(stats.samplesConverted, 4*5u + 2*5u + 1*5u);
+			EXPECT_LE(stats.ioSeconds + stats.decodeSeconds, stats.totalSeconds);
+
+			file.resetReadStats();
+			EXPECT_EQ(file.getReadStats().readSignalCalls, 0u);
+			EXPECT_EQ(file.getReadStats().bytesRead, 0u);
+		}
+		else
+		{
+			EXPECT_EQ(stats.readSignalCalls, 0u);
+			EXPECT_EQ(file.getReadCounters(), nullptr);
+		}
+	}
+
+	remove(filePath);
+}
+
+TEST_F(primary_file_test, probe)
+{
+	using namespace boost::filesystem;
+
+	path dir = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%");
+	create_directories(dir/"sub");
+
+	writeMixedRateGdf((dir/"a.gdf").string(), 5);
+
+	// An EDF+ file with two signals and an annotation signal, 3 records of 0.5 s.
+	{
+		string header = "0       " + string(80, ' ') + string(80, ' ') + "24.12.16" + "13.14.15" + "1024    "
+			+ "EDF+C" + string(39, ' ') + "3       " + "0.5     " + "3   ";
+		header += "Fp1             " "Fp2             " "EDF Annotations ";
+		header += string((80 + 8*5 + 80)*3, ' ');
+		header += "100     " "100     " "30      ";
+		header += string(32*3, ' ');
+		header += string(3*(2*100 + 2*100 + 2*30), '\0');
+
+		std::ofstream file((dir/"sub"/"b.EDF").string(), ios_base::binary);
+		file << header;
+	}
+
+	{
+		std::ofstream file((dir/"c.edf").string(), ios_base::binary);
+		file << "not an EDF file";
+	}
+
+	{
+		std::ofstream file((dir/"d.txt").string(), ios_base::binary);
+		file << "ignored";
+	}
+
+	FileInfo gdf = probeFile((dir/"a.gdf").string());
+	EXPECT_EQ(gdf.format, FileFormat::GDF2);
+	EXPECT_EQ(gdf.channelCount, 3u);
+	EXPECT_DOUBLE_EQ(gdf.samplingFrequency, 4);
+	EXPECT_EQ(gdf.samplesRecorded, 20u);
+	EXPECT_EQ(gdf.labels.size(), 3u);
+
+	GDF2 gdfFile((dir/"a.gdf").string());
+	EXPECT_DOUBLE_EQ(gdf.startDate, gdfFile.getStartDate());
+
+	ThreadPool pool(2);
+	vector<FileInfo> infos = scanDirectory(dir.string(), &pool);
+	ASSERT_EQ(infos.size(), 3u);
+
+	EXPECT_EQ(infos[0].format, FileFormat::GDF2);
+	EXPECT_TRUE(infos[0].error.empty());
+
+	EXPECT_EQ(infos[1].format, FileFormat::EDF);
+	EXPECT_FALSE(infos[1].error.empty());
+
+	const FileInfo& edf = infos[2];
+	EXPECT_TRUE(edf.error.empty());
+	EXPECT_EQ(edf.format, FileFormat::EDF);
+	EXPECT_EQ(edf.channelCount, 2u);
+	EXPECT_DOUBLE_EQ(edf.samplingFrequency, 200);
+	EXPECT_EQ(edf.samplesRecorded, 300u);
+	EXPECT_EQ(edf.labels, (vector<string>{"Fp1", "Fp2"}));
+	EXPECT_NEAR(edf.startDate, 736688 + (13 + (14 + 15/60.)/60)/24, 1);
+
+	EXPECT_EQ(scanDirectory(dir.string(), nullptr, false).size(), 2u);
+	EXPECT_THROW(probeFile((dir/"d.txt").string()), runtime_error);
+
+	remove_all(dir);
+}
+
+// Tests of EDF.
 TEST_F(primary_file_test, EDF_exceptions)
 {
 	unique_ptr<DataFile> file;
@@ -241,6 +1255,636 @@ TEST_F(primary_file_test, EDF_data_00)
 		MAX_REL_ERR_FLOAT/1000, MAX_ABS_ERR_DOUBLE/100000, MAX_ABS_ERR_FLOAT/100);
 }
 
+TEST_F(primary_file_test, EDF_deferred_annotations)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeMixedRateGdf(sourcePath.string(), 5);
+
+	{
+		GDF2 source(sourcePath.string());
+		DataModel sourceModel(new EventTypeTable(), new MontageTable());
+		source.setDataModel(&sourceModel);
+		source.load();
+
+		Montage montage = sourceModel.montageTable()->row(0);
+		montage.save = true;
+		sourceModel.montageTable()->row(0, montage);
+
+		sourceModel.eventTypeTable()->insertRows(0);
+
+		AbstractEventTable* events = sourceModel.montageTable()->eventTable(0);
+		events->insertRows(0, 3);
+		for (int i = 0; i < 3; i++)
+		{
+			Event e = events->row(i);
+			e.position = 4*i + 1;
+			e.duration = i;
+			e.channel = i - 1;
+			e.type = 0;
+			events->row(i, e);
+		}
+
+		EDF::saveAs(edfPath.string(), &source);
+	}
+
+	vector<Event> expected;
+
+	for (EDF::Annotations annotations : {EDF::Annotations::OnOpen, EDF::Annotations::InBackground, EDF::Annotations::OnLoad})
+	{
+		EDF file(edfPath.string(), annotations);
+
+		// The signal is available before the annotations are read.
+		vector<float> data(3*file.getSamplesRecorded());
+		file.readSignal(data.data(), 0, file.getSamplesRecorded() - 1);
+
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		AbstractEventTable* events = dataModel.montageTable()->eventTable(0);
+		ASSERT_EQ(events->rowCount(), 3);
+
+		if (annotations == EDF::Annotations::OnOpen)
+		{
+			for (int i = 0; i < 3; i++)
+				expected.push_back(events->row(i));
+			continue;
+		}
+
+		for (int i = 0; i < 3; i++)
+		{
+			EXPECT_EQ(events->row(i).position, expected[i].position);
+			EXPECT_EQ(events->row(i).duration, expected[i].duration);
+			EXPECT_EQ(events->row(i).channel, expected[i].channel);
+			EXPECT_EQ(events->row(i).type, expected[i].type);
+		}
+	}
+
+	// Destroying the file while the annotations are being read is fine.
+	unique_ptr<EDF> file(new EDF(edfPath.string(), EDF::Annotations::InBackground));
+	file.reset();
+
+	remove(sourcePath);
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, EDF_native_annotations)
+{
+	using namespace boost::filesystem;
+
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+
+	writeSmallEdfPlus(edfPath.string(), "EDF+C", {
+		string("+0\x14\x14", 4) + '\0' + "+0.5\x15" "0.25\x14" "Sleep stage W\x14" + '\0',
+		string("+1\x14\x14", 4) + '\0' + "+1.2\x14t=3 c=0|label|description\x14" + '\0'});
+
+	EDF file(edfPath.string(), EDF::Annotations::OnLoad);
+	DataModel dataModel(new EventTypeTable(), new MontageTable());
+	file.setDataModel(&dataModel);
+	file.load();
+
+	AbstractEventTypeTable* types = dataModel.eventTypeTable();
+	ASSERT_EQ(types->rowCount(), 2);
+	EXPECT_EQ(types->row(0).id, -1);
+	EXPECT_EQ(types->row(1).id, 3);
+
+	AbstractEventTable* events = dataModel.montageTable()->eventTable(0);
+	ASSERT_EQ(events->rowCount(), 2);
+
+	// Annotations from other programs keep the whole text.
+	Event e = events->row(0);
+	EXPECT_EQ(e.position, 5);
+	EXPECT_EQ(e.duration, 3);
+	EXPECT_EQ(e.type, 0);
+	EXPECT_EQ(e.label, "Sleep stage W");
+	EXPECT_EQ(e.description, "Sleep stage W");
+
+	e = events->row(1);
+	EXPECT_EQ(e.position, 12);
+	EXPECT_EQ(e.type, 1);
+	EXPECT_EQ(e.channel, 0);
+	EXPECT_EQ(e.label, "label");
+	EXPECT_EQ(e.description, "description");
+
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, EDF_discontinuous)
+{
+	using namespace boost::filesystem;
+
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+
+	// The third record starts 3 s after the end of the second one.
+	writeSmallEdfPlus(edfPath.string(), "EDF+D", {
+		string("+10\x14\x14", 5) + '\0',
+		string("+11\x14\x14", 5) + '\0',
+		string("+15\x14\x14", 5) + '\0' + "+15.2\x14t=0 c=-1|a|b\x14" + '\0',
+		string("+16\x14\x14", 5) + '\0'});
+
+	EDF file(edfPath.string(), EDF::Annotations::OnLoad);
+	ASSERT_TRUE(file.isDiscontinuous());
+	ASSERT_EQ(file.getSamplesRecorded(), 40u);
+
+	EXPECT_DOUBLE_EQ(file.sampleToTime(15), 1.5);
+	EXPECT_DOUBLE_EQ(file.sampleToTime(25), 5.5);
+	EXPECT_EQ(file.timeToSample(1.5), 15u);
+	EXPECT_EQ(file.timeToSample(3), 20u); // In the gap.
+	EXPECT_EQ(file.timeToSample(5.2), 22u);
+	EXPECT_EQ(file.timeToSample(100), 40u);
+
+	// From 1.5 s to 5.4 s: samples 15 to 19, 3 s of zeros and samples 20 to 24.
+	vector<double> data(40);
+	file.readSignalByTime(data.data(), 1.5, 40);
+
+	for (int i = 0; i < 40; i++)
+	{
+		double expected = i < 5 ? 15 + i : i < 35 ? 0 : i - 15;
+		EXPECT_EQ(data[i], expected) << "i = " << i;
+	}
+
+	// The event is placed by the record onsets.
+	DataModel dataModel(new EventTypeTable(), new MontageTable());
+	file.setDataModel(&dataModel);
+	file.load();
+
+	AbstractEventTable* events = dataModel.montageTable()->eventTable(0);
+	ASSERT_EQ(events->rowCount(), 1);
+	EXPECT_EQ(events->row(0).position, 22);
+
+	// Each of the last two records gets two events. They fit in the annotation
+	// signal only if they are stored in the records that hold their samples.
+	events->insertRows(1, 3);
+	for (int i = 1; i < 4; i++)
+	{
+		Event e = events->row(0);
+		e.position = i == 1 ? 25 : 29 + 3*i;
+		e.label = "";
+		e.description = "";
+		events->row(i, e);
+	}
+
+	Montage montage = dataModel.montageTable()->row(0);
+	montage.save = true;
+	dataModel.montageTable()->row(0, montage);
+
+	file.save();
+	remove(edfPath.string() + ".mont");
+
+	{
+		std::ifstream header(edfPath.string(), ios_base::binary);
+		string annotationSpr(8, ' ');
+		header.seekg(256 + 216*2 + 8);
+		header.read(&annotationSpr[0], 8);
+		EXPECT_EQ(annotationSpr, "30      ");
+
+		EDF saved(edfPath.string(), EDF::Annotations::OnLoad);
+		DataModel savedModel(new EventTypeTable(), new MontageTable());
+		saved.setDataModel(&savedModel);
+		saved.load();
+
+		AbstractEventTable* savedEvents = savedModel.montageTable()->eventTable(0);
+		ASSERT_EQ(savedEvents->rowCount(), 4);
+
+		vector<int> positions;
+		for (int i = 0; i < 4; i++)
+			positions.push_back(savedEvents->row(i).position);
+		sort(positions.begin(), positions.end());
+
+		EXPECT_EQ(positions, vector<int>({22, 25, 35, 38}));
+	}
+
+	for (const char* e : {"", ".backup", ".mont"})
+		remove(edfPath.string() + e);
+}
+
+TEST_F(primary_file_test, EDF_comma_locale)
+{
+	using namespace boost::filesystem;
+
+	// Applications like Qt ones set the locale of the user, where the decimal separator can be a comma.
+	string oldLocale = setlocale(LC_NUMERIC, nullptr);
+	bool commaLocale = false;
+
+	for (const char* e : {"de_DE.UTF-8", "de_DE.utf8", "cs_CZ.UTF-8", "cs_CZ.utf8", "fr_FR.UTF-8", "fr_FR.utf8", "German"})
+	{
+		if (setlocale(LC_NUMERIC, e) && localeconv()->decimal_point[0] == ',')
+		{
+			commaLocale = true;
+			break;
+		}
+	}
+
+	if (!commaLocale)
+	{
+		setlocale(LC_NUMERIC, oldLocale.c_str());
+		GTEST_SKIP() << "No locale with a decimal comma is installed.";
+	}
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(sourcePath.string(), 1, 10);
+
+	// The physical range is [-3276.8, 3276.7], so sample j is -0.1*j.
+	{
+		std::fstream file(sourcePath.string(), ios_base::binary | ios_base::in | ios_base::out);
+		file.seekp(256 + 104);
+		file << "-3276.8 " "3276.7  ";
+	}
+
+	{
+		EDF file(sourcePath.string());
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		vector<double> data(100);
+		file.readSignal(data.data(), 0, 99);
+
+		for (int j = 0; j < 100; j++)
+			EXPECT_NEAR(data[j], -0.1*j, 1e-9) << "j = " << j;
+
+		EDF::saveAs(edfPath.string(), &file);
+	}
+
+	{
+		// The header of the export holds the signal and the annotation signal.
+		std::ifstream header(edfPath.string(), ios_base::binary);
+		string physicalRange(32, ' ');
+		header.seekg(256 + 104*2);
+		header.read(&physicalRange[0], 32);
+		EXPECT_EQ(physicalRange, "-3276.8 -1      3276.7  1       ");
+
+		EDF file(edfPath.string());
+		vector<double> data(100);
+		file.readSignal(data.data(), 0, 99);
+
+		for (int j = 0; j < 100; j++)
+			EXPECT_NEAR(data[j], -0.1*j, 1e-9) << "j = " << j;
+	}
+
+	setlocale(LC_NUMERIC, oldLocale.c_str());
+
+	remove(sourcePath);
+	remove(edfPath);
+}
+
+// An EDF file that reads another file on the same thread in readChannels(),
+// like a file derived from a source file would.
+class NestedReadEdf : public EDF
+{
+public:
+	NestedReadEdf(const string& filePath, DataFile* source) : EDF(filePath), source(source) {}
+
+	using EDF::readChannels;
+	virtual void readChannels(const vector<double*>& dataChannels, uint64_t firstSample, uint64_t lastSample) override
+	{
+		vector<double> data(source->getChannelCount()*10);
+		source->readSignal(data.data(), 0, 9);
+		EDF::readChannels(dataChannels, firstSample, lastSample);
+	}
+
+private:
+	DataFile* source;
+};
+
+TEST_F(primary_file_test, nestedReads)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(sourcePath.string(), 3, 10);
+	writeWideEdf(edfPath.string(), 20, 10);
+
+	{
+		EDF source(sourcePath.string());
+		NestedReadEdf file(edfPath.string(), &source);
+
+		vector<double> data(20*50);
+		file.readSignal(data.data(), 25, 74);
+
+		for (int c = 0; c < 20; c++)
+		{
+			for (int j = 0; j < 50; j++)
+				ASSERT_EQ(data[c*50 + j], c - j - 25) << "c = " << c << ", j = " << j;
+		}
+	}
+
+	remove(sourcePath);
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, EDF_mixed_rates)
+{
+	using namespace boost::filesystem;
+
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeMixedRateEdf(edfPath.string(), 2);
+
+	{
+		EDF file(edfPath.string());
+		ASSERT_EQ(file.getChannelCount(), 2u);
+		ASSERT_EQ(file.getSamplesRecorded(), 20u);
+
+		// The slow signal has only 6 samples; the rest of it reads as zeros.
+		vector<double> data(2*20, -1);
+		file.readSignal(data.data(), 0, 19);
+
+		for (int j = 0; j < 20; j++)
+		{
+			EXPECT_EQ(data[j], j);
+			EXPECT_EQ(data[20 + j], j < 6 ? 100 + j : 0) << "j = " << j;
+		}
+
+		// The last samples read the whole last record.
+		vector<double> last(2*5, -1);
+		file.readSignal(last.data(), 15, 19);
+
+		for (int j = 0; j < 5; j++)
+		{
+			EXPECT_EQ(last[j], 15 + j);
+			EXPECT_EQ(last[5 + j], 0);
+		}
+
+		// Only the slow signal is read one record at a time.
+		vector<double> slow(16, -1);
+		file.readSignal(slow.data(), {1}, 4, 19);
+
+		for (int j = 0; j < 16; j++)
+			EXPECT_EQ(slow[j], j < 2 ? 104 + j : 0) << "j = " << j;
+
+		file.readSignal(slow.data(), {1}, 10, 19);
+
+		for (int j = 0; j < 10; j++)
+			EXPECT_EQ(slow[j], 0);
+	}
+
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, EDF_many_channels)
+{
+	using namespace boost::filesystem;
+
+	const int channels = 2048;
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	path savedPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(edfPath.string(), channels, 2);
+
+	{
+		EDF file(edfPath.string());
+		ASSERT_EQ(file.getChannelCount(), static_cast<unsigned int>(channels));
+		ASSERT_EQ(file.getSamplesRecorded(), 20u);
+		EXPECT_EQ(file.getLabel(1500), "C1500");
+
+		vector<float> data(channels*15);
+		file.readSignal(data.data(), 3, 17);
+
+		for (int c = 0; c < channels; c++)
+		{
+			for (int j = 0; j < 15; j++)
+				ASSERT_EQ(data[c*15 + j], c - j - 3) << "c = " << c << ", j = " << j;
+		}
+
+		vector<double> subset(3*5);
+		file.readSignal(subset.data(), {2047, 0, 600}, 8, 12);
+		EXPECT_EQ(subset[0], 2047 - 8);
+		EXPECT_EQ(subset[5 + 4], -12);
+		EXPECT_EQ(subset[10 + 2], 600 - 10);
+
+		vector<float*> dataChannels(channels, data.data());
+		EXPECT_THROW(file.readChannels(dataChannels, 15, 20), invalid_argument);
+		dataChannels.pop_back();
+		EXPECT_THROW(file.readChannels(dataChannels, 0, 9), invalid_argument);
+
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		EDF::saveAs(savedPath.string(), &file);
+	}
+
+	EDF saved(savedPath.string());
+	ASSERT_EQ(saved.getChannelCount(), static_cast<unsigned int>(channels));
+	ASSERT_EQ(saved.getSamplesRecorded(), 20u);
+	EXPECT_EQ(saved.getLabel(channels - 1), "C2047");
+
+	vector<float> data(channels*20);
+	saved.readSignal(data.data(), 0, 19);
+
+	for (int c = 0; c < channels; c++)
+	{
+		for (int j = 0; j < 20; j++)
+			ASSERT_EQ(data[c*20 + j], c - j) << "c = " << c << ", j = " << j;
+	}
+
+	remove(edfPath);
+	remove(savedPath);
+}
+
+TEST_F(primary_file_test, EDF_save_during_async_reads)
+{
+	using namespace boost::filesystem;
+
+	const int channels = 4;
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(edfPath.string(), channels, 50);
+
+	{
+		EDF file(edfPath.string());
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		Montage montage = dataModel.montageTable()->row(0);
+		montage.save = true;
+		dataModel.montageTable()->row(0, montage);
+
+		// The file is replaced while the reads keep coming.
+		atomic<bool> done(false);
+		thread reader([&file, &done] ()
+		{
+			vector<float> buffer(channels*100);
+
+			while (!done)
+			{
+				try
+				{
+					file.readSignalAsync(buffer.data(), 0, 99).get();
+				}
+				catch (ReadCancelled&)
+				{
+				}
+			}
+		});
+
+		file.buildOverview(true);
+		file.save();
+		done = true;
+		reader.join();
+
+		// The asynchronous reads work again after the save.
+		vector<float> data(channels*20);
+		file.readSignalAsync(data.data(), 480, 499).get();
+
+		for (int c = 0; c < channels; c++)
+		{
+			for (int j = 0; j < 20; j++)
+				ASSERT_EQ(data[c*20 + j], c - j - 480) << "c = " << c << ", j = " << j;
+		}
+	}
+
+	for (const char* e : {"", ".backup", ".mont", ".overview"})
+		remove(edfPath.string() + e);
+}
+
+TEST_F(primary_file_test, EDF_export_during_cancelled_reads)
+{
+	using namespace boost::filesystem;
+
+	const int channels = 100;
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeWideEdf(sourcePath.string(), channels, 2000);
+
+	{
+		EDF source(sourcePath.string());
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		source.setDataModel(&dataModel);
+		source.load();
+
+		// A viewer keeps dropping its pending reads while the export runs.
+		atomic<bool> done(false);
+		thread viewer([&source, &done] ()
+		{
+			while (!done)
+				source.cancelAsyncReads(-2, -1);
+		});
+
+		EXPECT_NO_THROW(EDF::saveAs(edfPath.string(), &source));
+		done = true;
+		viewer.join();
+	}
+
+	{
+		EDF file(edfPath.string());
+		ASSERT_EQ(file.getSamplesRecorded(), 20000u);
+
+		vector<double> data(channels*20);
+		file.readSignal(data.data(), 19980, 19999);
+
+		for (int c = 0; c < channels; c++)
+		{
+			for (int j = 0; j < 20; j++)
+				ASSERT_EQ(data[c*20 + j], c - j - 19980) << "c = " << c << ", j = " << j;
+		}
+	}
+
+	remove(sourcePath);
+	remove(edfPath);
+}
+
+TEST_F(primary_file_test, EDF_save_lossless)
+{
+	using namespace boost::filesystem;
+
+	path sourcePath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.gdf");
+	path edfPath = unique_path(temp_directory_path().string() + "/%%%%_%%%%_%%%%_%%%%.edf");
+	writeMixedRateGdf(sourcePath.string(), 5);
+
+	{
+		GDF2 source(sourcePath.string());
+		DataModel sourceModel(new EventTypeTable(), new MontageTable());
+		source.setDataModel(&sourceModel);
+		source.load();
+		EDF::saveAs(edfPath.string(), &source);
+	}
+
+	auto readFile = [] (const path& filePath)
+	{
+		std::ifstream file(filePath.string(), ios_base::binary);
+		return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+	};
+
+	vector<double> signal;
+	const int eventCount = 500; // Too many for the original annotation signal.
+
+	{
+		EDF file(edfPath.string());
+		signal.resize(3*file.getSamplesRecorded());
+		file.readSignal(signal.data(), 0, file.getSamplesRecorded() - 1);
+
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		Montage montage = dataModel.montageTable()->row(0);
+		montage.save = true;
+		dataModel.montageTable()->row(0, montage);
+
+		dataModel.eventTypeTable()->insertRows(0);
+
+		AbstractEventTable* events = dataModel.montageTable()->eventTable(0);
+		events->insertRows(0, eventCount);
+		for (int i = 0; i < eventCount; i++)
+		{
+			Event e = events->row(i);
+			e.position = i%17;
+			e.duration = i%3 + 1;
+			e.channel = i%3 - 1;
+			e.type = 0;
+			e.label = to_string(i);
+			events->row(i, e);
+		}
+
+		file.save();
+	}
+
+	string saved = readFile(edfPath);
+
+	{
+		EDF file(edfPath.string(), EDF::Annotations::OnLoad);
+
+		// The samples were copied, so there is no requantization error.
+		vector<double> data(3*file.getSamplesRecorded());
+		file.readSignal(data.data(), 0, file.getSamplesRecorded() - 1);
+		EXPECT_EQ(data, signal);
+
+		DataModel dataModel(new EventTypeTable(), new MontageTable());
+		file.setDataModel(&dataModel);
+		file.load();
+
+		AbstractEventTable* events = dataModel.montageTable()->eventTable(0);
+		ASSERT_EQ(events->rowCount(), eventCount);
+
+		for (int i = 0; i < eventCount; i++)
+		{
+			Event e = events->row(i);
+			int j = stoi(e.label);
+			EXPECT_EQ(e.position, j%17);
+			EXPECT_EQ(e.duration, j%3 + 1);
+			EXPECT_EQ(e.channel, j%3 - 1);
+		}
+
+		Montage montage = dataModel.montageTable()->row(0);
+		montage.save = true;
+		dataModel.montageTable()->row(0, montage);
+
+		file.save();
+	}
+
+	// Saving the same events again gives the same file.
+	EXPECT_EQ(readFile(edfPath), saved);
+
+	remove(sourcePath);
+	remove(edfPath);
+	remove(edfPath.string() + ".backup");
+}
+
 // TODO: add a small edf file to test; like the gdf01
 
 // Tests of MAT. TODO: Split these tests into smaller test cases (by file type and/or test type).
@@ -0,0 +1,87 @@
+#include <gtest/gtest.h>
+
+#include "../src/sampleconversion.h"
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace std;
+using namespace AlenkaFile;
+
+namespace
+{
+
+template<class T>
+void decode(InstructionSet set, const char* raw, SampleType type, bool swapBytes, T* out, int n)
+{
+	setInstructionSet(set);
+	decodeSamples(raw, type, swapBytes, 0.37, -12.5, out, n);
+}
+
+// NaNs made from the random floats must match too, so the bits are compared.
+template<class T>
+bool sameBits(T a, T b)
+{
+	return memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+// Compares the vector kernels with the scalar ones on random, misaligned data
+// of every length up to a few vectors, so that all the tails are covered.
+template<class T>
+void compareKernels()
+{
+	mt19937 generator(42);
+	uniform_int_distribution<int> byte(0, 255);
+
+	const int maxLength = 70;
+	vector<char> raw(8*maxLength + 8);
+	for (char& e : raw)
+		e = static_cast<char>(byte(generator));
+
+	vector<T> expected(maxLength + 2), actual(maxLength + 2);
+	InstructionSet original = getInstructionSet();
+
+	for (int type = 0; type < static_cast<int>(SampleType::size); ++type)
+	{
+		for (bool swapBytes : {false, true})
+		{
+			for (int n = 0; n <= maxLength; ++n)
+			{
+				const char* input = raw.data() + 1 + n%7;
+
+				decode(InstructionSet::Scalar, input, static_cast<SampleType>(type), swapBytes, expected.data() + 1, n);
+
+				for (InstructionSet set : {InstructionSet::SSE41, InstructionSet::AVX2})
+				{
+					fill(actual.begin(), actual.end(), T(0));
+					decode(set, input, static_cast<SampleType>(type), swapBytes, actual.data() + 1, n);
+
+					for (int i = 1; i <= n; ++i)
+					{
+						ASSERT_TRUE(sameBits(expected[i], actual[i])) << "type = " << type << ", swapBytes = " << swapBytes
+							<< ", n = " << n << ", i = " << i - 1 << ", set = " << static_cast<int>(getInstructionSet());
+					}
+
+					// Nothing outside the output is written.
+					ASSERT_EQ(actual[0], T(0));
+					ASSERT_EQ(actual[n + 1], T(0));
+				}
+			}
+		}
+	}
+
+	setInstructionSet(original);
+}
+
+} // namespace
+
+TEST(sampleconversion_test, float_kernels)
+{
+	compareKernels<float>();
+}
+
+TEST(sampleconversion_test, double_kernels)
+{
+	compareKernels<double>();
+}
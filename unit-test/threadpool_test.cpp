@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+
+#include <AlenkaFile/threadpool.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+using namespace AlenkaFile;
+
+TEST(threadpool_test, allIterations)
+{
+	ThreadPool pool(4);
+
+	for (int count : {0, 1, 3, 1000})
+	{
+		vector<atomic<int>> visited(count);
+		for (auto& e : visited)
+			e = 0;
+
+		pool.parallelFor(count, [&visited] (int i) { ++visited[i]; });
+
+		for (auto& e : visited)
+			EXPECT_EQ(e, 1);
+	}
+}
+
+TEST(threadpool_test, nested)
+{
+	ThreadPool pool(2);
+	atomic<int> sum(0);
+
+	pool.parallelFor(8, [&pool, &sum] (int)
+	{
+		pool.parallelFor(8, [&sum] (int j) { sum += j; });
+	});
+
+	EXPECT_EQ(sum, 8*28);
+}
+
+TEST(threadpool_test, exception)
+{
+	ThreadPool pool(2);
+	atomic<int> calls(0);
+
+	EXPECT_THROW(pool.parallelFor(100, [&calls] (int i)
+	{
+		++calls;
+		if (i == 50)
+			throw runtime_error("test");
+	}), runtime_error);
+
+	EXPECT_EQ(calls, 100);
+}